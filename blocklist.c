@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "blocklist.h"
+#include "reply_codes.h"
+#include "constants.h"
+
+#define BLOCKLIST_MAGIC 0x314b4c42 /* "BLK1" */
+
+/* Header of the file written by blocklist_write(), followed by each zone: the
+ * length of its reply, the reply and its ip_list.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t nzones;
+} blocklist_header_t;
+
+static int set_reply (blocklist_zone_t *zone, const char *filename, const char *value);
+static int load_zone (ip_list_t *ip_list, const char *filename);
+static int write_all (int fd, const void *data, size_t len);
+
+void blocklist_init (blocklist_t *blocklist)
+{
+	blocklist->zones = NULL;
+	blocklist->nzones = 0;
+}
+
+void blocklist_free (blocklist_t *blocklist)
+{
+	size_t i;
+
+	if (blocklist->zones) {
+		for (i = 0; i < blocklist->nzones; i++) {
+			if (blocklist->zones[i].reply) {
+				free (blocklist->zones[i].reply);
+			}
+
+			ip_list_free (&blocklist->zones[i].ip_list);
+		}
+
+		free (blocklist->zones);
+		blocklist->zones = NULL;
+	}
+
+	blocklist->nzones = 0;
+}
+
+int blocklist_load (blocklist_t *blocklist, configuration_t *conf)
+{
+	blocklist_zone_t *zone;
+	const char *filename;
+	ssize_t count;
+	size_t i;
+	int ret;
+
+	blocklist_free (blocklist);
+
+	if ((count = configuration_get_count (conf, "General", "Blocklists", NULL)) <= 0) {
+		return 0;
+	}
+
+	blocklist->zones = (blocklist_zone_t *) calloc (count, sizeof (blocklist_zone_t));
+	if (!blocklist->zones) {
+		fprintf (stderr, "[blocklist_load] Couldn't allocate memory.\n");
+		return -1;
+	}
+
+	for (i = 0; ((filename = configuration_get_child (conf, i, "General", "Blocklists", NULL)) != NULL); i++) {
+		zone = &(blocklist->zones[blocklist->nzones]);
+		ip_list_init (&zone->ip_list);
+
+		if (set_reply (zone, filename, configuration_get_value (conf, "General", "Blocklists", filename, NULL)) < 0) {
+			fprintf (stderr, "[blocklist_load] Couldn't allocate memory.\n");
+			blocklist_free (blocklist);
+			return -1;
+		}
+
+		/* Count the zone now, so that blocklist_free() releases it. */
+		blocklist->nzones++;
+
+		if ((ret = load_zone (&zone->ip_list, filename)) < 0) {
+			if (ret == -1) {
+				/* Go on without this zone. */
+				fprintf (stderr, "Couldn't load blocklist %s.\n", filename);
+
+				free (zone->reply);
+				ip_list_free (&zone->ip_list);
+				blocklist->nzones--;
+
+				continue;
+			}
+
+			/* Couldn't allocate memory. */
+			fprintf (stderr, "[blocklist_load] Couldn't allocate memory.\n");
+			blocklist_free (blocklist);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int set_reply (blocklist_zone_t *zone, const char *filename, const char *value)
+{
+	size_t len;
+
+	/* "<4xx or 5xx> <text>". */
+	if ((value) && (*value) && ((value[0] == '4') || (value[0] == '5')) && (value[1] >= '0') && (value[1] <= '9') && (value[2] >= '0') && (value[2] <= '9') && ((value[3] == ' ') || (!value[3]))) {
+		len = strlen (value);
+		if (len <= TEXT_LINE_MAXLEN - 2) {
+			zone->reply = (char *) malloc (len + 3);
+			if (!zone->reply) {
+				return -1;
+			}
+
+			memcpy (zone->reply, value, len);
+			memcpy (zone->reply + len, "\r\n", 3);
+
+			return 0;
+		}
+	}
+
+	if ((value) && (*value)) {
+		fprintf (stderr, "Invalid reply for blocklist %s, using: %s", filename, CLIENT_BLOCKED);
+	}
+
+	zone->reply = strdup (CLIENT_BLOCKED);
+	if (!zone->reply) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int load_zone (ip_list_t *ip_list, const char *filename)
+{
+	static const char *zeros[] = {".0.0.0", ".0.0", ".0"};
+	static const char *lengths[] = {"/8", "/16", "/24"};
+	char line[TEXT_LINE_MAXLEN + 1];
+	char entry[INET6_ADDRSTRLEN + 8];
+	char prefix[INET6_ADDRSTRLEN + 8];
+	FILE *file;
+	const char *ptr;
+	const char *separator;
+	const char *slash;
+	unsigned long nline;
+	uint32_t value;
+	size_t len;
+	size_t addrlen;
+	size_t dots;
+	size_t i;
+	int c;
+	int ret;
+
+	file = fopen (filename, "r");
+	if (!file) {
+		return -1;
+	}
+
+	nline = 0;
+
+	while (fgets (line, sizeof (line), file)) {
+		nline++;
+
+		/* Skip the rest of a line too long. */
+		if ((!strchr (line, '\n')) && (!feof (file))) {
+			while (((c = getc (file)) != EOF) && (c != '\n'));
+		}
+
+		for (ptr = line; (*ptr == ' ') || (*ptr == '\t'); ptr++);
+
+		/* Blank lines, comments, directives and default A/TXT values. */
+		if ((!*ptr) || (*ptr == '\n') || (*ptr == '\r') || (*ptr == '#') || (*ptr == ';') || (*ptr == '$') || (*ptr == ':')) {
+			continue;
+		}
+
+		if (*ptr == '!') {
+			value = BLOCKLIST_EXCLUDED;
+			ptr++;
+		} else {
+			value = BLOCKLIST_LISTED;
+		}
+
+		/* The entry ends at the first blank, or at the first ':' after an
+		 * IPv4 address (the A/TXT values of the entry follow).
+		 */
+		separator = strpbrk (ptr, ".: \t\r\n");
+		if ((!separator) || (*separator != ':')) {
+			len = strcspn (ptr, ": \t\r\n");
+		} else {
+			len = strcspn (ptr, " \t\r\n");
+		}
+
+		if ((len == 0) || (len >= sizeof (entry))) {
+			fprintf (stderr, "Ignoring line %lu of blocklist %s.\n", nline, filename);
+			continue;
+		}
+
+		memcpy (entry, ptr, len);
+		entry[len] = 0;
+
+		/* IPv4 addresses may be shortened: "10.1" is 10.1.0.0/16. */
+		if ((!separator) || (*separator != ':')) {
+			slash = strchr (entry, '/');
+			addrlen = (slash) ? (size_t) (slash - entry) : len;
+
+			for (i = 0, dots = 0; i < addrlen; i++) {
+				if (entry[i] == '.') {
+					dots++;
+				}
+			}
+
+			if (dots < 3) {
+				snprintf (prefix, sizeof (prefix), "%.*s%s%s", (int) addrlen, entry, zeros[dots], (slash) ? slash : lengths[dots]);
+				ptr = prefix;
+			} else {
+				ptr = entry;
+			}
+		} else {
+			ptr = entry;
+		}
+
+		if ((ret = ip_list_insert (ip_list, ptr, value)) < 0) {
+			if (ret == -1) {
+				fprintf (stderr, "Ignoring line %lu of blocklist %s.\n", nline, filename);
+				continue;
+			}
+
+			/* Couldn't allocate memory. */
+			fclose (file);
+			return -2;
+		}
+	}
+
+	if (ferror (file)) {
+		fclose (file);
+		return -1;
+	}
+
+	fclose (file);
+
+	if (ip_list_build (ip_list) < 0) {
+		return -2;
+	}
+
+	return 0;
+}
+
+const char *blocklist_lookup (blocklist_t *blocklist, uint32_t ip)
+{
+	size_t i;
+
+	for (i = 0; i < blocklist->nzones; i++) {
+		if (ip_list_lookup (&blocklist->zones[i].ip_list, ip) == BLOCKLIST_LISTED) {
+			return blocklist->zones[i].reply;
+		}
+	}
+
+	return NULL;
+}
+
+int blocklist_write (blocklist_t *blocklist, int fd)
+{
+	blocklist_header_t header;
+	uint32_t len;
+	size_t i;
+
+	header.magic = BLOCKLIST_MAGIC;
+	header.nzones = blocklist->nzones;
+
+	if (write_all (fd, &header, sizeof (header)) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < blocklist->nzones; i++) {
+		len = strlen (blocklist->zones[i].reply);
+
+		if ((write_all (fd, &len, sizeof (len)) < 0) || (write_all (fd, blocklist->zones[i].reply, len) < 0) || (ip_list_write (&blocklist->zones[i].ip_list, fd) < 0)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int blocklist_read (blocklist_t *blocklist, int fd)
+{
+	blocklist_header_t header;
+	blocklist_zone_t *zone;
+	off_t offset;
+	uint32_t len;
+	size_t i;
+
+	blocklist_free (blocklist);
+
+	if ((pread (fd, &header, sizeof (header), 0) != sizeof (header)) || (header.magic != BLOCKLIST_MAGIC)) {
+		return -1;
+	}
+
+	if (header.nzones == 0) {
+		return 0;
+	}
+
+	blocklist->zones = (blocklist_zone_t *) calloc (header.nzones, sizeof (blocklist_zone_t));
+	if (!blocklist->zones) {
+		return -1;
+	}
+
+	offset = sizeof (header);
+
+	for (i = 0; i < header.nzones; i++) {
+		zone = &(blocklist->zones[i]);
+		ip_list_init (&zone->ip_list);
+		blocklist->nzones++;
+
+		if ((pread (fd, &len, sizeof (len), offset) != sizeof (len)) || (len == 0) || (len > TEXT_LINE_MAXLEN)) {
+			blocklist_free (blocklist);
+			return -1;
+		}
+
+		offset += sizeof (len);
+
+		zone->reply = (char *) malloc (len + 1);
+		if ((!zone->reply) || (pread (fd, zone->reply, len, offset) != (ssize_t) len)) {
+			blocklist_free (blocklist);
+			return -1;
+		}
+
+		zone->reply[len] = 0;
+		offset += len;
+
+		if (ip_list_read (&zone->ip_list, fd, &offset) < 0) {
+			blocklist_free (blocklist);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int write_all (int fd, const void *data, size_t len)
+{
+	const char *ptr;
+	ssize_t bytes;
+
+	ptr = (const char *) data;
+
+	while (len > 0) {
+		if ((bytes = write (fd, ptr, len)) < 0) {
+			return -1;
+		}
+
+		ptr += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "configuration.h"
+#include "ip_list.h"
+
+/* Local copies of DNS blocklists (RBL zone files, e.g. mirrored with rsync),
+ * checked when a client connects, instead of querying the DNS.
+ * Each zone is compiled into its own ip_list (longest prefix match), so a
+ * lookup costs one trie walk per zone. A zone lists prefixes and may exclude
+ * parts of them ("!<ip>[/<length>]"): the longest match decides.
+ */
+
+/* Values in the ip_lists (an exclusion wins over the same prefix listed). */
+#define BLOCKLIST_LISTED   1
+#define BLOCKLIST_EXCLUDED 2
+
+typedef struct {
+	char *reply; /* Reply sent to the listed clients ("<code> <text>\r\n"). */
+	ip_list_t ip_list;
+} blocklist_zone_t;
+
+typedef struct {
+	blocklist_zone_t *zones;
+	size_t nzones;
+} blocklist_t;
+
+void blocklist_init (blocklist_t *blocklist);
+void blocklist_free (blocklist_t *blocklist);
+
+/* Blocklists: "<zone file> = <reply>". */
+int blocklist_load (blocklist_t *blocklist, configuration_t *conf);
+
+/* Reply of the first zone listing the IP (host byte order), NULL if none. */
+const char *blocklist_lookup (blocklist_t *blocklist, uint32_t ip);
+
+/* Copy the compiled zones to / from a file (passed between processes). */
+int blocklist_write (blocklist_t *blocklist, int fd);
+int blocklist_read (blocklist_t *blocklist, int fd);
+
+#endif /* BLOCKLIST_H */
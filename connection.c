@@ -14,7 +14,7 @@ int connection_init (connection_t *connection, size_t buffer_size)
 	connection->index = -1;
 
 	connection->sd = -1;
-	connection->fd = -1;
+	spool_file_init (&connection->spool_file);
 
 	input_stream = &connection->input_stream;
 
@@ -34,6 +34,7 @@ int connection_init (connection_t *connection, size_t buffer_size)
 	input_stream->end_of_file = 0;
 	input_stream->error = 0;
 
+	connection->nreplies = 0;
 	buffer_init (&connection->output, 1024);
 
 	connection->state = INITIAL_STATE;
@@ -47,6 +48,8 @@ int connection_init (connection_t *connection, size_t buffer_size)
 
 	connection->last_read_write = 0;
 
+	connection->pipelined = 0;
+
 	connection->quit = 0;
 
 	return 0;
@@ -60,9 +63,7 @@ void connection_free (connection_t *connection)
 	}
 
 	/* Close file descriptor. */
-	if (connection->fd != -1) {
-		close (connection->fd);
-	}
+	spool_file_abort (&connection->spool_file);
 
 	if (connection->input_stream.buf_base) {
 		free (connection->input_stream.buf_base);
@@ -77,7 +78,6 @@ void connection_free (connection_t *connection)
 void connection_reset (connection_t *connection)
 {
 	input_stream_t *input_stream;
-	char filename[PATH_MAX + 1];
 
 	connection->index = -1;
 
@@ -87,14 +87,8 @@ void connection_reset (connection_t *connection)
 		connection->sd = -1;
 	}
 
-	/* Close file descriptor. */
-	if (connection->fd != -1) {
-		close (connection->fd);
-		connection->fd = -1;
-
-		snprintf (filename, sizeof (filename), "%s/%lu-%u.eml", server.incoming_directory, connection->file_timestamp, connection->nfile);
-		unlink (filename);
-	}
+	/* Close and remove file. */
+	spool_file_abort (&connection->spool_file);
 
 	input_stream = &connection->input_stream;
 
@@ -106,6 +100,7 @@ void connection_reset (connection_t *connection)
 	input_stream->end_of_file = 0;
 	input_stream->error = 0;
 
+	connection->nreplies = 0;
 	if (connection->output.size > connection->output.buffer_increment) {
 		buffer_free (&connection->output);
 	}
@@ -126,5 +121,52 @@ void connection_reset (connection_t *connection)
 
 	connection->last_read_write = 0;
 
+	connection->pipelined = 0;
+
 	connection->quit = 0;
 }
+
+int connection_reply (connection_t *connection, const char *reply, size_t len)
+{
+	struct iovec *iov;
+
+	if (connection->nreplies == MAX_PIPELINED_REPLIES) {
+		return -1;
+	}
+
+	iov = &(connection->replies[connection->nreplies++]);
+	iov->iov_base = (void *) reply;
+	iov->iov_len = len;
+
+	return 0;
+}
+
+int connection_reply_copy (connection_t *connection, const char *reply, size_t len)
+{
+	struct iovec *iov;
+
+	/* Right after the previous copy? */
+	if ((connection->nreplies > 0) && (!connection->replies[connection->nreplies - 1].iov_base)) {
+		iov = &(connection->replies[connection->nreplies - 1]);
+	} else if (connection->nreplies < MAX_PIPELINED_REPLIES) {
+		iov = &(connection->replies[connection->nreplies++]);
+		iov->iov_base = NULL;
+		iov->iov_len = 0;
+	} else {
+		return -1;
+	}
+
+	if (buffer_append_size_bounded_string (&connection->output, reply, len) < 0) {
+		return -1;
+	}
+
+	iov->iov_len += len;
+
+	return 0;
+}
+
+void connection_reset_replies (connection_t *connection)
+{
+	connection->nreplies = 0;
+	buffer_reset (&connection->output);
+}
@@ -2,10 +2,12 @@
 #define CONNECTION_H
 
 #include <time.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include "input_stream.h"
 #include "mail_transaction.h"
 #include "buffer.h"
+#include "spool.h"
 
 typedef enum {
 	INITIAL_STATE,
@@ -15,20 +17,27 @@ typedef enum {
 	BDAT_STATE,
 	DISCARDING_COMMAND_LINE,
 	DISCARDING_DATA,
-	DISCARDING_BDAT
+	DISCARDING_BDAT,
+	COMMITTING_STATE /* Waiting for the message to be flushed to disk. */
 } eSmtpConnectionState;
 
 typedef struct {
 	int index; /* Position of connection in index array. */
 
 	int sd; /* Socket descriptor. */
-	int fd; /* File descriptor. */
+	spool_file_t spool_file; /* Message being received. */
 
 	struct sockaddr_in sin;
 
 	input_stream_t input_stream;
 	char input[TEXT_LINE_MAXLEN + 1];
 
+	/* Replies to be sent, with a single writev(): strings which don't change
+	 * while they are queued (not copied) and, where iov_base is NULL, the next
+	 * iov_len bytes of "output".
+	 */
+	struct iovec replies[MAX_PIPELINED_REPLIES];
+	size_t nreplies;
 	buffer_t output;
 
 	eSmtpConnectionState state;
@@ -42,14 +51,13 @@ typedef struct {
 
 	time_t last_read_write; /* Time at which the client got connected or last time we got data from him or sent data to him. */
 
-	time_t file_timestamp;
-	unsigned nfile;
-
 	size_t filesize;
 
 	size_t chunk_size;
 	char last;
 
+	char pipelined; /* May the reply wait for the replies to the next commands? */
+
 	char quit;
 } connection_t;
 
@@ -58,4 +66,13 @@ void connection_free (connection_t *connection);
 
 void connection_reset (connection_t *connection);
 
+/* Queue a reply which stays valid until it has been sent (e.g. from reply_codes.h). */
+int connection_reply (connection_t *connection, const char *reply, size_t len);
+
+/* Queue a copy of a reply (or of a part of it). */
+int connection_reply_copy (connection_t *connection, const char *reply, size_t len);
+
+/* Forget the replies (they have been sent). */
+void connection_reset_replies (connection_t *connection);
+
 #endif /* CONNECTION_H */
@@ -1,6 +1,8 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
+#define CONFIG_FILE       "SmtpServer.conf"
+
 #define LOCAL_PART_MAXLEN 64
 #define DOMAIN_MAXLEN     255
 #define PATH_MAXLEN       256
@@ -9,6 +11,23 @@
 #define MAX_MESSAGE_SIZE  (100 * 1024 * 1024)
 #define MAX_TRANSACTIONS  100
 
+#define MIN_FREE_DISK_SPACE (16 * 1024 * 1024)
+
+#define MEMORY_SPOOL_SIZE         (64 * 1024 * 1024)
+#define MEMORY_SPOOL_MESSAGE_SIZE (32 * 1024)
+
+#define DIRECT_DELIVERY_SIZE           0 /* Disabled. */
+#define DIRECT_DELIVERY_MAX_RECIPIENTS 16
+
+#define DELIVERY_WORKERS     4
+#define MAX_DELIVERY_WORKERS 64
+
+#define COMMIT_LATENCY     5 /* milliseconds. */
+#define MAX_COMMIT_LATENCY 1000
+
 #define TEXT_LINE_MAXLEN  1024
 
+/* Replies held back for the commands of a group (PIPELINING). */
+#define MAX_PIPELINED_REPLIES 32
+
 #endif /* CONSTANTS_H */
@@ -3,17 +3,38 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include "delivery.h"
 #include "server.h"
 #include "configuration.h"
-#include "parser.h"
 #include "switch_to_user.h"
 #include "relay.h"
+#include "handoff.h"
+#include "fanout.h"
+#include "envelope.h"
+#include "spool_directory.h"
+#include "journal.h"
+#include "mailbox.h"
+#include "lmtp.h"
+
+#define DELIVER_EVERY     5 /* seconds (check whether the receiver is alive). */
+#define COMMIT_EVERY      64 /* messages (group commit). */
+#define SCAN_BATCH        256 /* messages delivered per call to deliver(). */
+
+#define RETRY_INTERVAL     60 /* seconds (doubled after each attempt). */
+#define RETRY_MAX_INTERVAL 3600 /* seconds. */
+#define RETRY_MAX_ATTEMPTS 30 /* Then the message goes to the error directory. */
+#define RETRY_QUEUE_SIZE   1024 /* messages waiting for another attempt (per worker). */
 
-#define DELIVER_EVERY     5 /* seconds. */
 #define MESSAGE_EXTENSION ".eml"
 
 extern server_t server;
@@ -22,20 +43,84 @@ extern configuration_t mime_types;
 
 static void stop (int nsignal);
 static void handle_sigusr1 (int nsignal);
+static void upgrade_spool (const char *directory);
 
-static int deliver (void);
-static int deliver_mail (const char *path, const char *filename);
-static int read_pre_header (input_stream_t *input_stream, mail_transaction_t *delivery, mail_transaction_t *relay);
+/* Do we have to scan the received directory? */
+static volatile sig_atomic_t got_mail = 0;
+
+/* Scan of the received directory (it goes on where it stopped). */
+static spool_scan_t scan;
+static int scanning = 0;
+
+/* Do we have to look for queued messages in the journal? */
+static int recover = 0;
+
+/* Are local recipients handed to the LMTP server? */
+static int lmtp = 0;
+
+/* Has the receiver opened the mailboxes for direct delivery? */
+static int direct = 0;
+
+/* Has the single-instance store file been created with O_TMPFILE? */
+static int store_tmpfile_supported = 1;
+static int store_anonymous = 0;
+
+/* Worker number (0: the delivery process itself) and pids of the other workers. */
+static unsigned worker = 0;
+static pid_t *workers = NULL;
+
+/* Delivered messages waiting to be committed before being removed
+ * (we keep them open and locked, so no other worker takes them).
+ */
+static char delivered[COMMIT_EVERY][NAME_MAX + 1];
+static int delivered_fd[COMMIT_EVERY];
+static size_t ndelivered = 0;
 
-static int open_files (size_t nfds, int *fd_vector, mail_transaction_t *delivery, mail_transaction_t *relay, const char *filename);
-static void close_and_remove_files (size_t nfds, int *fd_vector, mail_transaction_t *delivery, mail_transaction_t *relay, const char *filename);
+/* Messages with deferred recipients, they stay in the received directory
+ * until it is time for another attempt.
+ */
+typedef struct {
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	time_t time;
+} retry_t;
 
-static int write_relay_pre_header (int fd, const char *reverse_path, mail_transaction_t *relay);
-static int copy_file_to_recipients (input_stream_t *input_stream, size_t nfds, int *fd_vector);
+static retry_t retries[RETRY_QUEUE_SIZE];
+static size_t nretries = 0;
+
+/* If the retry queue was full: when to look for the messages left out. */
+static time_t retry_rescan = 0;
+
+static int create_workers (void);
+static int deliver (void);
+static int deliver_pending (void);
+static void deliver_queued (void);
+static void deliver_file (const char *filename);
+static void deliver_retries (void);
+static void schedule_retry (const char *filename, time_t time);
+static time_t retry_interval (unsigned attempts);
+static int commit_deliveries (void);
+static int sync_copies (void);
+static int receive_messages (void);
+static void save_message (int fd, const char *filename);
+static int requeue_message (int fd, const char *filename, time_t time);
+static int copy_message (int fd, const char *path);
+static int deliver_mail (int fd, const char *filename, time_t *retry);
+
+static void open_files (size_t nfds, int *fd_vector, envelope_t *envelope, int relay, const char *filename, int single_instance);
+static void copy_to_files (int fd, off_t offset, size_t nfds, int *fd_vector, int relay, off_t relay_start);
+
+static void publish_to_mailboxes (int *fd_vector, envelope_t *envelope, const char *filename);
+static size_t change_state (envelope_t *envelope, uint32_t flags, unsigned from, unsigned to);
+
+static int open_store_file (const char *filename);
+static void link_to_mailboxes (int fd, envelope_t *envelope, const char *filename);
+
+static ssize_t write_relay_envelope (int fd, envelope_t *envelope);
 
 void deliver_loop (void)
 {
 	struct sigaction act;
+	struct pollfd pfd[2];
 
 	/* Am I root? */
 	if ((getuid () == 0) || (geteuid () == 0)) {
@@ -59,6 +144,26 @@ void deliver_loop (void)
 		}
 	}
 
+	/* The receiver creates the shards too, but we might get there first. */
+	if ((spool_directory_create (server.received_directory) < 0) || (spool_directory_create (server.relay_directory) < 0) || (spool_directory_create (server.error_directory) < 0)) {
+		domainlist_free (&server.domainlist);
+
+		configuration_free (&conf);
+		configuration_free (&mime_types);
+
+		exit (-1);
+	}
+
+	/* Move the messages queued by a previous version into their shards, then
+	 * convert their envelopes (before the relay process starts).
+	 */
+	spool_directory_migrate (server.received_directory);
+	spool_directory_migrate (server.relay_directory);
+	spool_directory_migrate (server.error_directory);
+
+	upgrade_spool (server.received_directory);
+	upgrade_spool (server.relay_directory);
+
 	/* Create relay process. */
 	if ((server.relay_pid = fork ()) < 0) {
 		perror ("fork");
@@ -87,14 +192,136 @@ void deliver_loop (void)
 	act.sa_handler = handle_sigusr1;
 	sigaction (SIGUSR1, &act, NULL);
 
+	/* The domains are reloaded by the receiver. */
+	act.sa_handler = SIG_IGN;
+	sigaction (SIGHUP, &act, NULL);
+
+	/* Create the other delivery workers. */
+	if (create_workers () < 0) {
+		waitpid (server.relay_pid, NULL, 0);
+
+		domainlist_free (&server.domainlist);
+
+		configuration_free (&conf);
+		configuration_free (&mime_types);
+
+		exit (-1);
+	}
+
+	if (spool_scan_init (&scan, server.received_directory) < 0) {
+		spool_scan_free (&scan);
+
+		domainlist_free (&server.domainlist);
+
+		configuration_free (&conf);
+		configuration_free (&mime_types);
+
+		fprintf (stderr, "Couldn't allocate memory for scanning the received directory.\n");
+		exit (-1);
+	}
+
+	/* Each worker keeps its own cache of open mailboxes. */
+	if (mailbox_init (server.domains_directory, server.mailbox_format) < 0) {
+		spool_scan_free (&scan);
+
+		domainlist_free (&server.domainlist);
+
+		configuration_free (&conf);
+		configuration_free (&mime_types);
+
+		fprintf (stderr, "Couldn't open domains directory %s.\n", server.domains_directory);
+		exit (-1);
+	}
+
+	if ((server.lmtp_server) && (*server.lmtp_server)) {
+		if (lmtp_init (server.lmtp_server, server.lmtp_port) < 0) {
+			mailbox_free ();
+			spool_scan_free (&scan);
+
+			domainlist_free (&server.domainlist);
+
+			configuration_free (&conf);
+			configuration_free (&mime_types);
+
+			fprintf (stderr, "Couldn't resolve LMTP server %s.\n", server.lmtp_server);
+			exit (-1);
+		}
+
+		lmtp = 1;
+	}
+
 	server.running = 1;
 
+	/* The first worker delivers the messages left in the queue: it finds
+	 * them in the journal (and, if asked to, checks the received directory).
+	 */
+	if (worker == 0) {
+		recover = server.queue_journal;
+		got_mail = ((!server.queue_journal) || (server.queue_check));
+	}
+
 	do {
-		if (deliver () < 0) {
-			break;
+		/* Messages which didn't fit in the ring are found in the journal
+		 * or, without a journal, scanning the received directory.
+		 */
+		if (handoff_overflowed ()) {
+			if (server.queue_journal) {
+				recover = 1;
+			} else {
+				got_mail = 1;
+			}
+		}
+
+		if (recover) {
+			recover = 0;
+
+			/* If the journal can't be read, fall back to scanning. */
+			if (deliver_pending () < 0) {
+				got_mail = 1;
+			}
+		}
+
+		/* The received directory is scanned when we are asked to (SIGUSR1). */
+		if (got_mail) {
+			got_mail = 0;
+
+			spool_scan_start (&scan);
+			scanning = 1;
+		}
+
+		/* Scan a batch of messages (in between, we serve the receiver). */
+		if (scanning) {
+			scanning = deliver ();
 		}
 
-		sleep (DELIVER_EVERY);
+		/* Deliver the messages queued by the receiver. */
+		deliver_queued ();
+
+		/* Try the deferred recipients again. */
+		deliver_retries ();
+
+		if ((worker == 0) && (server.queue_journal)) {
+			journal_compact (JOURNAL_COMPACT_SIZE);
+		}
+
+		/* Wait for the receiver. */
+		pfd[0].fd = server.delivery_socket;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = handoff_fd ();
+		pfd[1].events = POLLIN;
+
+		if (poll (pfd, 2, scanning ? 0 : DELIVER_EVERY * 1000) > 0) {
+			if (pfd[0].revents) {
+				if (receive_messages () < 0) {
+					/* The receiver has gone away. */
+					break;
+				}
+			}
+
+			if (pfd[1].revents) {
+				handoff_clear ();
+			}
+		}
 
 		if (server.running) {
 			/* If the parent process is not alive... */
@@ -106,6 +333,13 @@ void deliver_loop (void)
 		}
 	} while (1);
 
+	if (lmtp) {
+		lmtp_free ();
+	}
+
+	mailbox_free ();
+	spool_scan_free (&scan);
+
 	domainlist_free (&server.domainlist);
 
 	configuration_free (&conf);
@@ -114,12 +348,127 @@ void deliver_loop (void)
 	exit (0);
 }
 
+int deliver_direct (int fd, const char *filename)
+{
+	time_t retry;
+	int copy;
+
+	/* Each process keeps its own cache of open mailboxes. */
+	if (!direct) {
+		if (mailbox_init (server.domains_directory, server.mailbox_format) < 0) {
+			return -1;
+		}
+
+		direct = 1;
+	}
+
+	/* deliver_mail() closes the file, the caller keeps it. */
+	if ((copy = dup (fd)) < 0) {
+		return -1;
+	}
+
+	return deliver_mail (copy, filename, &retry);
+}
+
+void deliver_direct_free (void)
+{
+	if (direct) {
+		mailbox_free ();
+		direct = 0;
+	}
+}
+
+int create_workers (void)
+{
+	pid_t pid;
+	unsigned i;
+
+	if (server.delivery_workers <= 1) {
+		return 0;
+	}
+
+	workers = (pid_t *) malloc (server.delivery_workers * sizeof (pid_t));
+	if (!workers) {
+		fprintf (stderr, "Couldn't allocate memory for delivery workers.\n");
+		return -1;
+	}
+
+	for (i = 1; i < server.delivery_workers; i++) {
+		if ((pid = fork ()) < 0) {
+			perror ("fork");
+
+			/* Go on with the workers we have. */
+			break;
+		}
+
+		/* If I am a new worker... */
+		if (pid == 0) {
+			worker = i;
+
+			free (workers);
+			workers = NULL;
+
+			return 0;
+		}
+
+		workers[i] = pid;
+	}
+
+	server.delivery_workers = i;
+
+	return 0;
+}
+
+void upgrade_spool (const char *directory)
+{
+	spool_scan_t upgrade_scan;
+	char path[PATH_MAX + 1];
+	const char *filename;
+	size_t n;
+
+	if (spool_scan_init (&upgrade_scan, directory) < 0) {
+		spool_scan_free (&upgrade_scan);
+		return;
+	}
+
+	n = 0;
+
+	spool_scan_start (&upgrade_scan);
+	while ((filename = spool_scan_next (&upgrade_scan)) != NULL) {
+		spool_directory_path (path, sizeof (path), directory, filename);
+
+		/* Files which can't be converted fail validation later (and go to the error directory). */
+		if (envelope_upgrade (path, &server.domainlist) > 0) {
+			n++;
+		}
+	}
+
+	spool_scan_free (&upgrade_scan);
+
+	if (n > 0) {
+		fprintf (stderr, "Converted %lu message(s) of %s to the binary envelope.\n", (unsigned long) n, directory);
+	}
+}
+
 void stop (int nsignal)
 {
-	printf ("Delivery process received signal %d.\nStopping...\n", nsignal);
+	unsigned i;
 
 	server.running = 0;
 
+	if (worker != 0) {
+		return;
+	}
+
+	printf ("Delivery process received signal %d.\nStopping...\n", nsignal);
+
+	/* Wait for the other workers. */
+	if (workers) {
+		for (i = 1; i < server.delivery_workers; i++) {
+			waitpid (workers[i], NULL, 0);
+		}
+	}
+
 	/* Wait for relay process. */
 	waitpid (server.relay_pid, NULL, 0);
 }
@@ -127,377 +476,842 @@ void stop (int nsignal)
 void handle_sigusr1 (int nsignal)
 {
 	/* We got mail. */
+	got_mail = 1;
 }
 
 int deliver (void)
 {
-	DIR *delivery;
-	struct dirent *mail;
-	char oldpath[PATH_MAX + 1];
-	char newpath[PATH_MAX + 1];
-	size_t len;
-
-	delivery = opendir (server.received_directory);
-	if (!delivery) {
-		fprintf (stderr, "Couldn't open received directory %s.\n", server.received_directory);
-		return -1;
-	}
+	const char *filename;
+	size_t n;
 
 	/* For each message to deliver/relay... */
-	while ((mail = readdir (delivery)) != NULL) {
-		if (mail->d_name[0] == '.') {
-			continue;
+	for (n = 0; n < SCAN_BATCH; n++) {
+		if ((filename = spool_scan_next (&scan)) == NULL) {
+			break;
 		}
 
-		/* If not a message... */
-		len = strlen (mail->d_name);
-		if ((len < sizeof (MESSAGE_EXTENSION)) || (strcmp (mail->d_name + len - (sizeof (MESSAGE_EXTENSION) - 1), MESSAGE_EXTENSION) != 0)) {
+		deliver_file (filename);
+	}
+
+	if (ndelivered > 0) {
+		commit_deliveries ();
+	}
+
+	/* Is there more to scan? */
+	return (n == SCAN_BATCH);
+}
+
+int deliver_pending (void)
+{
+	journal_index_t index;
+	journal_entry_t *entry;
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	size_t i;
+
+	journal_index_init (&index);
+
+	if (journal_load (&index) < 0) {
+		journal_index_free (&index);
+		return -1;
+	}
+
+	/* For each message of the received directory still in the queue... */
+	for (i = 0; i < index.size; i++) {
+		entry = &(index.entries[i]);
+		if ((!entry->used) || (entry->spool != JOURNAL_RECEIVED)) {
 			continue;
 		}
 
-		snprintf (oldpath, sizeof (oldpath), "%s/%s", server.received_directory, mail->d_name);
+		snprintf (filename, sizeof (filename), "%s%s", entry->queue_id, MESSAGE_EXTENSION);
 
-		if (deliver_mail (oldpath, mail->d_name) < 0) {
-			/* Move mail to error directory. */
-			snprintf (newpath, sizeof (newpath), "%s/%s", server.error_directory, mail->d_name);
-			rename (oldpath, newpath);
-		} else {
-			unlink (oldpath);
-		}
+		deliver_file (filename);
 	}
 
-	closedir (delivery);
+	journal_index_free (&index);
+
+	if (ndelivered > 0) {
+		commit_deliveries ();
+	}
 
 	return 0;
 }
 
-int deliver_mail (const char *path, const char *filename)
+void deliver_queued (void)
 {
-	input_stream_t input_stream;
-	mail_transaction_t delivery;
-	mail_transaction_t relay;
-	domainlist_t *forward_paths;
-	int fd; /* Input file. */
-	int *fd_vector;
-	size_t nfds;
-	size_t i;
+	handoff_entry_t entry;
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
 
-	/* Open received message. */
-	fd = open (path, O_RDONLY);
-	if (fd < 0) {
-		fprintf (stderr, "Couldn't open message file %s.\n", path);
-		return -1;
+	/* For each message queued by the receiver... */
+	while (handoff_pop (&entry) == 0) {
+		snprintf (filename, sizeof (filename), "%s%s", entry.queue_id, MESSAGE_EXTENSION);
+
+		deliver_file (filename);
 	}
 
-	/* Open stream. */
-	if (input_stream_fdopen (&input_stream, fd, 16 * 1024) < 0) {
-		/* Couldn't allocate memory. */
-		close (fd);
-		return -1;
+	if (ndelivered > 0) {
+		commit_deliveries ();
 	}
+}
 
-	mail_transaction_init (&delivery);
-	mail_transaction_init (&relay);
+void deliver_file (const char *filename)
+{
+	char oldpath[PATH_MAX + 1];
+	char newpath[PATH_MAX + 1];
+	struct stat buf;
+	struct stat path_buf;
+	time_t retry;
+	int fd;
+	int lock;
+	int ret;
 
-	/* Read message pre-header. */
-	if (read_pre_header (&input_stream, &delivery, &relay) < 0) {
-		mail_transaction_free (&delivery);
-		mail_transaction_free (&relay);
+	spool_directory_path (oldpath, sizeof (oldpath), server.received_directory, filename);
 
-		input_stream_fclose (&input_stream);
-		return -1;
+	/* Open received message (the states of the recipients are written back to it). */
+	if ((fd = open (oldpath, O_RDWR)) < 0) {
+		/* Already delivered? */
+		if (errno == ENOENT) {
+			journal_append (JOURNAL_DONE, JOURNAL_RECEIVED, filename, 0, 0);
+			return;
+		}
+
+		fprintf (stderr, "Couldn't open message file %s.\n", oldpath);
+	} else {
+		/* Claim the message: if another worker has it, or has already
+		 * delivered it (and removed it) or moved it to the error directory
+		 * since we opened it, leave it alone.
+		 */
+		if ((flock (fd, LOCK_EX | LOCK_NB) < 0) || (fstat (fd, &buf) < 0) || (buf.st_nlink == 0) || (fstatat (AT_FDCWD, oldpath, &path_buf, 0) < 0) || (path_buf.st_dev != buf.st_dev) || (path_buf.st_ino != buf.st_ino)) {
+			close (fd);
+			return;
+		}
+
+		journal_append (JOURNAL_CLAIM, JOURNAL_RECEIVED, filename, 0, 0);
 	}
 
-	/* If there is not reverse-path. */
-	if (!delivery.reverse_path[0]) {
-		mail_transaction_free (&delivery);
-		mail_transaction_free (&relay);
+	/* deliver_mail() closes the file, keep it locked until we are done. */
+	lock = (fd != -1) ? dup (fd) : -1;
 
-		input_stream_fclose (&input_stream);
-		return -1;
+	ret = (fd != -1) ? deliver_mail (fd, filename, &retry) : -1;
+
+	if (ret < 0) {
+		/* Move mail to error directory. */
+		spool_directory_path (newpath, sizeof (newpath), server.error_directory, filename);
+		rename (oldpath, newpath);
+
+		journal_append (JOURNAL_DONE, JOURNAL_RECEIVED, filename, 0, ENVELOPE_FAILED);
+	} else if (ret > 0) {
+		/* Some recipients are deferred: the message stays in the queue. */
+		schedule_retry (filename, retry);
+	} else if (!server.group_commit) {
+		unlink (oldpath);
+
+		journal_append (JOURNAL_DONE, JOURNAL_RECEIVED, filename, 0, ENVELOPE_DELIVERED);
+	} else {
+		/* Remove the message once the copies are on disk. */
+		snprintf (delivered[ndelivered], NAME_MAX + 1, "%s", filename);
+		delivered_fd[ndelivered++] = lock;
+
+		if (ndelivered == COMMIT_EVERY) {
+			commit_deliveries ();
+		}
+
+		return;
 	}
 
-	/* Compute how many files we will have to generate. */
-	forward_paths = &delivery.forward_paths;
-	nfds = 0;
+	if (lock != -1) {
+		close (lock);
+	}
+}
+
+void deliver_retries (void)
+{
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	time_t now;
+	size_t i;
 
-	for (i = 0; i < forward_paths->used; i++) {
-		nfds += forward_paths->records[i].used;
+	if ((nretries == 0) && (retry_rescan == 0)) {
+		return;
 	}
 
-	if (relay.forward_paths.used > 0) {
-		nfds++;
+	now = time (NULL);
+
+	/* Look for the messages which didn't fit in the retry queue. */
+	if ((retry_rescan != 0) && (retry_rescan <= now)) {
+		retry_rescan = 0;
+
+		if (server.queue_journal) {
+			recover = 1;
+		} else {
+			got_mail = 1;
+		}
 	}
 
-	/* If there are not recipients... */
-	if (nfds == 0) {
-		mail_transaction_free (&delivery);
-		mail_transaction_free (&relay);
+	i = 0;
+	while (i < nretries) {
+		if (retries[i].time > now) {
+			i++;
+			continue;
+		}
 
-		input_stream_fclose (&input_stream);
-		return -1;
+		/* deliver_file() may schedule it again. */
+		strcpy (filename, retries[i].filename);
+		retries[i] = retries[--nretries];
+
+		deliver_file (filename);
 	}
 
-	/* Allocate memory for file descriptors. */
-	fd_vector = (int *) malloc (nfds * sizeof (int));
-	if (!fd_vector) {
-		mail_transaction_free (&delivery);
-		mail_transaction_free (&relay);
+	if (ndelivered > 0) {
+		commit_deliveries ();
+	}
+}
 
-		input_stream_fclose (&input_stream);
-		return -1;
+void schedule_retry (const char *filename, time_t time)
+{
+	size_t i;
+
+	/* Already scheduled? */
+	for (i = 0; i < nretries; i++) {
+		if (strcmp (retries[i].filename, filename) == 0) {
+			retries[i].time = time;
+			return;
+		}
 	}
 
-	/* Initialize file descriptors. */
-	for (i = 0; i < nfds; i++) {
-		fd_vector[i] = -1;
+	/* If the queue is full, the message will be found in the journal (or
+	 * scanning the received directory) when it's time.
+	 */
+	if (nretries == RETRY_QUEUE_SIZE) {
+		if ((retry_rescan == 0) || (time < retry_rescan)) {
+			retry_rescan = time;
+		}
+
+		return;
 	}
 
-	/* Open output files. */
-	if (open_files (nfds, fd_vector, &delivery, &relay, filename) < 0) {
-		close_and_remove_files (nfds, fd_vector, &delivery, &relay, filename);
-		free (fd_vector);
+	snprintf (retries[nretries].filename, sizeof (retries[nretries].filename), "%s", filename);
+	retries[nretries++].time = time;
+}
 
-		mail_transaction_free (&delivery);
-		mail_transaction_free (&relay);
+time_t retry_interval (unsigned attempts)
+{
+	time_t interval;
 
-		input_stream_fclose (&input_stream);
-		return -1;
+	/* Exponential backoff. */
+	interval = RETRY_INTERVAL;
+	while ((--attempts > 0) && (interval < RETRY_MAX_INTERVAL)) {
+		interval *= 2;
 	}
 
-	/* If we have to relay... */
-	if (relay.forward_paths.used > 0) {
-		/* Write pre-header. */
-		if (write_relay_pre_header (fd_vector[nfds - 1], delivery.reverse_path, &relay) < 0) {
-			close_and_remove_files (nfds, fd_vector, &delivery, &relay, filename);
-			free (fd_vector);
+	return (interval < RETRY_MAX_INTERVAL) ? interval : RETRY_MAX_INTERVAL;
+}
+
+int commit_deliveries (void)
+{
+	char path[PATH_MAX + 1];
+	int synced;
+	size_t i;
 
-			mail_transaction_free (&delivery);
-			mail_transaction_free (&relay);
+	/* Flush the mailboxes and the relay directory. */
+	synced = (sync_copies () == 0);
 
-			input_stream_fclose (&input_stream);
+	/* If the copies couldn't be flushed, the messages will be delivered again. */
+	for (i = 0; i < ndelivered; i++) {
+		if (synced) {
+			spool_directory_path (path, sizeof (path), server.received_directory, delivered[i]);
+			unlink (path);
+
+			journal_append (JOURNAL_DONE, JOURNAL_RECEIVED, delivered[i], 0, ENVELOPE_DELIVERED);
+		}
+
+		if (delivered_fd[i] != -1) {
+			close (delivered_fd[i]);
+		}
+	}
+
+	ndelivered = 0;
+
+	return synced ? 0 : -1;
+}
+
+int sync_copies (void)
+{
+	const char *directories[2];
+	int fd;
+	size_t i;
+
+	directories[0] = server.domains_directory;
+	directories[1] = server.relay_directory;
+
+	for (i = 0; i < 2; i++) {
+		if ((fd = open (directories[i], O_RDONLY | O_DIRECTORY)) < 0) {
 			return -1;
 		}
+
+		if (syncfs (fd) < 0) {
+			close (fd);
+			return -1;
+		}
+
+		close (fd);
 	}
 
-	/* Copy message to recipients. */
-	if (copy_file_to_recipients (&input_stream, nfds, fd_vector) < 0) {
-		close_and_remove_files (nfds, fd_vector, &delivery, &relay, filename);
-		free (fd_vector);
+	return 0;
+}
+
+int receive_messages (void)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE (sizeof (int))];
+	char queue_id[QUEUE_ID_MAXLEN + 1];
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	time_t retry;
+	ssize_t len;
+	int fd;
+	int copy;
+	int ret;
+
+	do {
+		iov.iov_base = queue_id;
+		iov.iov_len = sizeof (queue_id) - 1;
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+
+		if ((len = recvmsg (server.delivery_socket, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return (errno == EAGAIN) ? 0 : -1;
+		} else if (len == 0) {
+			/* The receiver has closed its end of the socket. */
+			return -1;
+		}
 
-		mail_transaction_free (&delivery);
-		mail_transaction_free (&relay);
+		cmsg = CMSG_FIRSTHDR (&msg);
+		if ((!cmsg) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+			continue;
+		}
+
+		memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+
+		queue_id[len] = 0;
+		snprintf (filename, sizeof (filename), "%s%s", queue_id, MESSAGE_EXTENSION);
+
+		/* Keep a copy of the descriptor, in case the message can't be delivered. */
+		copy = dup (fd);
+
+		ret = deliver_mail (fd, filename, &retry);
+		if ((ret != 0) && (copy != -1)) {
+			/* If the deferred recipients can't be queued, save the message. */
+			if ((ret < 0) || (requeue_message (copy, filename, retry) < 0)) {
+				save_message (copy, filename);
+			}
+		}
+
+		if (copy != -1) {
+			close (copy);
+		}
+
+		/* The pages of the message are gone: the receiver can use them again. */
+		handoff_release ();
+	} while (1);
+}
+
+void save_message (int fd, const char *filename)
+{
+	char path[PATH_MAX + 1];
 
-		input_stream_fclose (&input_stream);
+	/* Store message in the error directory. */
+	spool_directory_path (path, sizeof (path), server.error_directory, filename);
+
+	if (copy_message (fd, path) < 0) {
+		fprintf (stderr, "Couldn't save message file %s.\n", path);
+	}
+}
+
+int requeue_message (int fd, const char *filename, time_t time)
+{
+	char oldpath[PATH_MAX + 1];
+	char newpath[PATH_MAX + 1];
+
+	/* Write it in the incoming directory and move it to the received directory
+	 * once complete (as the receiver does).
+	 */
+	spool_directory_path (oldpath, sizeof (oldpath), server.incoming_directory, filename);
+	spool_directory_path (newpath, sizeof (newpath), server.received_directory, filename);
+
+	if (copy_message (fd, oldpath) < 0) {
+		unlink (oldpath);
 		return -1;
 	}
 
-	/* Close files. */
-	for (i = 0; i < nfds; i++) {
-		close (fd_vector[i]);
+	if (rename (oldpath, newpath) < 0) {
+		unlink (oldpath);
+		return -1;
 	}
 
-	free (fd_vector);
+	journal_append (JOURNAL_ENQUEUE, JOURNAL_RECEIVED, filename, 0, 0);
+
+	schedule_retry (filename, time);
+
+	return 0;
+}
+
+int copy_message (int fd, const char *path)
+{
+	struct stat buf;
+	off_t offset;
+	int out;
 
-	mail_transaction_free (&delivery);
-	mail_transaction_free (&relay);
+	if (fstat (fd, &buf) < 0) {
+		return -1;
+	}
 
-	input_stream_fclose (&input_stream);
+	if ((out = open (path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+		return -1;
+	}
+
+	offset = 0;
+	while (offset < buf.st_size) {
+		if (sendfile (out, fd, &offset, buf.st_size - offset) <= 0) {
+			close (out);
+			return -1;
+		}
+	}
+
+	close (out);
 
 	return 0;
 }
 
-int read_pre_header (input_stream_t *input_stream, mail_transaction_t *delivery, mail_transaction_t *relay)
+int deliver_mail (int fd, const char *filename, time_t *retry)
 {
-	mail_transaction_t *mail_transaction;
+	/* Return values:
+	 * -1: Error (the message goes to the error directory).
+	 *  0: Every recipient is done.
+	 *  1: Some recipients are deferred, "retry" is the time of the next attempt.
+	 */
+
+	envelope_t envelope;
+	envelope_domain_t *domain;
+	envelope_recipient_t *recipient;
+	struct stat buf;
+	char path[PATH_MAX + 1];
+	int *fd_vector;
+	size_t nfds;
+	size_t nlocal;
+	size_t ndeferred;
+	ssize_t relay_start;
+	int relay;
+	int relayed;
+	int single_instance;
+	size_t i, j;
 
-	unsigned char *argument;
-	unsigned char *local_part;
-	size_t local_part_len;
-	unsigned char *domain;
-	size_t domainlen;
+	/* Read the envelope (a single pread() in most cases). */
+	if (envelope_read (&envelope, fd) < 0) {
+		close (fd);
+		return -1;
+	}
 
-	char line[TEXT_LINE_MAXLEN + 1];
-	size_t len;
+	/* If there is not reverse-path or there are not recipients... */
+	if ((!*envelope_string (&envelope, envelope.header->reverse_path)) || (envelope.header->nrecipients == 0)) {
+		envelope_free (&envelope);
 
-	int error;
-	int ret;
+		close (fd);
+		return -1;
+	}
 
-	error = 0;
+	/* Deferred before? Wait until it's time for another attempt. */
+	if (envelope.header->attempts > 0) {
+		if (fstat (fd, &buf) < 0) {
+			envelope_free (&envelope);
 
-	do {
-		/* Read line. */
-		if ((!input_stream_fgets (input_stream, line, sizeof (line), &len)) || (line[len - 1] != '\n')) {
+			close (fd);
 			return -1;
 		}
 
-		/* End of pre-header? */
-		if ((len == 1) || ((len == 2) && (line[0] == '\r'))) {
-			return 0;
-		}
+		*retry = buf.st_mtime + retry_interval (envelope.header->attempts);
+		if (*retry > time (NULL)) {
+			envelope_free (&envelope);
 
-		/* Parse SMTP command. */
-		if (((ret = parse_smtp_command ((unsigned char *) line, &argument, &error)) < 0) || (error != 0)) {
-			return -1;
+			close (fd);
+			return 1;
 		}
+	}
 
-		if ((eSmtpCommand) ret == MAIL) {
-			/* If there was another "MAIL FROM: <reverse_path>" line... */
-			if (delivery->reverse_path[0]) {
-				return -1;
-			}
+	/* The deferred recipients are tried again, the others are done. */
+	change_state (&envelope, ENVELOPE_LOCAL | ENVELOPE_RELAY, ENVELOPE_DEFERRED, ENVELOPE_PENDING);
 
-			/* Valid reverse path? */
-			if (parse_reverse_path (argument, &local_part, &local_part_len, &domain, &domainlen, NULL, NULL) < 0) {
-				return -1;
+	/* Compute how many files we will have to generate. */
+	nlocal = 0;
+	relay = 0;
+
+	for (i = 0; i < envelope.header->ndomains; i++) {
+		domain = &(envelope.domains[i]);
+
+		for (j = 0; j < domain->count; j++) {
+			if (envelope.recipients[domain->first + j].state != ENVELOPE_PENDING) {
+				continue;
 			}
 
-			/* Null reverse path? */
-			if (!local_part) {
-				memcpy (delivery->reverse_path, "<>", 3);
+			if (domain->flags & ENVELOPE_LOCAL) {
+				nlocal++;
 			} else {
-				mail_transaction_set_reverse_path (delivery, (const char *) local_part, local_part_len, (const char *) domain, domainlen);
-			}
-		} else if ((eSmtpCommand) ret == RCPT) {
-			/* Valid forward path? */
-			if (parse_forward_path (argument, &local_part, &local_part_len, &domain, &domainlen) < 0) {
-				return -1;
+				relay = 1;
 			}
+		}
+	}
 
-			local_part[local_part_len] = 0;
-			domain[domainlen] = 0;
+	/* Nothing left to do (removed before the last attempt completed)? */
+	if ((nlocal == 0) && (!relay)) {
+		envelope_free (&envelope);
 
-			/* If I know nothing about: <local_part>@<domain>... */
-			if (domainlist_search (&server.domainlist, (const char *) local_part, (const char *) domain) < 0) {
-				mail_transaction = relay;
-			} else {
-				mail_transaction = delivery;
-			}
+		close (fd);
+		return 0;
+	}
+
+	/* With LMTP, no files are written for the local recipients. */
+	nfds = (lmtp) ? 0 : nlocal;
+
+	/* Store the message once and link it into the mailboxes? */
+	single_instance = ((server.single_instance_store) && (nfds > 1));
+	if (single_instance) {
+		nfds = 1;
+	}
+
+	if (relay) {
+		nfds++;
+	}
+
+	/* Allocate memory for file descriptors. */
+	fd_vector = (int *) malloc ((nfds > 0 ? nfds : 1) * sizeof (int));
+	if (!fd_vector) {
+		envelope_free (&envelope);
+
+		close (fd);
+		return -1;
+	}
+
+	/* Open output files (the files which can't be opened are -1). */
+	open_files (nfds, fd_vector, &envelope, relay, filename, single_instance);
+
+	/* If we have to relay... */
+	relay_start = 0;
+	if ((relay) && (fd_vector[nfds - 1] != -1)) {
+		/* Write the envelope of the recipients to relay. */
+		if ((relay_start = write_relay_envelope (fd_vector[nfds - 1], &envelope)) < 0) {
+			close (fd_vector[nfds - 1]);
+			fd_vector[nfds - 1] = -1;
+		}
+	}
+
+	/* Copy message to recipients (it starts right after the envelope). */
+	if (nfds > 0) {
+		copy_to_files (fd, envelope.header->size, nfds, fd_vector, relay, relay_start);
+	}
+
+	/* Hand the local recipients to the LMTP server, make the copies visible or
+	 * link the stored message into the mailboxes. The recipients done are
+	 * marked as delivered, the others are left pending.
+	 */
+	if (lmtp) {
+		if (nlocal > 0) {
+			lmtp_deliver (fd, envelope.header->size, &envelope, ENVELOPE_LOCAL);
+		}
+	} else if (!single_instance) {
+		publish_to_mailboxes (fd_vector, &envelope, filename);
+	} else {
+		link_to_mailboxes (fd_vector[0], &envelope, filename);
+	}
+
+	relayed = ((relay) && (fd_vector[nfds - 1] != -1));
+
+	/* Close files. */
+	for (i = 0; i < nfds; i++) {
+		if (fd_vector[i] != -1) {
+			close (fd_vector[i]);
+		}
+	}
+
+	free (fd_vector);
+
+	/* Queue the message for the relay process. */
+	if (relayed) {
+		change_state (&envelope, ENVELOPE_RELAY, ENVELOPE_PENDING, ENVELOPE_DELIVERED);
+
+		journal_append (JOURNAL_ENQUEUE, JOURNAL_RELAY, filename, 0, 0);
+	} else if (relay) {
+		spool_directory_path (path, sizeof (path), server.relay_directory, filename);
+		unlink (path);
+	}
+
+	/* The recipients left pending are deferred (as those deferred by the LMTP
+	 * server), until there have been too many attempts.
+	 */
+	change_state (&envelope, ENVELOPE_LOCAL | ENVELOPE_RELAY, ENVELOPE_PENDING, ENVELOPE_DEFERRED);
+
+	ndeferred = change_state (&envelope, ENVELOPE_LOCAL | ENVELOPE_RELAY, ENVELOPE_DEFERRED, ENVELOPE_DEFERRED);
+	if (ndeferred > 0) {
+		if (++envelope.header->attempts >= RETRY_MAX_ATTEMPTS) {
+			change_state (&envelope, ENVELOPE_LOCAL | ENVELOPE_RELAY, ENVELOPE_DEFERRED, ENVELOPE_FAILED);
+		}
+	}
 
-			if (mail_transaction_add_forward_path (mail_transaction, (const char *) local_part, local_part_len, (const char *) domain, domainlen) < 0) {
-				return -1;
+	/* Record the results (of the local recipients: the relay recipients are
+	 * only handed over to the relay spool here).
+	 */
+	for (i = 0; i < envelope.header->ndomains; i++) {
+		domain = &(envelope.domains[i]);
+		if (domain->flags & ENVELOPE_LOCAL) {
+			for (j = 0; j < domain->count; j++) {
+				recipient = &(envelope.recipients[domain->first + j]);
+				journal_append (JOURNAL_RESULT, JOURNAL_RECEIVED, filename, domain->first + j, recipient->state);
 			}
-		} else {
-			return -1;
 		}
-	} while (1);
+	}
+
+	if (ndeferred == 0) {
+		envelope_free (&envelope);
+
+		close (fd);
+		return 0;
+	}
+
+	/* Keep the states in the envelope: the next attempt only takes the deferred
+	 * recipients. With group commit, the copies have to be on disk before
+	 * their recipients are marked as delivered.
+	 */
+	if ((!server.group_commit) || (sync_copies () == 0)) {
+		envelope_write (&envelope, fd);
+	}
+
+	if (envelope.header->attempts >= RETRY_MAX_ATTEMPTS) {
+		envelope_free (&envelope);
+
+		close (fd);
+		return -1;
+	}
+
+	*retry = time (NULL) + retry_interval (envelope.header->attempts);
+
+	envelope_free (&envelope);
+
+	close (fd);
+
+	return 1;
 }
 
-int open_files (size_t nfds, int *fd_vector, mail_transaction_t *delivery, mail_transaction_t *relay, const char *filename)
+void open_files (size_t nfds, int *fd_vector, envelope_t *envelope, int relay, const char *filename, int single_instance)
 {
-	domainlist_t *forward_paths;
-	domain_t *domain;
-	char *data;
+	envelope_domain_t *domain;
 
 	char path[PATH_MAX + 1];
 	size_t idx;
 	size_t i, j;
 
-	/* Open output files. */
-	forward_paths = &delivery->forward_paths;
-	data = forward_paths->data.data;
-
 	idx = 0;
 
-	/* Open files for local delivery. */
-	for (i = 0; i < forward_paths->used; i++) {
-		domain = &(forward_paths->records[i]);
-		for (j = 0; j < domain->used; j++) {
-			/* Open file. */
-			snprintf (path, sizeof (path), "%s/%s/%s/%s", server.domains_directory, data + domain->domain_name, data + domain->local_parts[j], filename);
-			fd_vector[idx] = open (path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			if (fd_vector[idx] < 0) {
-				return -1;
+	/* Open a single file for all the local recipients. */
+	if (single_instance) {
+		fd_vector[idx++] = open_store_file (filename);
+	}
+
+	/* Open files for local delivery (one per pending recipient). */
+	for (i = 0; (i < envelope->header->ndomains) && (!single_instance) && (!lmtp); i++) {
+		domain = &(envelope->domains[i]);
+		if (!(domain->flags & ENVELOPE_LOCAL)) {
+			continue;
+		}
+
+		for (j = 0; j < domain->count; j++) {
+			if (envelope->recipients[domain->first + j].state != ENVELOPE_PENDING) {
+				continue;
 			}
 
-			idx++;
+			/* Open file (under a temporary name). */
+			fd_vector[idx++] = mailbox_create (envelope_string (envelope, domain->name), envelope_string (envelope, envelope->recipients[domain->first + j].local_part), filename);
 		}
 	}
 
 	/* If we have to relay... */
-	if (relay->forward_paths.used > 0) {
+	if (relay) {
 		/* Open file for relay. */
-		snprintf (path, sizeof (path), "%s/%s", server.relay_directory, filename);
+		spool_directory_path (path, sizeof (path), server.relay_directory, filename);
 		fd_vector[idx] = open (path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-		if (fd_vector[idx] < 0) {
-			return -1;
-		}
 	}
-
-	return 0;
 }
 
-void close_and_remove_files (size_t nfds, int *fd_vector, mail_transaction_t *delivery, mail_transaction_t *relay, const char *filename)
+void copy_to_files (int fd, off_t offset, size_t nfds, int *fd_vector, int relay, off_t relay_start)
 {
-	domainlist_t *forward_paths;
-	domain_t *domain;
-	char *data;
+	off_t start;
+	size_t i;
 
-	char path[PATH_MAX + 1];
-	size_t i, j;
+	/* Usually, the message is copied to all the files at once. */
+	for (i = 0; (i < nfds) && (fd_vector[i] != -1); i++);
 
+	if ((i == nfds) && (fanout_copy (fd, offset, nfds, fd_vector) == 0)) {
+		return;
+	}
+
+	/* Copy it to each file on its own, so that a file which can't be written
+	 * (a full mailbox) doesn't fail the others.
+	 */
 	for (i = 0; i < nfds; i++) {
-		if (fd_vector[i] != -1) {
-			/* Close file. */
+		if (fd_vector[i] == -1) {
+			continue;
+		}
+
+		start = ((relay) && (i == nfds - 1)) ? relay_start : 0;
+
+		if ((ftruncate (fd_vector[i], start) < 0) || (lseek (fd_vector[i], start, SEEK_SET) < 0) || (fanout_copy (fd, offset, 1, &(fd_vector[i])) < 0)) {
 			close (fd_vector[i]);
+			fd_vector[i] = -1;
 		}
 	}
+}
 
-	forward_paths = &delivery->forward_paths;
-	data = forward_paths->data.data;
+void publish_to_mailboxes (int *fd_vector, envelope_t *envelope, const char *filename)
+{
+	envelope_domain_t *domain;
+	envelope_recipient_t *recipient;
+	size_t idx;
+	size_t i, j;
 
-	for (i = 0; i < forward_paths->used; i++) {
-		domain = &(forward_paths->records[i]);
-		for (j = 0; j < domain->used; j++) {
-			/* Remove file. */
-			snprintf (path, sizeof (path), "%s/%s/%s/%s", server.domains_directory, data + domain->domain_name, data + domain->local_parts[j], filename);
-			unlink (path);
+	idx = 0;
+
+	/* One renameat() per recipient: readers never see a partial message. */
+	for (i = 0; i < envelope->header->ndomains; i++) {
+		domain = &(envelope->domains[i]);
+		if (!(domain->flags & ENVELOPE_LOCAL)) {
+			continue;
+		}
+
+		for (j = 0; j < domain->count; j++) {
+			recipient = &(envelope->recipients[domain->first + j]);
+			if (recipient->state != ENVELOPE_PENDING) {
+				continue;
+			}
+
+			if ((fd_vector[idx] != -1) && (mailbox_publish (envelope_string (envelope, domain->name), envelope_string (envelope, recipient->local_part), filename) == 0)) {
+				recipient->state = ENVELOPE_DELIVERED;
+			} else {
+				/* Remove the partial copy. */
+				mailbox_remove (envelope_string (envelope, domain->name), envelope_string (envelope, recipient->local_part), filename);
+			}
+
+			idx++;
 		}
 	}
+}
 
-	/* If we have to relay... */
-	if (relay->forward_paths.used > 0) {
-		/* Remove file. */
-		snprintf (path, sizeof (path), "%s/%s", server.relay_directory, filename);
-		unlink (path);
+size_t change_state (envelope_t *envelope, uint32_t flags, unsigned from, unsigned to)
+{
+	envelope_domain_t *domain;
+	size_t count;
+	size_t i, j;
+
+	count = 0;
+
+	for (i = 0; i < envelope->header->ndomains; i++) {
+		domain = &(envelope->domains[i]);
+		if (!(domain->flags & flags)) {
+			continue;
+		}
+
+		for (j = 0; j < domain->count; j++) {
+			if (envelope->recipients[domain->first + j].state == from) {
+				envelope->recipients[domain->first + j].state = to;
+				count++;
+			}
+		}
 	}
+
+	return count;
 }
 
-int write_relay_pre_header (int fd, const char *reverse_path, mail_transaction_t *relay)
+int open_store_file (const char *filename)
 {
-	domainlist_t *forward_paths;
-	domain_t *domain;
-	char *data;
+	char path[PATH_MAX + 1];
+	int fd;
+
+	/* Create an unnamed file on the filesystem of the mailboxes. */
+	if (store_tmpfile_supported) {
+		fd = open (server.domains_directory, O_TMPFILE | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (fd != -1) {
+			store_anonymous = 1;
+			return fd;
+		}
 
-	buffer_t buffer;
-	size_t i, j;
+		/* If the kernel or the filesystem doesn't support O_TMPFILE... */
+		if ((errno != EISDIR) && (errno != EOPNOTSUPP) && (errno != EINVAL)) {
+			return -1;
+		}
 
-	buffer_init (&buffer, 512);
+		store_tmpfile_supported = 0;
+	}
 
-	/* Add reverse path to the pre-header. */
-	if (buffer_format (&buffer, "MAIL FROM: %s\r\n", reverse_path) < 0) {
-		/* Couldn't allocate memory. */
-		buffer_free (&buffer);
-		return -1;
+	/* Fall back to a hidden file (it is ignored when loading the domains). */
+	store_anonymous = 0;
+
+	snprintf (path, sizeof (path), "%s/.store-%s", server.domains_directory, filename);
+
+	return open (path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+}
+
+void link_to_mailboxes (int fd, envelope_t *envelope, const char *filename)
+{
+	envelope_domain_t *domain;
+	envelope_recipient_t *recipient;
+
+	char oldpath[PATH_MAX + 1];
+	size_t i, j;
+
+	if (store_anonymous) {
+		snprintf (oldpath, sizeof (oldpath), "/proc/self/fd/%d", fd);
+	} else {
+		snprintf (oldpath, sizeof (oldpath), "%s/.store-%s", server.domains_directory, filename);
 	}
 
-	forward_paths = &relay->forward_paths;
-	data = forward_paths->data.data;
+	/* The mailboxes share the inode, the kernel keeps the reference count (st_nlink). */
+	for (i = 0; (i < envelope->header->ndomains) && (fd != -1); i++) {
+		domain = &(envelope->domains[i]);
+		if (!(domain->flags & ENVELOPE_LOCAL)) {
+			continue;
+		}
+
+		for (j = 0; j < domain->count; j++) {
+			recipient = &(envelope->recipients[domain->first + j]);
+			if (recipient->state != ENVELOPE_PENDING) {
+				continue;
+			}
 
-	/* Add forward paths to the pre-header. */
-	for (i = 0; i < forward_paths->used; i++) {
-		domain = &(forward_paths->records[i]);
-		for (j = 0; j < domain->used; j++) {
-			if (buffer_format (&buffer, "RCPT TO: %s@%s\r\n", data + domain->local_parts[j], data + domain->domain_name) < 0) {
-				/* Couldn't allocate memory. */
-				buffer_free (&buffer);
-				return -1;
+			if (mailbox_link (oldpath, envelope_string (envelope, domain->name), envelope_string (envelope, recipient->local_part), filename) == 0) {
+				recipient->state = ENVELOPE_DELIVERED;
 			}
 		}
 	}
 
-	/* Add an empty line to the pre-header. */
-	if (buffer_append_size_bounded_string (&buffer, "\r\n", 2) < 0) {
+	/* The store file is only reachable through the mailboxes. */
+	if (!store_anonymous) {
+		unlink (oldpath);
+	}
+}
+
+ssize_t write_relay_envelope (int fd, envelope_t *envelope)
+{
+	buffer_t buffer;
+	ssize_t size;
+
+	buffer_init (&buffer, 512);
+
+	/* Keep only the domains to relay. */
+	if (envelope_build_subset (&buffer, envelope, ENVELOPE_RELAY) < 0) {
 		/* Couldn't allocate memory. */
 		buffer_free (&buffer);
 		return -1;
@@ -510,31 +1324,9 @@ int write_relay_pre_header (int fd, const char *reverse_path, mail_transaction_t
 		return -1;
 	}
 
-	buffer_free (&buffer);
-
-	return 0;
-}
-
-int copy_file_to_recipients (input_stream_t *input_stream, size_t nfds, int *fd_vector)
-{
-	char buffer[20 * 1024];
-	size_t bytes;
-	size_t i;
+	size = buffer.used;
 
-	do {
-		/* Read chunk from input stream... */
-		bytes = input_stream_fread (input_stream, buffer, sizeof (buffer));
-		if (bytes <= 0) {
-			break;
-		}
-
-		/* and write it to the recipients. */
-		for (i = 0; i < nfds; i++) {
-			if (write (fd_vector[i], buffer, bytes) != bytes) {
-				return -1;
-			}
-		}
-	} while (1);
+	buffer_free (&buffer);
 
-	return 0;
+	return size;
 }
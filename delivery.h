@@ -3,4 +3,12 @@
 
 void deliver_loop (void);
 
+/* Deliver a message for local recipients only, in the calling process (the
+ * receiver). Returns 0 if it has been delivered to every recipient, 1 if some
+ * have been deferred (their states are in the envelope: the message has to be
+ * queued as usual) and -1 on error.
+ */
+int deliver_direct (int fd, const char *filename);
+void deliver_direct_free (void);
+
 #endif /* DELIVERY_H */
@@ -157,6 +157,7 @@ int insert_rr (unsigned char *msg, unsigned char *end, unsigned char *cp, rr_t *
 	char host[MAXDNAME + 1];
 	size_t len;
 	int bytes;
+	int ret;
 	size_t size;
 	size_t i;
 
@@ -213,12 +214,12 @@ int insert_rr (unsigned char *msg, unsigned char *end, unsigned char *cp, rr_t *
 				return -1;
 			}
 
-			if (valid_domain ((const unsigned char *) host) < 0) {
+			if ((ret = valid_domain ((const unsigned char *) host)) < 0) {
 				return -1;
 			}
 
 			buffer_init (&name, 64);
-			len = strlen (host);
+			len = ret;
 			if (buffer_allocate (&name, len + 1) < 0) {
 				buffer_free (&name);
 				return -1;
@@ -238,12 +239,12 @@ int insert_rr (unsigned char *msg, unsigned char *end, unsigned char *cp, rr_t *
 				return -1;
 			}
 
-			if (valid_domain ((const unsigned char *) host) < 0) {
+			if ((ret = valid_domain ((const unsigned char *) host)) < 0) {
 				return -1;
 			}
 
 			buffer_init (&name, 64);
-			len = strlen (host);
+			len = ret;
 			if (buffer_allocate (&name, len + 1) < 0) {
 				buffer_free (&name);
 				return -1;
@@ -1,20 +1,98 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "domainlist.h"
 #include "parser.h"
 
 #define DOMAIN_ALLOC     10
 #define LOCAL_PART_ALLOC 100
 
-static int allocate_domains (domainlist_t *domainlist);
-static int allocate_local_parts (domain_t *domain);
+#define CACHE_LINE_SIZE  64
+
+#define WALK_MAX_THREADS 16
+
+#define IMAGE_MAGIC      0x31494c44 /* "DLI1" */
+#define IMAGE_VERSION    1
+
+#define ALIGN(size) (((size) + CACHE_LINE_SIZE - 1) & ~((uint64_t) CACHE_LINE_SIZE - 1))
+
+/* Header of the compiled image, followed by:
+ *   domain names   (original case, sorted, NUL-terminated)
+ *   slots          (aligned to a cache line)
+ *   keys
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size; /* Size of the file. */
+	int64_t mtime;
+
+	uint64_t names;
+	uint64_t names_size;
+
+	uint64_t slots;
+	uint64_t nslots;
+
+	uint64_t keys;
+	uint64_t keys_size;
+} image_header_t;
+
+/* Walk of the domains directory (domainlist_load()): each domain is loaded
+ * by one of the threads, then they are merged in order.
+ */
+#define WALK_SKIPPED 0 /* Not a (valid) domain. */
+#define WALK_LOADED  1
+#define WALK_ERROR   -1
+
+typedef struct {
+	char *name;
+	int status;
+	int64_t mtime;
+
+	buffer_t local_parts; /* NUL-terminated names. */
+	char **sorted;
+	size_t count;
+} walk_domain_t;
+
+typedef struct {
+	DIR *directory;
+
+	walk_domain_t *domains;
+	size_t ndomains;
+	size_t size;
+
+	size_t next; /* Next domain to load (atomic). */
+} walk_t;
+
+/* Case folding (as strcasecmp() in the "C" locale). */
+#define FOLD(c) ((((c) >= 'A') && ((c) <= 'Z')) ? ((c) + ('a' - 'A')) : (c))
+
+static int allocate_domains (domainlist_t *domainlist, size_t count);
+static int allocate_local_parts (domain_t *domain, size_t count);
 static int search_domain (domainlist_t *domainlist, const char *domain, unsigned int *position);
 static int search_local_part (domainlist_t *domainlist, domain_t *domain, const char *local_part, unsigned int *position);
 static domain_t *insert_domain (domainlist_t *domainlist, const char *domain, size_t len);
 static int insert_local_part (domainlist_t *domainlist, domain_t *domain, const char *local_part, size_t len);
+static int build_directory (domainlist_t *domainlist);
+static uint64_t hash_key (const char *local_part, const char *domain);
+static int compare_key (const char *key, const char *local_part, const char *domain);
+static domainlist_slot_t *lookup_key (domainlist_t *domainlist, const char *local_part, const char *domain);
+static char *copy_key (char *key, const char *local_part, const char *domain);
+static int64_t modification_time (const struct stat *buf);
+static int write_all (int fd, const void *data, size_t len);
+static void *walk_thread (void *arg);
+static void walk_domain (walk_t *walk, walk_domain_t *domain);
+static void walk_free (walk_t *walk);
+static int compare_domains (const void *p1, const void *p2);
+static int compare_local_parts (const void *p1, const void *p2);
 
 void domainlist_init (domainlist_t *domainlist)
 {
@@ -25,6 +103,16 @@ void domainlist_init (domainlist_t *domainlist)
 	domainlist->used = 0;
 
 	buffer_init (&domainlist->data, 4 * 1024);
+
+	domainlist->slots = NULL;
+	domainlist->mask = 0;
+	domainlist->keys = NULL;
+	domainlist->keys_size = 0;
+
+	domainlist->mtime = 0;
+
+	domainlist->image = NULL;
+	domainlist->image_size = 0;
 }
 
 void domainlist_free (domainlist_t *domainlist)
@@ -53,6 +141,29 @@ void domainlist_free (domainlist_t *domainlist)
 	domainlist->used = 0;
 
 	buffer_free (&domainlist->data);
+
+	if (domainlist->image) {
+		/* The directory is in the image. */
+		munmap (domainlist->image, domainlist->image_size);
+
+		domainlist->image = NULL;
+		domainlist->image_size = 0;
+	} else {
+		if (domainlist->slots) {
+			free (domainlist->slots);
+		}
+
+		if (domainlist->keys) {
+			free (domainlist->keys);
+		}
+	}
+
+	domainlist->slots = NULL;
+	domainlist->keys = NULL;
+	domainlist->keys_size = 0;
+	domainlist->mask = 0;
+
+	domainlist->mtime = 0;
 }
 
 void domainlist_swap (domainlist_t *domainlist1, domainlist_t *domainlist2)
@@ -64,14 +175,15 @@ void domainlist_swap (domainlist_t *domainlist1, domainlist_t *domainlist2)
 	memcpy (domainlist2, &tmp, sizeof (domainlist_t));
 }
 
-int allocate_domains (domainlist_t *domainlist)
+int allocate_domains (domainlist_t *domainlist, size_t count)
 {
 	domain_t *records;
 	off_t *index;
 	size_t size;
 
-	if (domainlist->used == domainlist->size) {
-		size = domainlist->size + DOMAIN_ALLOC;
+	/* Room for "count" more. */
+	if (domainlist->used + count > domainlist->size) {
+		size = domainlist->used + ((count > DOMAIN_ALLOC) ? count : DOMAIN_ALLOC);
 		index = (off_t *) malloc (size * sizeof (off_t));
 		if (!index) {
 			return -1;
@@ -96,13 +208,13 @@ int allocate_domains (domainlist_t *domainlist)
 	return 0;
 }
 
-int allocate_local_parts (domain_t *domain)
+int allocate_local_parts (domain_t *domain, size_t count)
 {
 	off_t *local_parts;
 	size_t size;
 
-	if (domain->used == domain->size) {
-		size = domain->size + LOCAL_PART_ALLOC;
+	if (domain->used + count > domain->size) {
+		size = domain->used + ((count > LOCAL_PART_ALLOC) ? count : LOCAL_PART_ALLOC);
 		local_parts = (off_t *) realloc (domain->local_parts, size * sizeof (off_t));
 		if (!local_parts) {
 			return -1;
@@ -182,7 +294,7 @@ domain_t *insert_domain (domainlist_t *domainlist, const char *domain, size_t le
 		return &(domainlist->records[domainlist->index[position]]);
 	}
 
-	if (allocate_domains (domainlist) < 0) {
+	if (allocate_domains (domainlist, 1) < 0) {
 		return NULL;
 	}
 
@@ -225,7 +337,7 @@ int insert_local_part (domainlist_t *domainlist, domain_t *domain, const char *l
 		return 0;
 	}
 
-	if (allocate_local_parts (domain) < 0) {
+	if (allocate_local_parts (domain, 1) < 0) {
 		return -1;
 	}
 
@@ -254,123 +366,700 @@ int insert_local_part (domainlist_t *domainlist, domain_t *domain, const char *l
 
 int domainlist_load (domainlist_t *domainlist, const char *directory)
 {
-	DIR *domains;
-	DIR *local_parts;
-	struct dirent *domain;
-	struct dirent *local_part;
+	walk_t walk;
+	walk_domain_t *domain;
 	domain_t *record;
+	pthread_t threads[WALK_MAX_THREADS];
+	struct dirent *entry;
 	struct stat buf;
-	char path[PATH_MAX + 1];
+	size_t nthreads;
 	size_t nmailboxes;
-	size_t dirlen;
-	size_t domainlen;
-	size_t len;
+	size_t data_size;
+	size_t i, j;
+	long n;
 
 	domainlist_free (domainlist);
 
-	domains = opendir (directory);
-	if (!domains) {
+	walk.domains = NULL;
+	walk.ndomains = 0;
+	walk.size = 0;
+	walk.next = 0;
+
+	walk.directory = opendir (directory);
+	if (!walk.directory) {
 		fprintf (stderr, "Couldn't open domains directory %s.\n", directory);
 		return -1;
 	}
 
-	nmailboxes = 0;
+	/* Before listing it: a change made meanwhile makes the result look older. */
+	if (fstat (dirfd (walk.directory), &buf) < 0) {
+		closedir (walk.directory);
 
-	dirlen = strlen (directory);
+		fprintf (stderr, "Couldn't open domains directory %s.\n", directory);
+		return -1;
+	}
+
+	domainlist->mtime = modification_time (&buf);
 
-	/* For each domain... */
-	while ((domain = readdir (domains)) != NULL) {
-		if (domain->d_name[0] == '.') {
+	/* List the domains (the entries which might be directories). */
+	while ((entry = readdir (walk.directory)) != NULL) {
+		if ((entry->d_name[0] == '.') || ((entry->d_type != DT_DIR) && (entry->d_type != DT_UNKNOWN) && (entry->d_type != DT_LNK))) {
 			continue;
 		}
 
-		/* If it is not a directory... */
-		domainlen = snprintf (path, sizeof (path), "%s/%s", directory, domain->d_name);
-		if ((stat (path, &buf) < 0) || (!S_ISDIR (buf.st_mode))) {
-			continue;
+		if (walk.ndomains == walk.size) {
+			domain = (walk_domain_t *) realloc (walk.domains, (walk.size + DOMAIN_ALLOC) * 2 * sizeof (walk_domain_t));
+			if (!domain) {
+				walk_free (&walk);
+
+				fprintf (stderr, "Couldn't allocate memory for listing the domains.\n");
+				return -1;
+			}
+
+			walk.domains = domain;
+			walk.size = (walk.size + DOMAIN_ALLOC) * 2;
 		}
 
-		domainlen -= (dirlen + 1);
+		domain = &(walk.domains[walk.ndomains]);
+		domain->name = strdup (entry->d_name);
+		domain->status = WALK_SKIPPED;
+		domain->mtime = 0;
+		buffer_init (&domain->local_parts, 4 * 1024);
+		domain->sorted = NULL;
+		domain->count = 0;
+
+		if (!domain->name) {
+			walk_free (&walk);
 
-		/* Valid domain name? */
-		if (valid_domain ((const unsigned char *) domain->d_name) < 0) {
-			fprintf (stderr, "%s is not a valid domain name.\n", domain->d_name);
+			fprintf (stderr, "Couldn't allocate memory for listing the domains.\n");
+			return -1;
+		}
+
+		walk.ndomains++;
+	}
+
+	/* Walk the domains with a pool of threads (they take the next one). */
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+	nthreads = (n > 0) ? n : 1;
+	if (nthreads > WALK_MAX_THREADS) {
+		nthreads = WALK_MAX_THREADS;
+	}
+
+	if (nthreads > walk.ndomains) {
+		nthreads = walk.ndomains;
+	}
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create (&(threads[i]), NULL, walk_thread, &walk) != 0) {
+			break;
+		}
+	}
+
+	nthreads = i;
+
+	/* The calling thread works too. */
+	walk_thread (&walk);
+
+	for (i = 1; i < nthreads; i++) {
+		pthread_join (threads[i], NULL);
+	}
+
+	/* Merge the domains in order: every insertion is an append. */
+	qsort (walk.domains, walk.ndomains, sizeof (walk_domain_t), compare_domains);
+
+	data_size = 0;
+	for (i = 0; i < walk.ndomains; i++) {
+		domain = &(walk.domains[i]);
+		if (domain->status == WALK_ERROR) {
+			walk_free (&walk);
+
+			fprintf (stderr, "Couldn't allocate memory for loading domain %s.\n", domain->name);
+			return -1;
+		}
+
+		if (domain->mtime > domainlist->mtime) {
+			domainlist->mtime = domain->mtime;
+		}
+
+		if (domain->status == WALK_LOADED) {
+			data_size += strlen (domain->name) + 1 + domain->local_parts.used;
+		}
+	}
+
+	if ((allocate_domains (domainlist, walk.ndomains) < 0) || (buffer_allocate (&domainlist->data, data_size) < 0)) {
+		walk_free (&walk);
+
+		fprintf (stderr, "Couldn't allocate memory for the domains.\n");
+		return -1;
+	}
+
+	nmailboxes = 0;
+
+	for (i = 0; i < walk.ndomains; i++) {
+		domain = &(walk.domains[i]);
+		if (domain->status != WALK_LOADED) {
 			continue;
 		}
 
 		/* Insert domain. */
-		if ((record = insert_domain (domainlist, domain->d_name, domainlen)) == NULL) {
-			fprintf (stderr, "Couldn't allocate memory for inserting domain %s.\n", domain->d_name);
+		if (((record = insert_domain (domainlist, domain->name, strlen (domain->name))) == NULL) || (allocate_local_parts (record, domain->count) < 0)) {
+			fprintf (stderr, "Couldn't allocate memory for inserting domain %s.\n", domain->name);
 
-			closedir (domains);
+			walk_free (&walk);
 			return -1;
 		}
 
-		local_parts = opendir (path);
-		if (!local_parts) {
-			fprintf (stderr, "Couldn't open domain directory %s.\n", domain->d_name);
-			continue;
+		/* Insert local parts. */
+		for (j = 0; j < domain->count; j++) {
+			if (insert_local_part (domainlist, record, domain->sorted[j], strlen (domain->sorted[j])) < 0) {
+				fprintf (stderr, "Couldn't allocate memory for inserting local part %s of domain %s.\n", domain->sorted[j], domain->name);
+
+				walk_free (&walk);
+				return -1;
+			}
+
+#if DEBUG
+			printf ("Inserted %s@%s.\n", domain->sorted[j], domain->name);
+#endif /* DEBUG */
+
+			nmailboxes++;
 		}
+	}
+
+	walk_free (&walk);
+
+	if (nmailboxes == 0) {
+		fprintf (stderr, "No mailboxes.\n");
+		return -1;
+	}
+
+	if (build_directory (domainlist) < 0) {
+		fprintf (stderr, "Couldn't allocate memory for the recipient directory.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void *walk_thread (void *arg)
+{
+	walk_t *walk;
+	size_t i;
+
+	walk = (walk_t *) arg;
+
+	while ((i = __sync_fetch_and_add (&walk->next, 1)) < walk->ndomains) {
+		walk_domain (walk, &(walk->domains[i]));
+	}
+
+	return NULL;
+}
+
+void walk_domain (walk_t *walk, walk_domain_t *domain)
+{
+	DIR *local_parts;
+	struct dirent *local_part;
+	struct stat buf;
+	char *ptr;
+	size_t len;
+	size_t i;
+	int fd;
+	int ret;
+
+	/* Relative to the domains directory: no path to build and resolve. */
+	fd = openat (dirfd (walk->directory), domain->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		/* If it is not a directory... */
+		if ((fstatat (dirfd (walk->directory), domain->name, &buf, 0) < 0) || (!S_ISDIR (buf.st_mode))) {
+			return;
+		}
+
+		domain->mtime = modification_time (&buf);
+
+		if (valid_domain ((const unsigned char *) domain->name) < 0) {
+			fprintf (stderr, "%s is not a valid domain name.\n", domain->name);
+			return;
+		}
+
+		/* The domain is known, without mailboxes. */
+		fprintf (stderr, "Couldn't open domain directory %s.\n", domain->name);
+
+		domain->status = WALK_LOADED;
+		return;
+	}
+
+	if (fstat (fd, &buf) == 0) {
+		domain->mtime = modification_time (&buf);
+	}
+
+	/* Valid domain name? */
+	if (valid_domain ((const unsigned char *) domain->name) < 0) {
+		fprintf (stderr, "%s is not a valid domain name.\n", domain->name);
+
+		close (fd);
+		return;
+	}
+
+	local_parts = fdopendir (fd);
+	if (!local_parts) {
+		fprintf (stderr, "Couldn't open domain directory %s.\n", domain->name);
+
+		close (fd);
 
-		/* For each local part... */
-		while ((local_part = readdir (local_parts)) != NULL) {
-			if (local_part->d_name[0] == '.') {
-				if (local_part->d_name[1] == 0) {
-					/* Current directory. */
-					continue;
-				}
+		domain->status = WALK_LOADED;
+		return;
+	}
 
-				if (local_part->d_name[1] == '.') {
-					if (local_part->d_name[2] == 0) {
-						/* Parent directory. */
-						continue;
-					}
-				}
+	/* For each local part... */
+	while ((local_part = readdir (local_parts)) != NULL) {
+		/* Local part cannot start with '.' (nor "." and ".."). */
+		if (local_part->d_name[0] == '.') {
+			continue;
+		}
 
-				/* Local part cannot start with '.'. */
+		/* If it is not a directory (stat() only if the file system doesn't tell)... */
+		if (local_part->d_type != DT_DIR) {
+			if ((local_part->d_type != DT_UNKNOWN) && (local_part->d_type != DT_LNK)) {
 				continue;
 			}
 
-			/* If it is not a directory... */
-			len = snprintf (path, sizeof (path), "%s/%s/%s", directory, domain->d_name, local_part->d_name);
-			if ((stat (path, &buf) < 0) || (!S_ISDIR (buf.st_mode))) {
+			if ((fstatat (fd, local_part->d_name, &buf, 0) < 0) || (!S_ISDIR (buf.st_mode))) {
 				continue;
 			}
+		}
 
-			len -= (dirlen + domainlen + 2);
+		/* Valid local part? */
+		if ((ret = valid_local_part ((const unsigned char *) local_part->d_name)) < 0) {
+			fprintf (stderr, "%s is not a valid local part.\n", local_part->d_name);
+			continue;
+		}
 
-			/* Valid local part? */
-			if (valid_local_part ((const unsigned char *) local_part->d_name) < 0) {
-				fprintf (stderr, "%s is not a valid local part.\n", local_part->d_name);
-				continue;
+		len = ret + 1;
+		if (buffer_allocate (&domain->local_parts, len) < 0) {
+			closedir (local_parts);
+
+			domain->status = WALK_ERROR;
+			return;
+		}
+
+		memcpy (domain->local_parts.data + domain->local_parts.used, local_part->d_name, len);
+		domain->local_parts.used += len;
+
+		domain->count++;
+	}
+
+	closedir (local_parts);
+
+	/* Sort them (as the list of local parts of the domain). */
+	if (domain->count > 0) {
+		domain->sorted = (char **) malloc (domain->count * sizeof (char *));
+		if (!domain->sorted) {
+			domain->status = WALK_ERROR;
+			return;
+		}
+
+		ptr = domain->local_parts.data;
+		for (i = 0; i < domain->count; i++) {
+			domain->sorted[i] = ptr;
+			ptr += strlen (ptr) + 1;
+		}
+
+		qsort (domain->sorted, domain->count, sizeof (char *), compare_local_parts);
+	}
+
+	domain->status = WALK_LOADED;
+}
+
+void walk_free (walk_t *walk)
+{
+	size_t i;
+
+	for (i = 0; i < walk->ndomains; i++) {
+		free (walk->domains[i].name);
+		buffer_free (&(walk->domains[i].local_parts));
+
+		if (walk->domains[i].sorted) {
+			free (walk->domains[i].sorted);
+		}
+	}
+
+	if (walk->domains) {
+		free (walk->domains);
+	}
+
+	closedir (walk->directory);
+}
+
+int compare_domains (const void *p1, const void *p2)
+{
+	return strcasecmp (((const walk_domain_t *) p1)->name, ((const walk_domain_t *) p2)->name);
+}
+
+int compare_local_parts (const void *p1, const void *p2)
+{
+	return strcasecmp (*((char * const *) p1), *((char * const *) p2));
+}
+
+int build_directory (domainlist_t *domainlist)
+{
+	domain_t *record;
+	const char *domain;
+	const char *local_part;
+	char *key;
+	uint64_t hash;
+	uint32_t tag;
+	size_t nkeys;
+	size_t keys_size;
+	size_t nslots;
+	size_t i, j, k;
+
+	/* Size of the keys. */
+	nkeys = 0;
+	keys_size = 0;
+
+	for (i = 0; i < domainlist->used; i++) {
+		record = &(domainlist->records[i]);
+		domain = domainlist->data.data + record->domain_name;
+
+		nkeys += 1 + record->used;
+		keys_size += (1 + record->used) * (strlen (domain) + 1);
+
+		for (j = 0; j < record->used; j++) {
+			keys_size += strlen (domainlist->data.data + record->local_parts[j]) + 1;
+		}
+	}
+
+	/* The offsets of the keys are 32-bit: without a directory, binary search is used. */
+	if (keys_size > UINT32_MAX) {
+		return 0;
+	}
+
+	/* At most half of the slots are used. */
+	for (nslots = CACHE_LINE_SIZE / sizeof (domainlist_slot_t); nslots < 2 * nkeys; nslots *= 2);
+
+	if (posix_memalign ((void **) &domainlist->slots, CACHE_LINE_SIZE, nslots * sizeof (domainlist_slot_t)) != 0) {
+		domainlist->slots = NULL;
+		return -1;
+	}
+
+	memset (domainlist->slots, 0, nslots * sizeof (domainlist_slot_t));
+
+	domainlist->keys = (char *) malloc (keys_size);
+	if (!domainlist->keys) {
+		free (domainlist->slots);
+		domainlist->slots = NULL;
+
+		return -1;
+	}
+
+	domainlist->mask = nslots - 1;
+	domainlist->keys_size = keys_size;
+
+	/* Insert the domains and their local parts. */
+	key = domainlist->keys;
+
+	for (i = 0; i < domainlist->used; i++) {
+		record = &(domainlist->records[i]);
+		domain = domainlist->data.data + record->domain_name;
+
+		/* The domain itself first. */
+		for (j = 0; j <= record->used; j++) {
+			local_part = (j == 0) ? NULL : domainlist->data.data + record->local_parts[j - 1];
+
+			hash = hash_key (local_part, domain);
+			if ((tag = (uint32_t) (hash >> 32)) == 0) {
+				tag = 1;
 			}
 
-			/* Insert local part. */
-			if (insert_local_part (domainlist, record, local_part->d_name, len) < 0) {
-				fprintf (stderr, "Couldn't allocate memory for inserting local part %s of domain %s.\n", local_part->d_name, domain->d_name);
+			/* The keys are unique (the lists are): take the first free slot. */
+			for (k = hash & domainlist->mask; domainlist->slots[k].tag; k = (k + 1) & domainlist->mask);
 
-				closedir (local_parts);
-				closedir (domains);
+			domainlist->slots[k].tag = tag;
+			domainlist->slots[k].key = (uint32_t) (key - domainlist->keys);
+
+			key = copy_key (key, local_part, domain);
+		}
+	}
+
+	return 0;
+}
+
+uint64_t hash_key (const char *local_part, const char *domain)
+{
+	const char *ptr;
+	uint64_t hash;
+
+	/* FNV-1a of the case-folded key. */
+	hash = 14695981039346656037ull;
+
+	if (local_part) {
+		for (ptr = local_part; *ptr; ptr++) {
+			hash ^= (unsigned char) FOLD (*ptr);
+			hash *= 1099511628211ull;
+		}
+
+		hash ^= '@';
+		hash *= 1099511628211ull;
+	}
+
+	for (ptr = domain; *ptr; ptr++) {
+		hash ^= (unsigned char) FOLD (*ptr);
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+int compare_key (const char *key, const char *local_part, const char *domain)
+{
+	if (local_part) {
+		for (; *local_part; local_part++, key++) {
+			if (*key != FOLD (*local_part)) {
 				return -1;
 			}
+		}
 
-#if DEBUG
-			printf ("Inserted %s@%s.\n", local_part->d_name, domain->d_name);
-#endif /* DEBUG */
+		if (*key++ != '@') {
+			return -1;
+		}
+	}
 
-			nmailboxes++;
+	for (; *domain; domain++, key++) {
+		if (*key != FOLD (*domain)) {
+			return -1;
 		}
+	}
+
+	return (*key == 0) ? 0 : -1;
+}
 
-		closedir (local_parts);
+domainlist_slot_t *lookup_key (domainlist_t *domainlist, const char *local_part, const char *domain)
+{
+	domainlist_slot_t *slot;
+	uint64_t hash;
+	uint32_t tag;
+	size_t i;
+
+	hash = hash_key (local_part, domain);
+	if ((tag = (uint32_t) (hash >> 32)) == 0) {
+		tag = 1;
 	}
 
-	closedir (domains);
+	/* Linear probing: the next slots are usually in the same cache line. */
+	for (i = hash & domainlist->mask; domainlist->slots[i].tag; i = (i + 1) & domainlist->mask) {
+		slot = &(domainlist->slots[i]);
+		if ((slot->tag == tag) && (slot->key < domainlist->keys_size) && (compare_key (domainlist->keys + slot->key, local_part, domain) == 0)) {
+			return slot;
+		}
+	}
 
-	if (nmailboxes == 0) {
-		fprintf (stderr, "No mailboxes.\n");
+	return NULL;
+}
+
+char *copy_key (char *key, const char *local_part, const char *domain)
+{
+	if (local_part) {
+		for (; *local_part; local_part++) {
+			*key++ = FOLD (*local_part);
+		}
+
+		*key++ = '@';
+	}
+
+	for (; *domain; domain++) {
+		*key++ = FOLD (*domain);
+	}
+
+	*key++ = 0;
+
+	return key;
+}
+
+int domainlist_write (domainlist_t *domainlist, int fd)
+{
+	image_header_t header;
+	static const char padding[CACHE_LINE_SIZE];
+	char *names;
+	const char *name;
+	size_t len;
+	size_t i;
+
+	if (domainlist->mask == 0) {
+		return -1;
+	}
+
+	memset (&header, 0, sizeof (header));
+	header.magic = IMAGE_MAGIC;
+	header.version = IMAGE_VERSION;
+	header.mtime = domainlist->mtime;
+
+	/* Domain names, in the order of the index (the first one is the first domain). */
+	header.names_size = 0;
+	for (i = 0; i < domainlist->used; i++) {
+		header.names_size += strlen (domainlist->data.data + domainlist->records[domainlist->index[i]].domain_name) + 1;
+	}
+
+	names = (char *) malloc (header.names_size);
+	if (!names) {
+		return -1;
+	}
+
+	header.names_size = 0;
+	for (i = 0; i < domainlist->used; i++) {
+		name = domainlist->data.data + domainlist->records[domainlist->index[i]].domain_name;
+		len = strlen (name) + 1;
+
+		memcpy (names + header.names_size, name, len);
+		header.names_size += len;
+	}
+
+	header.names = sizeof (image_header_t);
+	header.slots = ALIGN (header.names + header.names_size);
+	header.nslots = domainlist->mask + 1;
+	header.keys = header.slots + header.nslots * sizeof (domainlist_slot_t);
+	header.keys_size = domainlist->keys_size;
+	header.size = header.keys + header.keys_size;
+
+	if ((write_all (fd, &header, sizeof (header)) < 0) || (write_all (fd, names, header.names_size) < 0) || (write_all (fd, padding, header.slots - header.names - header.names_size) < 0) || (write_all (fd, domainlist->slots, header.nslots * sizeof (domainlist_slot_t)) < 0) || (write_all (fd, domainlist->keys, header.keys_size) < 0)) {
+		free (names);
+		return -1;
+	}
+
+	free (names);
+
+	return 0;
+}
+
+int domainlist_save (domainlist_t *domainlist, const char *path)
+{
+	char tmppath[PATH_MAX + 1];
+	int fd;
+
+	/* Write a new file and rename it: the processes using the old one keep it. */
+	if (snprintf (tmppath, sizeof (tmppath), "%s.tmp", path) >= sizeof (tmppath)) {
+		return -1;
+	}
+
+	if ((fd = open (tmppath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+		return -1;
+	}
+
+	if ((domainlist_write (domainlist, fd) < 0) || (fsync (fd) < 0)) {
+		close (fd);
+		unlink (tmppath);
+
+		return -1;
+	}
+
+	close (fd);
+
+	if (rename (tmppath, path) < 0) {
+		unlink (tmppath);
+		return -1;
+	}
+
+	return 0;
+}
+
+int domainlist_map (domainlist_t *domainlist, const char *path, const char *directory)
+{
+	int ret;
+	int fd;
+
+	if ((fd = open (path, O_RDONLY)) < 0) {
+		return -1;
+	}
+
+	ret = domainlist_map_fd (domainlist, fd, directory);
+
+	close (fd);
+
+	return ret;
+}
+
+int domainlist_map_fd (domainlist_t *domainlist, int fd, const char *directory)
+{
+	image_header_t *header;
+	struct stat buf;
+	char domain_path[PATH_MAX + 1];
+	char *image;
+	const char *name;
+	const char *end;
+
+	if ((fstat (fd, &buf) < 0) || (buf.st_size < sizeof (image_header_t))) {
 		return -1;
 	}
 
+	image = (char *) mmap (NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED) {
+		return -1;
+	}
+
+	/* Valid image? */
+	header = (image_header_t *) image;
+	if ((header->magic != IMAGE_MAGIC) || (header->version != IMAGE_VERSION) || (header->size != buf.st_size) ||
+	    (header->names != sizeof (image_header_t)) || (header->names_size == 0) || (header->names_size > header->size - header->names) || (image[header->names + header->names_size - 1] != 0) ||
+	    (header->slots % CACHE_LINE_SIZE != 0) || (header->slots < header->names + header->names_size) || (header->nslots < CACHE_LINE_SIZE / sizeof (domainlist_slot_t)) || (header->nslots & (header->nslots - 1)) || (header->nslots > (header->size - header->slots) / sizeof (domainlist_slot_t)) ||
+	    (header->keys != header->slots + header->nslots * sizeof (domainlist_slot_t)) || (header->keys_size == 0) || (header->keys_size > UINT32_MAX) || (header->keys_size != header->size - header->keys) || (image[header->keys + header->keys_size - 1] != 0)) {
+		munmap (image, buf.st_size);
+		return -1;
+	}
+
+	/* Up to date? A domain or a mailbox added or removed since it was
+	 * compiled has changed the modification time of its directory.
+	 */
+	if (directory) {
+		if ((stat (directory, &buf) < 0) || (modification_time (&buf) > header->mtime)) {
+			munmap (image, header->size);
+			return -1;
+		}
+
+		end = image + header->names + header->names_size;
+		for (name = image + header->names; name < end; name += strlen (name) + 1) {
+			snprintf (domain_path, sizeof (domain_path), "%s/%s", directory, name);
+			if ((stat (domain_path, &buf) < 0) || (!S_ISDIR (buf.st_mode)) || (modification_time (&buf) > header->mtime)) {
+				munmap (image, header->size);
+				return -1;
+			}
+		}
+	}
+
+	domainlist_free (domainlist);
+
+	domainlist->image = image;
+	domainlist->image_size = header->size;
+
+	domainlist->slots = (domainlist_slot_t *) (image + header->slots);
+	domainlist->mask = header->nslots - 1;
+	domainlist->keys = image + header->keys;
+	domainlist->keys_size = header->keys_size;
+
+	domainlist->mtime = header->mtime;
+
+	return 0;
+}
+
+int64_t modification_time (const struct stat *buf)
+{
+	return (int64_t) buf->st_mtim.tv_sec * 1000000000 + buf->st_mtim.tv_nsec;
+}
+
+int write_all (int fd, const void *data, size_t len)
+{
+	const char *ptr;
+	ssize_t bytes;
+
+	ptr = (const char *) data;
+
+	while (len > 0) {
+		if ((bytes = write (fd, ptr, len)) < 0) {
+			return -1;
+		}
+
+		ptr += bytes;
+		len -= bytes;
+	}
+
 	return 0;
 }
 
@@ -378,6 +1067,10 @@ int domainlist_search_domain (domainlist_t *domainlist, const char *domain)
 {
 	unsigned int position;
 
+	if (domainlist->mask != 0) {
+		return (lookup_key (domainlist, NULL, domain) != NULL) ? 0 : -1;
+	}
+
 	if (search_domain (domainlist, domain, &position) < 0) {
 		return -1;
 	}
@@ -390,6 +1083,14 @@ int domainlist_search (domainlist_t *domainlist, const char *local_part, const c
 	domain_t *record;
 	unsigned int position;
 
+	if (domainlist->mask != 0) {
+		if (lookup_key (domainlist, local_part, domain) != NULL) {
+			return 0;
+		}
+
+		return (lookup_key (domainlist, NULL, domain) != NULL) ? -1 : -2;
+	}
+
 	if (search_domain (domainlist, domain, &position) < 0) {
 		return -2;
 	}
@@ -401,6 +1102,11 @@ int domainlist_search (domainlist_t *domainlist, const char *local_part, const c
 
 const char *domainlist_get_first_domain (domainlist_t *domainlist)
 {
+	/* The names in the image are sorted as the index. */
+	if (domainlist->image) {
+		return (domainlist->image + ((image_header_t *) domainlist->image)->names);
+	}
+
 	if (domainlist->used == 0) {
 		return NULL;
 	}
@@ -1,6 +1,7 @@
 #ifndef DOMAINLIST_H
 #define DOMAINLIST_H
 
+#include <stdint.h>
 #include "buffer.h"
 
 typedef struct {
@@ -11,6 +12,16 @@ typedef struct {
 	size_t used;
 } domain_t;
 
+/* Recipient directory, built by domainlist_load(): open addressing hash table
+ * over the case-folded keys "<local part>@<domain>" and "<domain>". A slot holds
+ * a tag (upper half of the hash) and the offset of its key, so that a lookup
+ * reads one line of slots and, usually, a single key.
+ */
+typedef struct {
+	uint32_t tag; /* 0: free slot. */
+	uint32_t key; /* Offset in "keys". */
+} domainlist_slot_t;
+
 typedef struct {
 	domain_t *records;
 	off_t *index;
@@ -19,6 +30,18 @@ typedef struct {
 	size_t used;
 
 	buffer_t data;
+
+	domainlist_slot_t *slots;
+	size_t mask; /* # of slots - 1 (0: no directory, binary search). */
+	char *keys;
+	size_t keys_size;
+
+	/* Latest modification (nanoseconds) of the domains directory and of its domains. */
+	int64_t mtime;
+
+	/* Compiled image (domainlist_map()): the directory points into it. */
+	char *image;
+	size_t image_size;
 } domainlist_t;
 
 void domainlist_init (domainlist_t *domainlist);
@@ -28,6 +51,18 @@ void domainlist_swap (domainlist_t *domainlist1, domainlist_t *domainlist2);
 
 int domainlist_load (domainlist_t *domainlist, const char *directory);
 
+/* Compiled image of the recipient directory: the domain names, the hash table
+ * and the keys in a single file, mapped read-only (and shared through the page
+ * cache) by the processes. domainlist_map() fails if the image is missing,
+ * invalid or older than any of the domains of "directory".
+ */
+int domainlist_save (domainlist_t *domainlist, const char *path);
+int domainlist_map (domainlist_t *domainlist, const char *path, const char *directory);
+
+/* The same on an open file ("directory" NULL: no check of the domains). */
+int domainlist_write (domainlist_t *domainlist, int fd);
+int domainlist_map_fd (domainlist_t *domainlist, int fd, const char *directory);
+
 int domainlist_search_domain (domainlist_t *domainlist, const char *domain);
 int domainlist_search (domainlist_t *domainlist, const char *local_part, const char *domain);
 
@@ -0,0 +1,512 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "envelope.h"
+#include "input_stream.h"
+#include "mail_transaction.h"
+#include "parser.h"
+
+#define ALIGN(size) (((size) + ENVELOPE_ALIGNMENT - 1) & ~((size_t) ENVELOPE_ALIGNMENT - 1))
+
+#define UPGRADE_SUFFIX ".upgrade"
+
+static int allocate (buffer_t *buffer, envelope_t *envelope, size_t ndomains, size_t nrecipients, size_t strings_size);
+static uint32_t add_string (envelope_t *envelope, size_t *position, const char *string);
+static void set_pointers (envelope_t *envelope);
+static int validate (envelope_t *envelope);
+static int read_text_envelope (input_stream_t *input_stream, mail_transaction_t *mail_transaction, off_t *offset);
+static int write_upgraded_file (const char *path, buffer_t *buffer, int fd, off_t offset);
+
+void envelope_init (envelope_t *envelope)
+{
+	envelope->data = NULL;
+
+	envelope->header = NULL;
+	envelope->domains = NULL;
+	envelope->recipients = NULL;
+	envelope->strings = NULL;
+}
+
+void envelope_free (envelope_t *envelope)
+{
+	if (envelope->data) {
+		free (envelope->data);
+	}
+
+	envelope_init (envelope);
+}
+
+int envelope_build (buffer_t *buffer, const char *reverse_path, domainlist_t *forward_paths, domainlist_t *local_domains, uint32_t flags)
+{
+	envelope_t envelope;
+	envelope_domain_t *record;
+	domain_t *domain;
+	char *data;
+	size_t nrecipients;
+	size_t strings_size;
+	size_t position;
+	size_t i, j;
+
+	data = forward_paths->data.data;
+
+	/* Compute the size of the tables. */
+	nrecipients = 0;
+	strings_size = strlen (reverse_path) + 1;
+
+	for (i = 0; i < forward_paths->used; i++) {
+		domain = &(forward_paths->records[i]);
+
+		nrecipients += domain->used;
+		strings_size += strlen (data + domain->domain_name) + 1;
+
+		for (j = 0; j < domain->used; j++) {
+			strings_size += strlen (data + domain->local_parts[j]) + 1;
+		}
+	}
+
+	if (allocate (buffer, &envelope, forward_paths->used, nrecipients, strings_size) < 0) {
+		return -1;
+	}
+
+	envelope.header->flags = flags;
+
+	position = 0;
+	envelope.header->reverse_path = add_string (&envelope, &position, reverse_path);
+
+	nrecipients = 0;
+
+	for (i = 0; i < forward_paths->used; i++) {
+		domain = &(forward_paths->records[i]);
+		record = &(envelope.domains[i]);
+
+		record->name = add_string (&envelope, &position, data + domain->domain_name);
+		record->first = nrecipients;
+		record->count = domain->used;
+
+		/* Local domains are resolved once, here. */
+		if (domainlist_search_domain (local_domains, data + domain->domain_name) == 0) {
+			record->flags = ENVELOPE_LOCAL;
+		} else {
+			record->flags = ENVELOPE_RELAY;
+		}
+
+		for (j = 0; j < domain->used; j++) {
+			envelope.recipients[nrecipients].local_part = add_string (&envelope, &position, data + domain->local_parts[j]);
+			envelope.recipients[nrecipients].state = ENVELOPE_PENDING;
+			nrecipients++;
+		}
+	}
+
+	return 0;
+}
+
+int envelope_build_subset (buffer_t *buffer, envelope_t *envelope, uint32_t flags)
+{
+	envelope_t subset;
+	envelope_domain_t *domain;
+	envelope_domain_t *record;
+	size_t ndomains;
+	size_t nrecipients;
+	size_t strings_size;
+	size_t position;
+	size_t i, j;
+
+	/* Compute the size of the tables. */
+	ndomains = 0;
+	nrecipients = 0;
+	strings_size = strlen (envelope_string (envelope, envelope->header->reverse_path)) + 1;
+
+	for (i = 0; i < envelope->header->ndomains; i++) {
+		domain = &(envelope->domains[i]);
+		if (!(domain->flags & flags)) {
+			continue;
+		}
+
+		ndomains++;
+		nrecipients += domain->count;
+		strings_size += strlen (envelope_string (envelope, domain->name)) + 1;
+
+		for (j = 0; j < domain->count; j++) {
+			strings_size += strlen (envelope_string (envelope, envelope->recipients[domain->first + j].local_part)) + 1;
+		}
+	}
+
+	if (allocate (buffer, &subset, ndomains, nrecipients, strings_size) < 0) {
+		return -1;
+	}
+
+	subset.header->flags = envelope_flags (envelope);
+
+	position = 0;
+	subset.header->reverse_path = add_string (&subset, &position, envelope_string (envelope, envelope->header->reverse_path));
+
+	ndomains = 0;
+	nrecipients = 0;
+
+	for (i = 0; i < envelope->header->ndomains; i++) {
+		domain = &(envelope->domains[i]);
+		if (!(domain->flags & flags)) {
+			continue;
+		}
+
+		record = &(subset.domains[ndomains++]);
+
+		record->name = add_string (&subset, &position, envelope_string (envelope, domain->name));
+		record->first = nrecipients;
+		record->count = domain->count;
+		record->flags = domain->flags;
+
+		for (j = 0; j < domain->count; j++) {
+			subset.recipients[nrecipients] = envelope->recipients[domain->first + j];
+			subset.recipients[nrecipients].local_part = add_string (&subset, &position, envelope_string (envelope, envelope->recipients[domain->first + j].local_part));
+			nrecipients++;
+		}
+	}
+
+	return 0;
+}
+
+int envelope_read (envelope_t *envelope, int fd)
+{
+	envelope_header_t *header;
+	char *data;
+	ssize_t bytes;
+	size_t size;
+
+	envelope_init (envelope);
+
+	envelope->data = (char *) malloc (ENVELOPE_READ_SIZE);
+	if (!envelope->data) {
+		return -1;
+	}
+
+	/* In most cases, the whole envelope comes with the first read. */
+	bytes = pread (fd, envelope->data, ENVELOPE_READ_SIZE, 0);
+	if (bytes < (ssize_t) sizeof (envelope_header_t)) {
+		envelope_free (envelope);
+		return -1;
+	}
+
+	header = (envelope_header_t *) envelope->data;
+	if ((header->magic != ENVELOPE_MAGIC) || (header->version != ENVELOPE_VERSION) || (header->header_size < ENVELOPE_MIN_HEADER_SIZE) || (header->header_size % sizeof (uint32_t) != 0) || (header->size < header->header_size) || (header->size > ENVELOPE_MAX_SIZE) || (header->size % ENVELOPE_ALIGNMENT != 0)) {
+		envelope_free (envelope);
+		return -1;
+	}
+
+	/* Large envelope? Read the rest. */
+	size = header->size;
+	if (size > (size_t) bytes) {
+		data = (char *) realloc (envelope->data, size);
+		if (!data) {
+			envelope_free (envelope);
+			return -1;
+		}
+
+		envelope->data = data;
+
+		if (pread (fd, envelope->data + bytes, size - bytes, bytes) != (ssize_t) (size - bytes)) {
+			envelope_free (envelope);
+			return -1;
+		}
+	}
+
+	set_pointers (envelope);
+
+	if (validate (envelope) < 0) {
+		envelope_free (envelope);
+		return -1;
+	}
+
+	return 0;
+}
+
+int envelope_write (envelope_t *envelope, int fd)
+{
+	/* The strings don't change. */
+	if (pwrite (fd, envelope->data, envelope->header->strings, 0) != (ssize_t) envelope->header->strings) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int envelope_upgrade (const char *path, domainlist_t *local_domains)
+{
+	input_stream_t input_stream;
+	mail_transaction_t mail_transaction;
+	buffer_t buffer;
+	uint32_t magic;
+	off_t offset;
+	int fd;
+	int ret;
+
+	if ((fd = open (path, O_RDONLY)) < 0) {
+		return -1;
+	}
+
+	/* Already in the binary format? */
+	if ((pread (fd, &magic, sizeof (magic), 0) == sizeof (magic)) && (magic == ENVELOPE_MAGIC)) {
+		close (fd);
+		return 0;
+	}
+
+	if (input_stream_fdopen (&input_stream, fd, ENVELOPE_READ_SIZE) < 0) {
+		close (fd);
+		return -1;
+	}
+
+	mail_transaction_init (&mail_transaction);
+	buffer_init (&buffer, ENVELOPE_READ_SIZE);
+
+	/* The messages of the text format were received with DATA. */
+	if ((read_text_envelope (&input_stream, &mail_transaction, &offset) < 0) || (envelope_build (&buffer, mail_transaction.reverse_path, &mail_transaction.forward_paths, local_domains, 0) < 0) || (write_upgraded_file (path, &buffer, fd, offset) < 0)) {
+		ret = -1;
+	} else {
+		ret = 1;
+	}
+
+	buffer_free (&buffer);
+	mail_transaction_free (&mail_transaction);
+
+	input_stream_fclose (&input_stream);
+
+	return ret;
+}
+
+int read_text_envelope (input_stream_t *input_stream, mail_transaction_t *mail_transaction, off_t *offset)
+{
+	unsigned char *argument;
+	unsigned char *local_part;
+	size_t local_part_len;
+	unsigned char *domain;
+	size_t domainlen;
+	size_t size;
+
+	char line[TEXT_LINE_MAXLEN + 1];
+	size_t len;
+
+	int error;
+	int ret;
+
+	size = 0;
+	error = 0;
+
+	/* "MAIL FROM: <reverse path>" and "RCPT TO: <forward path>" lines, up to an empty line. */
+	do {
+		if ((!input_stream_fgets (input_stream, line, sizeof (line), &len)) || (line[len - 1] != '\n')) {
+			return -1;
+		}
+
+		size += len;
+
+		/* End of the envelope? */
+		if ((len == 1) || ((len == 2) && (line[0] == '\r'))) {
+			/* If there is not reverse-path or no recipients... */
+			if ((!mail_transaction->reverse_path[0]) || (mail_transaction->forward_paths.used == 0)) {
+				return -1;
+			}
+
+			*offset = size;
+
+			return 0;
+		}
+
+		if (((ret = parse_smtp_command ((unsigned char *) line, &argument, &error)) < 0) || (error != 0)) {
+			return -1;
+		}
+
+		if ((eSmtpCommand) ret == MAIL) {
+			/* If there was another "MAIL FROM: <reverse_path>" line... */
+			if (mail_transaction->reverse_path[0]) {
+				return -1;
+			}
+
+			if (parse_reverse_path (argument, &local_part, &local_part_len, &domain, &domainlen, NULL, NULL) < 0) {
+				return -1;
+			}
+
+			/* Null reverse path? */
+			if (!local_part) {
+				memcpy (mail_transaction->reverse_path, "<>", 3);
+			} else {
+				mail_transaction_set_reverse_path (mail_transaction, (const char *) local_part, local_part_len, (const char *) domain, domainlen);
+			}
+		} else if ((eSmtpCommand) ret == RCPT) {
+			if (parse_forward_path (argument, &local_part, &local_part_len, &domain, &domainlen) < 0) {
+				return -1;
+			}
+
+			if (mail_transaction_add_forward_path (mail_transaction, (const char *) local_part, local_part_len, (const char *) domain, domainlen) < 0) {
+				return -1;
+			}
+		} else {
+			return -1;
+		}
+	} while (1);
+}
+
+int write_upgraded_file (const char *path, buffer_t *buffer, int fd, off_t offset)
+{
+	char tmppath[PATH_MAX + 1];
+	struct stat buf;
+	size_t written;
+	ssize_t bytes;
+	int out;
+
+	if (fstat (fd, &buf) < 0) {
+		return -1;
+	}
+
+	if (snprintf (tmppath, sizeof (tmppath), "%s%s", path, UPGRADE_SUFFIX) >= (int) sizeof (tmppath)) {
+		return -1;
+	}
+
+	if ((out = open (tmppath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+		return -1;
+	}
+
+	/* The new envelope... */
+	for (written = 0; written < buffer->used; written += bytes) {
+		if ((bytes = write (out, buffer->data + written, buffer->used - written)) <= 0) {
+			close (out);
+			unlink (tmppath);
+			return -1;
+		}
+	}
+
+	/* then the message, as it was. */
+	while (offset < buf.st_size) {
+		if (sendfile (out, fd, &offset, buf.st_size - offset) <= 0) {
+			close (out);
+			unlink (tmppath);
+			return -1;
+		}
+	}
+
+	/* Replace the old file only once the new one is on disk. */
+	if ((fsync (out) < 0) || (close (out) < 0) || (rename (tmppath, path) < 0)) {
+		unlink (tmppath);
+		return -1;
+	}
+
+	return 0;
+}
+
+int allocate (buffer_t *buffer, envelope_t *envelope, size_t ndomains, size_t nrecipients, size_t strings_size)
+{
+	envelope_header_t *header;
+	size_t strings;
+	size_t size;
+
+	strings = sizeof (envelope_header_t) + ndomains * sizeof (envelope_domain_t) + nrecipients * sizeof (envelope_recipient_t);
+	size = ALIGN (strings + strings_size);
+
+	if (size > ENVELOPE_MAX_SIZE) {
+		return -1;
+	}
+
+	/* The tables are accessed in place: the envelope must be at the beginning of the buffer. */
+	if ((buffer->used != 0) || (buffer_allocate (buffer, size) < 0)) {
+		return -1;
+	}
+
+	memset (buffer->data, 0, size);
+
+	header = (envelope_header_t *) buffer->data;
+	header->magic = ENVELOPE_MAGIC;
+	header->version = ENVELOPE_VERSION;
+	header->header_size = sizeof (envelope_header_t);
+	header->size = size;
+	header->ndomains = ndomains;
+	header->nrecipients = nrecipients;
+	header->strings = strings;
+
+	buffer->used = size;
+
+	/* The envelope doesn't own the buffer. */
+	envelope->data = buffer->data;
+	set_pointers (envelope);
+	envelope->data = NULL;
+
+	return 0;
+}
+
+uint32_t add_string (envelope_t *envelope, size_t *position, const char *string)
+{
+	uint32_t offset;
+	size_t len;
+
+	offset = *position;
+
+	len = strlen (string) + 1;
+	memcpy (envelope->strings + offset, string, len);
+	*position += len;
+
+	return offset;
+}
+
+void set_pointers (envelope_t *envelope)
+{
+	envelope->header = (envelope_header_t *) envelope->data;
+	envelope->domains = (envelope_domain_t *) (envelope->data + envelope->header->header_size);
+	envelope->recipients = (envelope_recipient_t *) (envelope->data + envelope->header->header_size + envelope->header->ndomains * sizeof (envelope_domain_t));
+	envelope->strings = envelope->data + envelope->header->strings;
+}
+
+int validate (envelope_t *envelope)
+{
+	envelope_header_t *header;
+	envelope_domain_t *domain;
+	size_t strings_size;
+	size_t nrecipients;
+	size_t i;
+
+	header = envelope->header;
+
+	/* Do the tables fit? */
+	if ((header->ndomains > ENVELOPE_MAX_SIZE / sizeof (envelope_domain_t)) || (header->nrecipients > ENVELOPE_MAX_SIZE / sizeof (envelope_recipient_t))) {
+		return -1;
+	}
+
+	if ((header->strings < header->header_size + header->ndomains * sizeof (envelope_domain_t) + header->nrecipients * sizeof (envelope_recipient_t)) || (header->strings >= header->size)) {
+		return -1;
+	}
+
+	/* Every string has to be terminated inside the string table. */
+	strings_size = header->size - header->strings;
+	if (envelope->strings[strings_size - 1] != 0) {
+		return -1;
+	}
+
+	if (header->reverse_path >= strings_size) {
+		return -1;
+	}
+
+	/* The domains must cover the recipients in order. */
+	nrecipients = 0;
+	for (i = 0; i < header->ndomains; i++) {
+		domain = &(envelope->domains[i]);
+		if ((domain->first != nrecipients) || (domain->count == 0) || (domain->count > header->nrecipients - nrecipients) || (domain->name >= strings_size)) {
+			return -1;
+		}
+
+		nrecipients += domain->count;
+	}
+
+	if (nrecipients != header->nrecipients) {
+		return -1;
+	}
+
+	for (i = 0; i < header->nrecipients; i++) {
+		if (envelope->recipients[i].local_part >= strings_size) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
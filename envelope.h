@@ -0,0 +1,106 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "domainlist.h"
+
+/* Binary envelope stored at the beginning of every spool file (received and relay).
+ * Layout (native byte order, every table 4-byte aligned):
+ *   envelope_header_t
+ *   envelope_domain_t [ndomains]        (recipients grouped by domain)
+ *   envelope_recipient_t [nrecipients]
+ *   string table                        (NUL-terminated strings)
+ *   padding up to a multiple of ENVELOPE_ALIGNMENT
+ * The message starts right after the envelope, at offset "size". A single pread()
+ * of ENVELOPE_READ_SIZE bytes is enough for any ordinary envelope.
+ */
+
+#define ENVELOPE_MAGIC      0x31564e45 /* "ENV1" */
+#define ENVELOPE_VERSION    1
+
+#define ENVELOPE_ALIGNMENT  8
+#define ENVELOPE_READ_SIZE  4096
+#define ENVELOPE_MAX_SIZE   (1024 * 1024)
+
+/* Message flags. */
+#define ENVELOPE_CHUNKED    0x01 /* Received with BDAT: stored as sent, not dot-stuffed. */
+
+/* Domain flags. */
+#define ENVELOPE_LOCAL      0x01 /* Delivered to the mailboxes of the domains directory. */
+#define ENVELOPE_RELAY      0x02 /* Relayed to another SMTP server. */
+
+/* Recipient states. */
+#define ENVELOPE_PENDING    0
+#define ENVELOPE_DELIVERED  1
+#define ENVELOPE_FAILED     2
+#define ENVELOPE_DEFERRED   3
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size; /* sizeof (envelope_header_t) of the version which wrote it. */
+	uint32_t size; /* Size of the envelope (offset of the message). */
+	uint32_t ndomains;
+	uint32_t nrecipients;
+	uint32_t strings; /* Offset of the string table. */
+	uint32_t reverse_path; /* Offset in the string table. */
+	uint32_t attempts; /* Delivery attempts which left recipients deferred. */
+	uint32_t flags; /* Message flags (not in the envelopes written before them). */
+} envelope_header_t;
+
+/* Smallest header accepted: the one written before the message flags. */
+#define ENVELOPE_MIN_HEADER_SIZE offsetof (envelope_header_t, flags)
+
+#define envelope_flags(envelope) (((envelope)->header->header_size > ENVELOPE_MIN_HEADER_SIZE) ? (envelope)->header->flags : 0)
+
+typedef struct {
+	uint32_t name; /* Offset in the string table. */
+	uint32_t first; /* First recipient. */
+	uint32_t count; /* Number of recipients. */
+	uint32_t flags;
+} envelope_domain_t;
+
+typedef struct {
+	uint32_t local_part; /* Offset in the string table. */
+	uint8_t state;
+	uint8_t reserved[3];
+} envelope_recipient_t;
+
+typedef struct {
+	char *data;
+
+	envelope_header_t *header;
+	envelope_domain_t *domains;
+	envelope_recipient_t *recipients;
+	char *strings;
+} envelope_t;
+
+#define envelope_string(envelope, offset) ((envelope)->strings + (offset))
+
+void envelope_init (envelope_t *envelope);
+void envelope_free (envelope_t *envelope);
+
+/* Append to an empty buffer the envelope of a transaction ("flags": message
+ * flags). Domains found in "local_domains" are flagged ENVELOPE_LOCAL, the
+ * others ENVELOPE_RELAY.
+ */
+int envelope_build (buffer_t *buffer, const char *reverse_path, domainlist_t *forward_paths, domainlist_t *local_domains, uint32_t flags);
+
+/* Append to an empty buffer the envelope with the domains of "envelope" having any of "flags". */
+int envelope_build_subset (buffer_t *buffer, envelope_t *envelope, uint32_t flags);
+
+/* Read and validate the envelope at the beginning of the file. */
+int envelope_read (envelope_t *envelope, int fd);
+
+/* Write back the header and the tables (the recipient states) of an envelope read from "fd". */
+int envelope_write (envelope_t *envelope, int fd);
+
+/* Rewrite a spool file still in the text format of the previous versions
+ * ("MAIL FROM:" and "RCPT TO:" lines, then an empty line) with a binary
+ * envelope. 1 if the file has been upgraded, 0 if it didn't need it.
+ */
+int envelope_upgrade (const char *path, domainlist_t *local_domains);
+
+#endif /* ENVELOPE_H */
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "fanout.h"
+
+#define PIPE_SIZE         (1024 * 1024)
+#define READ_BUFFER_SIZE  (64 * 1024)
+
+static int copy_file (int fd_in, off_t offset, off_t len, int fd_out);
+static int splice_files (int fd_in, off_t offset, off_t len, size_t nfds, int *fd_vector);
+static int read_write_files (int fd_in, off_t offset, off_t len, size_t nfds, int *fd_vector);
+static int splice_all (int fd_in, int fd_out, size_t len);
+
+/* Return values of the per-file strategies. */
+#define COPIED        0
+#define ERROR        -1
+#define NOT_SUPPORTED 1
+
+int fanout_copy (int fd_in, off_t offset, size_t nfds, int *fd_vector)
+{
+	struct stat buf;
+	int *pending;
+	size_t npending;
+	off_t len;
+	size_t i;
+	int ret;
+
+	if (fstat (fd_in, &buf) < 0) {
+		return -1;
+	}
+
+	if ((len = buf.st_size - offset) <= 0) {
+		return 0;
+	}
+
+	pending = (int *) malloc (nfds * sizeof (int));
+	if (!pending) {
+		/* Couldn't allocate memory. */
+		return -1;
+	}
+
+	/* Try in-kernel copies file by file. */
+	npending = 0;
+	for (i = 0; i < nfds; i++) {
+		ret = copy_file (fd_in, offset, len, fd_vector[i]);
+
+		if (ret == ERROR) {
+			free (pending);
+			return -1;
+		} else if (ret == NOT_SUPPORTED) {
+			pending[npending++] = fd_vector[i];
+		}
+	}
+
+	/* Read the message once for the files left. */
+	if (npending > 0) {
+		if ((ret = splice_files (fd_in, offset, len, npending, pending)) == NOT_SUPPORTED) {
+			ret = read_write_files (fd_in, offset, len, npending, pending);
+		}
+	} else {
+		ret = COPIED;
+	}
+
+	free (pending);
+
+	return (ret == COPIED) ? 0 : -1;
+}
+
+int copy_file (int fd_in, off_t offset, off_t len, int fd_out)
+{
+	loff_t off_in;
+	ssize_t bytes;
+
+	off_in = offset;
+
+	do {
+		if ((bytes = copy_file_range (fd_in, &off_in, fd_out, NULL, len, 0)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			/* If nothing has been copied yet, try another way. */
+			if ((off_in == offset) && ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) || (errno == EOPNOTSUPP) || (errno == EBADF))) {
+				return NOT_SUPPORTED;
+			}
+
+			return ERROR;
+		} else if (bytes == 0) {
+			/* The file has shrunk? */
+			return ERROR;
+		}
+
+		len -= bytes;
+	} while (len > 0);
+
+	return COPIED;
+}
+
+int splice_files (int fd_in, off_t offset, off_t len, size_t nfds, int *fd_vector)
+{
+	int source[2];
+	int copy[2];
+	loff_t off_in;
+	ssize_t bytes;
+	size_t chunk;
+	int source_size;
+	int copy_size;
+	size_t i;
+	int ret;
+
+	if (pipe2 (source, O_CLOEXEC) < 0) {
+		return NOT_SUPPORTED;
+	}
+
+	if (pipe2 (copy, O_CLOEXEC) < 0) {
+		close (source[0]);
+		close (source[1]);
+		return NOT_SUPPORTED;
+	}
+
+	/* Bigger pipes, fewer system calls (if we are allowed to, see
+	 * /proc/sys/fs/pipe-max-size, otherwise they keep their size).
+	 */
+	if ((source_size = fcntl (source[1], F_SETPIPE_SZ, PIPE_SIZE)) < 0) {
+		source_size = fcntl (source[1], F_GETPIPE_SZ);
+	}
+
+	if ((copy_size = fcntl (copy[1], F_SETPIPE_SZ, PIPE_SIZE)) < 0) {
+		copy_size = fcntl (copy[1], F_GETPIPE_SZ);
+	}
+
+	if ((source_size <= 0) || (copy_size <= 0)) {
+		close (source[0]);
+		close (source[1]);
+		close (copy[0]);
+		close (copy[1]);
+		return NOT_SUPPORTED;
+	}
+
+	/* tee() can't duplicate more than the copy pipe holds. */
+	chunk = (source_size < copy_size) ? source_size : copy_size;
+
+	off_in = offset;
+	ret = COPIED;
+
+	do {
+		/* Fill the pipe from the page cache... */
+		if ((bytes = splice (fd_in, &off_in, source[1], NULL, (len < chunk) ? len : chunk, SPLICE_F_MOVE)) <= 0) {
+			if ((bytes < 0) && (errno == EINTR)) {
+				continue;
+			}
+
+			/* If the input file can't be spliced, nothing has been written yet. */
+			ret = ((bytes < 0) && (off_in == offset) && (errno == EINVAL)) ? NOT_SUPPORTED : ERROR;
+			break;
+		}
+
+		len -= bytes;
+
+		/* duplicate it for all the files but the last one... */
+		for (i = 0; i + 1 < nfds; i++) {
+			if (tee (source[0], copy[1], bytes, 0) != bytes) {
+				ret = ERROR;
+				break;
+			}
+
+			if (splice_all (copy[0], fd_vector[i], bytes) < 0) {
+				ret = ERROR;
+				break;
+			}
+		}
+
+		/* and move it to the last one. */
+		if ((ret == ERROR) || (splice_all (source[0], fd_vector[nfds - 1], bytes) < 0)) {
+			ret = ERROR;
+			break;
+		}
+	} while (len > 0);
+
+	close (source[0]);
+	close (source[1]);
+	close (copy[0]);
+	close (copy[1]);
+
+	return ret;
+}
+
+int splice_all (int fd_in, int fd_out, size_t len)
+{
+	ssize_t bytes;
+
+	do {
+		if ((bytes = splice (fd_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE)) <= 0) {
+			if ((bytes < 0) && (errno == EINTR)) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		len -= bytes;
+	} while (len > 0);
+
+	return 0;
+}
+
+int read_write_files (int fd_in, off_t offset, off_t len, size_t nfds, int *fd_vector)
+{
+	char buffer[READ_BUFFER_SIZE];
+	ssize_t bytes;
+	size_t i;
+
+	do {
+		/* Read chunk from input file... */
+		if ((bytes = pread (fd_in, buffer, sizeof (buffer), offset)) <= 0) {
+			if ((bytes < 0) && (errno == EINTR)) {
+				continue;
+			}
+
+			return ERROR;
+		}
+
+		/* and write it to the recipients. */
+		for (i = 0; i < nfds; i++) {
+			if (write (fd_vector[i], buffer, bytes) != bytes) {
+				return ERROR;
+			}
+		}
+
+		offset += bytes;
+		len -= bytes;
+	} while (len > 0);
+
+	return COPIED;
+}
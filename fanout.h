@@ -0,0 +1,17 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <sys/types.h>
+
+/* Copy the file "fd_in" from "offset" until the end to the current position of
+ * each of the "nfds" file descriptors of "fd_vector", using the cheapest path
+ * the kernel offers for each of them:
+ *   1. copy_file_range() (in-kernel copy, may be offloaded by the filesystem).
+ *   2. splice() + tee() (one read from the page cache, duplicated through pipes).
+ *   3. pread() + write().
+ * No reflinks (FICLONERANGE): the message starts right after the envelope, so
+ * the source offset is never block-aligned.
+ */
+int fanout_copy (int fd_in, off_t offset, size_t nfds, int *fd_vector);
+
+#endif /* FANOUT_H */
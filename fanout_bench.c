@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/* Times the ways fanout_copy() could copy a message to its recipients:
+ * FICLONERANGE, copy_file_range(), splice() + tee() and pread() + write().
+ *
+ * Usage: fanout_bench <directory> [message size] [copies] [iterations] [offset]
+ * The message starts at "offset" in the source file (the size of the envelope),
+ * the copies are created in "directory" (use the filesystem of the spool).
+ */
+
+#define DEFAULT_SIZE       (64 * 1024)
+#define DEFAULT_COPIES     8
+#define DEFAULT_ITERATIONS 100
+#define DEFAULT_OFFSET     256
+
+#define PIPE_SIZE          (1024 * 1024)
+#define READ_BUFFER_SIZE   (64 * 1024)
+
+typedef int (*copy_function_t) (int fd_in, off_t offset, off_t len, int ncopies, int *fds);
+
+static int clone_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds);
+static int copy_file_range_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds);
+static int splice_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds);
+static int read_write_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds);
+static int splice_all (int fd_in, int fd_out, size_t len);
+
+static int open_copies (const char *directory, int ncopies, int *fds);
+static void close_copies (const char *directory, int ncopies, int *fds);
+static void run (const char *name, copy_function_t copy, const char *directory, int fd_in, off_t offset, off_t len, int ncopies, int iterations, int *fds);
+
+int main (int argc, char **argv)
+{
+	char path[PATH_MAX + 1];
+	char buffer[READ_BUFFER_SIZE];
+	const char *directory;
+	size_t size;
+	int ncopies;
+	int iterations;
+	off_t offset;
+	off_t written;
+	int *fds;
+	int fd;
+	size_t i;
+
+	if (argc < 2) {
+		fprintf (stderr, "Usage: %s <directory> [message size] [copies] [iterations] [offset]\n", argv[0]);
+		return -1;
+	}
+
+	directory = argv[1];
+	size = (argc > 2) ? strtoul (argv[2], NULL, 10) : DEFAULT_SIZE;
+	ncopies = (argc > 3) ? atoi (argv[3]) : DEFAULT_COPIES;
+	iterations = (argc > 4) ? atoi (argv[4]) : DEFAULT_ITERATIONS;
+	offset = (argc > 5) ? strtol (argv[5], NULL, 10) : DEFAULT_OFFSET;
+
+	if ((size == 0) || (ncopies <= 0) || (iterations <= 0) || (offset < 0)) {
+		fprintf (stderr, "Invalid arguments.\n");
+		return -1;
+	}
+
+	fds = (int *) malloc (ncopies * sizeof (int));
+	if (!fds) {
+		fprintf (stderr, "Couldn't allocate memory.\n");
+		return -1;
+	}
+
+	/* Source file: "offset" bytes of envelope, then the message. */
+	snprintf (path, sizeof (path), "%s/fanout_bench.src", directory);
+	if ((fd = open (path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR)) < 0) {
+		fprintf (stderr, "Couldn't create %s.\n", path);
+		free (fds);
+		return -1;
+	}
+
+	unlink (path);
+
+	for (i = 0; i < sizeof (buffer); i++) {
+		buffer[i] = 'a' + (i % 26);
+	}
+
+	for (written = 0; written < offset + (off_t) size; written += sizeof (buffer)) {
+		if (write (fd, buffer, sizeof (buffer)) != sizeof (buffer)) {
+			fprintf (stderr, "Couldn't write %s.\n", path);
+			close (fd);
+			free (fds);
+			return -1;
+		}
+	}
+
+	ftruncate (fd, offset + size);
+	fsync (fd);
+
+	printf ("%lu bytes at offset %ld, %d copies, %d iterations.\n", (unsigned long) size, (long) offset, ncopies, iterations);
+
+	run ("FICLONERANGE", clone_copies, directory, fd, offset, size, ncopies, iterations, fds);
+	run ("copy_file_range", copy_file_range_copies, directory, fd, offset, size, ncopies, iterations, fds);
+	run ("splice + tee", splice_copies, directory, fd, offset, size, ncopies, iterations, fds);
+	run ("pread + write", read_write_copies, directory, fd, offset, size, ncopies, iterations, fds);
+
+	close (fd);
+	free (fds);
+
+	return 0;
+}
+
+void run (const char *name, copy_function_t copy, const char *directory, int fd_in, off_t offset, off_t len, int ncopies, int iterations, int *fds)
+{
+	struct timespec start, end;
+	double elapsed;
+	double total;
+	int i;
+
+	total = 0;
+
+	for (i = 0; i < iterations; i++) {
+		if (open_copies (directory, ncopies, fds) < 0) {
+			printf ("%-16s couldn't create the copies.\n", name);
+			return;
+		}
+
+		clock_gettime (CLOCK_MONOTONIC, &start);
+
+		if (copy (fd_in, offset, len, ncopies, fds) < 0) {
+			printf ("%-16s failed (%s).\n", name, strerror (errno));
+			close_copies (directory, ncopies, fds);
+			return;
+		}
+
+		clock_gettime (CLOCK_MONOTONIC, &end);
+
+		close_copies (directory, ncopies, fds);
+
+		elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		total += elapsed;
+	}
+
+	printf ("%-16s %10.1f us/message %10.1f MB/s\n", name, total * 1e6 / iterations, ((double) len * ncopies * iterations) / total / (1024 * 1024));
+}
+
+int open_copies (const char *directory, int ncopies, int *fds)
+{
+	char path[PATH_MAX + 1];
+	int i;
+
+	for (i = 0; i < ncopies; i++) {
+		snprintf (path, sizeof (path), "%s/fanout_bench.%d", directory, i);
+		if ((fds[i] = open (path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)) < 0) {
+			close_copies (directory, i, fds);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void close_copies (const char *directory, int ncopies, int *fds)
+{
+	char path[PATH_MAX + 1];
+	int i;
+
+	for (i = 0; i < ncopies; i++) {
+		close (fds[i]);
+
+		snprintf (path, sizeof (path), "%s/fanout_bench.%d", directory, i);
+		unlink (path);
+	}
+}
+
+int clone_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds)
+{
+	struct file_clone_range range;
+	int i;
+
+	/* Needs a filesystem with reflinks (Btrfs, XFS) and a block-aligned "offset". */
+	range.src_fd = fd_in;
+	range.src_offset = offset;
+	range.src_length = 0; /* Until the end of the file. */
+	range.dest_offset = 0;
+
+	for (i = 0; i < ncopies; i++) {
+		if (ioctl (fds[i], FICLONERANGE, &range) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int copy_file_range_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds)
+{
+	loff_t off_in;
+	ssize_t bytes;
+	int i;
+
+	for (i = 0; i < ncopies; i++) {
+		off_in = offset;
+
+		do {
+			if ((bytes = copy_file_range (fd_in, &off_in, fds[i], NULL, offset + len - off_in, 0)) <= 0) {
+				return -1;
+			}
+		} while (off_in < offset + len);
+	}
+
+	return 0;
+}
+
+int splice_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds)
+{
+	int source[2];
+	int copy[2];
+	loff_t off_in;
+	ssize_t bytes;
+	size_t chunk;
+	int source_size;
+	int copy_size;
+	int i;
+	int ret;
+
+	if (pipe (source) < 0) {
+		return -1;
+	}
+
+	if (pipe (copy) < 0) {
+		close (source[0]);
+		close (source[1]);
+		return -1;
+	}
+
+	if ((source_size = fcntl (source[1], F_SETPIPE_SZ, PIPE_SIZE)) < 0) {
+		source_size = fcntl (source[1], F_GETPIPE_SZ);
+	}
+
+	if ((copy_size = fcntl (copy[1], F_SETPIPE_SZ, PIPE_SIZE)) < 0) {
+		copy_size = fcntl (copy[1], F_GETPIPE_SZ);
+	}
+
+	chunk = (source_size < copy_size) ? source_size : copy_size;
+
+	off_in = offset;
+	ret = 0;
+
+	while ((ret == 0) && (len > 0)) {
+		if ((bytes = splice (fd_in, &off_in, source[1], NULL, ((size_t) len < chunk) ? (size_t) len : chunk, SPLICE_F_MOVE)) <= 0) {
+			ret = -1;
+			break;
+		}
+
+		len -= bytes;
+
+		for (i = 0; i + 1 < ncopies; i++) {
+			if ((tee (source[0], copy[1], bytes, 0) != bytes) || (splice_all (copy[0], fds[i], bytes) < 0)) {
+				ret = -1;
+				break;
+			}
+		}
+
+		if ((ret == 0) && (splice_all (source[0], fds[ncopies - 1], bytes) < 0)) {
+			ret = -1;
+		}
+	}
+
+	close (source[0]);
+	close (source[1]);
+	close (copy[0]);
+	close (copy[1]);
+
+	return ret;
+}
+
+int splice_all (int fd_in, int fd_out, size_t len)
+{
+	ssize_t bytes;
+
+	do {
+		if ((bytes = splice (fd_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE)) <= 0) {
+			return -1;
+		}
+
+		len -= bytes;
+	} while (len > 0);
+
+	return 0;
+}
+
+int read_write_copies (int fd_in, off_t offset, off_t len, int ncopies, int *fds)
+{
+	char buffer[READ_BUFFER_SIZE];
+	ssize_t bytes;
+	int i;
+
+	do {
+		if ((bytes = pread (fd_in, buffer, sizeof (buffer), offset)) <= 0) {
+			return -1;
+		}
+
+		for (i = 0; i < ncopies; i++) {
+			if (write (fds[i], buffer, bytes) != bytes) {
+				return -1;
+			}
+		}
+
+		offset += bytes;
+		len -= bytes;
+	} while (len > 0);
+
+	return 0;
+}
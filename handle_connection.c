@@ -3,7 +3,6 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <signal.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <arpa/nameser.h>
@@ -15,39 +14,67 @@
 #include "relay.h"
 #include "reply_codes.h"
 #include "log.h"
-#include "version.h"
+#include "handoff.h"
+#include "envelope.h"
+#include "spool_directory.h"
+#include "journal.h"
+#include "delivery.h"
+#include "replies.h"
+
+#define MESSAGE_EXTENSION ".eml"
 
 extern server_t server;
 extern dnscache_t dnscache;
 
-static char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-static char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
-
 static int state_machine (connection_t *connection);
 static int discard_command_line (connection_t *connection);
 static int handle_write (connection_t *connection);
 static int prepare_for_writing (connection_t *connection);
+static int command_received (connection_t *connection);
 static void reset_mail_transaction (connection_t *connection);
 static int handle_command (connection_t *connection);
 static int handle_data_command (connection_t *connection);
 static int discard_data (connection_t *connection);
 static int handle_bdat_command (connection_t *connection);
 static int discard_bdat (connection_t *connection);
-static int prepare_message_file (connection_t *connection);
+static int prepare_message_file (connection_t *connection, uint32_t flags);
+static int finish_message (connection_t *connection);
+static int deliver_directly (connection_t *connection);
+static int reply_message (connection_t *connection, int committed);
+static void reply_committed_message (connection_t *connection, int committed);
 static int domain_is_reachable (const char *domain);
 
 int handle_connection (connection_t *connection, struct epoll_event *event)
 {
+	const buffer_t *greeting;
+	const char *reply;
+	uint32_t ip;
+
 	if ((event->events & EPOLLERR) || (event->events & EPOLLHUP)) {
 		return -1;
 	}
 
 	if (event->events & EPOLLOUT) {
 		if (connection->state == INITIAL_STATE) {
-			buffer_reset (&connection->output);
-			if (buffer_format (&connection->output, REPLY_CODE_220, domainlist_get_first_domain (&server.domainlist), SMTPSERVER_NAME) < 0) {
-				/* Couldn't allocate memory. */
-				return -1;
+			connection_reset_replies (connection);
+
+			/* If the client is listed in a blocklist (and can't relay)... */
+			ip = ntohl (connection->sin.sin_addr.s_addr);
+			if (((reply = blocklist_lookup (&server.blocklist, ip)) != NULL) && (ip_list_search (&server.ip_list, ip) < 0)) {
+				/* refuse it instead of greeting it (the reply goes away with the blocklists). */
+				if (connection_reply_copy (connection, reply, strlen (reply)) < 0) {
+					/* Couldn't allocate memory. */
+					return -1;
+				}
+
+				connection->quit = 1;
+			} else {
+				/* 220 <domain> Service ready. */
+				greeting = replies_get (GREETING_REPLY);
+				if (connection_reply_copy (connection, greeting->data, greeting->used) < 0) {
+					/* Couldn't allocate memory. */
+					return -1;
+				}
 			}
 
 			connection->input_stream.fd = connection->sd;
@@ -56,7 +83,9 @@ int handle_connection (connection_t *connection, struct epoll_event *event)
 		} else if (connection->state == WRITING_RESPONSE_STATE) {
 			return handle_write (connection);
 		}
-	} else if (event->events & EPOLLIN) {
+	}
+
+	if (event->events & EPOLLIN) {
 		if (connection->state == READING_COMMAND_STATE) {
 			return state_machine (connection);
 		} else if (connection->state == DATA_STATE) {
@@ -112,6 +141,9 @@ int state_machine (connection_t *connection)
 
 	connection->last_read_write = server.current_time;
 
+	/* Only the replies to some commands may wait (see handle_command()). */
+	connection->pipelined = 0;
+
 	/* If the line doesn't terminate in '\n'... */
 	if (connection->input[connection->offset - 1] != '\n') {
 		/* The line is too long... */
@@ -124,8 +156,7 @@ int state_machine (connection_t *connection)
 	/* If the line is too short... */
 	if (connection->offset < 6) {
 		/* 500 5.5.1 Command unrecognized. */
-		buffer_reset (&connection->output);
-		if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
+		if (connection_reply (connection, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
 			/* Couldn't allocate memory. */
 			return -1;
 		}
@@ -136,8 +167,7 @@ int state_machine (connection_t *connection)
 	/* If the line doesn't terminate in "\r\n"? */
 	if (connection->input[connection->offset - 2] != '\r') {
 		/* 500 5.5.1 Command unrecognized. */
-		buffer_reset (&connection->output);
-		if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
+		if (connection_reply (connection, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
 			/* Couldn't allocate memory. */
 			return -1;
 		}
@@ -193,8 +223,7 @@ int discard_command_line (connection_t *connection)
 		} else {
 			/* We have reached the end of line. */
 			/* 500 5.5.1 Command unrecognized. */
-			buffer_reset (&connection->output);
-			if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
+			if (connection_reply (connection, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -206,9 +235,15 @@ int discard_command_line (connection_t *connection)
 
 int handle_write (connection_t *connection)
 {
-	buffer_t *buffer;
+	struct iovec iov[MAX_PIPELINED_REPLIES];
+	struct iovec *reply;
+	const char *output;
 	ssize_t bytes;
 	size_t zero_bytes_sent;
+	size_t skip;
+	size_t len;
+	size_t niov;
+	size_t i;
 
 #if !HAVE_EPOLLRDHUP
 	struct epoll_event ev;
@@ -216,10 +251,69 @@ int handle_write (connection_t *connection)
 
 	zero_bytes_sent = 0;
 
-	buffer = &connection->output;
-
 	do {
-		bytes = send (connection->sd, buffer->data + connection->offset, buffer->used - connection->offset, 0);
+		/* The replies not sent yet ("offset": bytes already sent). */
+		output = connection->output.data;
+		skip = connection->offset;
+		niov = 0;
+
+		for (i = 0; i < connection->nreplies; i++) {
+			reply = &(connection->replies[i]);
+
+			if (reply->iov_base) {
+				iov[niov].iov_base = reply->iov_base;
+			} else {
+				iov[niov].iov_base = (void *) output;
+				output += reply->iov_len;
+			}
+
+			len = reply->iov_len;
+			if (skip >= len) {
+				skip -= len;
+				continue;
+			}
+
+			iov[niov].iov_base = (char *) iov[niov].iov_base + skip;
+			iov[niov].iov_len = len - skip;
+			skip = 0;
+			niov++;
+		}
+
+		if (niov == 0) {
+			if (connection->quit) {
+				return -1;
+			}
+
+#if !HAVE_EPOLLRDHUP
+			ev.events = EPOLLIN;
+			ev.data.u64 = 0;
+			ev.data.fd = connection->sd;
+
+			if (epoll_ctl (server.epoll_fd, EPOLL_CTL_MOD, connection->sd, &ev) < 0) {
+				return -1;
+			}
+#endif /* !HAVE_EPOLLRDHUP */
+
+			if ((connection->next_state == DATA_STATE) || (connection->next_state == DISCARDING_DATA)) {
+				connection->state = connection->next_state;
+			} else {
+				connection->state = READING_COMMAND_STATE;
+			}
+
+			connection_reset_replies (connection);
+			connection->offset = 0;
+
+			/* If the client has sent more meanwhile (PIPELINING), it
+			 * is already in the input buffer: no event will tell us.
+			 */
+			if (connection->input_stream.read_ptr < connection->input_stream.read_end) {
+				server.interrupted_connections[server.number_interrupted_connections++] = connection;
+			}
+
+			return 0;
+		}
+
+		bytes = writev (connection->sd, iov, niov);
 		if (bytes < 0) {
 			if (errno == EAGAIN) {
 				return 0;
@@ -242,31 +336,6 @@ int handle_write (connection_t *connection)
 			zero_bytes_sent = 0;
 
 			connection->offset += bytes;
-			if (connection->offset == buffer->used) {
-				if (connection->quit) {
-					return -1;
-				}
-
-#if !HAVE_EPOLLRDHUP
-				ev.events = EPOLLIN;
-				ev.data.u64 = 0;
-				ev.data.fd = connection->sd;
-
-				if (epoll_ctl (server.epoll_fd, EPOLL_CTL_MOD, connection->sd, &ev) < 0) {
-					return -1;
-				}
-#endif /* !HAVE_EPOLLRDHUP */
-
-				if ((connection->next_state == DATA_STATE) || (connection->next_state == DISCARDING_DATA)) {
-					connection->state = connection->next_state;
-				} else {
-					connection->state = READING_COMMAND_STATE;
-				}
-
-				connection->offset = 0;
-
-				return 0;
-			}
 		}
 	} while (1);
 }
@@ -275,7 +344,24 @@ int prepare_for_writing (connection_t *connection)
 {
 #if !HAVE_EPOLLRDHUP
 	struct epoll_event ev;
+#endif
+
+	/* If the reply may wait and the client has already sent the next command
+	 * (PIPELINING, RFC 2920), hold it back: it will be sent with the replies
+	 * to the next commands, once there are no more commands to handle or one
+	 * of them needs its reply right away.
+	 */
+	if ((connection->pipelined) && (connection->nreplies < MAX_PIPELINED_REPLIES) && (command_received (connection))) {
+		connection->state = READING_COMMAND_STATE;
+		connection->offset = 0;
 
+		/* Handle the next command. */
+		server.interrupted_connections[server.number_interrupted_connections++] = connection;
+
+		return 0;
+	}
+
+#if !HAVE_EPOLLRDHUP
 	/* Notify me of writeable events. */
 	ev.events = EPOLLOUT;
 	ev.data.u64 = 0;
@@ -292,19 +378,20 @@ int prepare_for_writing (connection_t *connection)
 	return 0;
 }
 
-void reset_mail_transaction (connection_t *connection)
+int command_received (connection_t *connection)
 {
-	char filename[PATH_MAX + 1];
+	input_stream_t *input_stream;
 
-	mail_transaction_free (&connection->mail_transaction);
+	input_stream = &connection->input_stream;
 
-	if (connection->fd != -1) {
-		close (connection->fd);
-		connection->fd = -1;
+	return (memchr (input_stream->read_ptr, '\n', input_stream->read_end - input_stream->read_ptr) != NULL);
+}
 
-		snprintf (filename, sizeof (filename), "%s/%lu-%u.eml", server.incoming_directory, connection->file_timestamp, connection->nfile);
-		unlink (filename);
-	}
+void reset_mail_transaction (connection_t *connection)
+{
+	mail_transaction_free (&connection->mail_transaction);
+
+	spool_file_abort (&connection->spool_file);
 
 	connection->next_state = INITIAL_STATE;
 }
@@ -312,6 +399,7 @@ void reset_mail_transaction (connection_t *connection)
 int handle_command (connection_t *connection)
 {
 	mail_transaction_t *mail_transaction;
+	const buffer_t *reply;
 	unsigned char *argument;
 	unsigned char *local_part;
 	size_t local_part_len;
@@ -324,14 +412,11 @@ int handle_command (connection_t *connection)
 	int error;
 	int ret;
 
-	/* Reset output buffer. */
-	buffer_reset (&connection->output);
-
 	/* Parse command. */
 	error = 0;
 	if (((ret = parse_smtp_command ((unsigned char *) connection->input, &argument, &error)) < 0) && (error == 500)) {
 		/* 500 5.5.1 Command unrecognized. */
-		if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
+		if (connection_reply (connection, REPLY_CODE_500, sizeof (REPLY_CODE_500) - 1) < 0) {
 			/* Couldn't allocate memory. */
 			return -1;
 		}
@@ -341,12 +426,18 @@ int handle_command (connection_t *connection)
 
 	mail_transaction = &connection->mail_transaction;
 
+	/* The replies to MAIL, RCPT, RSET and to the chunks of BDAT may be sent
+	 * along with the following ones (RFC 2920, RFC 3030), the other commands
+	 * are synchronization points.
+	 */
+	connection->pipelined = ((ret == MAIL) || (ret == RCPT) || (ret == RSET) || (ret == BDAT));
+
 	switch ((eSmtpCommand) ret) {
 		case BDAT:
 			/* If the client hasn't issued the "RCPT TO:" command... */
 			if (mail_transaction->forward_paths.used == 0) {
 				/* 503 5.0.0 Need RCPT (recipient). */
-				if (buffer_append_size_bounded_string (&connection->output, NEED_RCPT_COMMAND, sizeof (NEED_RCPT_COMMAND) - 1) < 0) {
+				if (connection_reply (connection, NEED_RCPT_COMMAND, sizeof (NEED_RCPT_COMMAND) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -357,7 +448,7 @@ int handle_command (connection_t *connection)
 			/* Wrong arguments? */
 			if ((error == 501) || (parse_bdat (argument, &chunk_size, &last) < 0)) {
 				/* 501 Syntax: "BDAT" SP chunk-size[SP "LAST"]. */
-				if (buffer_append_size_bounded_string (&connection->output, BDAT_SYNTAX, sizeof (BDAT_SYNTAX) - 1) < 0) {
+				if (connection_reply (connection, BDAT_SYNTAX, sizeof (BDAT_SYNTAX) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -378,7 +469,7 @@ int handle_command (connection_t *connection)
 				return discard_bdat (connection);
 			}
 
-			if (prepare_message_file (connection) < 0) {
+			if (prepare_message_file (connection, ENVELOPE_CHUNKED) < 0) {
 				connection->state = DISCARDING_BDAT;
 				connection->next_state = DISCARDING_BDAT;
 
@@ -395,7 +486,7 @@ int handle_command (connection_t *connection)
 			/* If we are handling BDAT... */
 			if ((connection->next_state == BDAT_STATE) || (connection->next_state == DISCARDING_BDAT)) {
 				/* 503 5.5.1 Error: MAIL transaction in progress. */
-				if (buffer_append_size_bounded_string (&connection->output, MAIL_TRANSACTION_IN_PROGRESS, sizeof (MAIL_TRANSACTION_IN_PROGRESS) - 1) < 0) {
+				if (connection_reply (connection, MAIL_TRANSACTION_IN_PROGRESS, sizeof (MAIL_TRANSACTION_IN_PROGRESS) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -406,7 +497,7 @@ int handle_command (connection_t *connection)
 			/* If the client hasn't issued the "RCPT TO:" command... */
 			if (mail_transaction->forward_paths.used == 0) {
 				/* 503 5.0.0 Need RCPT (recipient). */
-				if (buffer_append_size_bounded_string (&connection->output, NEED_RCPT_COMMAND, sizeof (NEED_RCPT_COMMAND) - 1) < 0) {
+				if (connection_reply (connection, NEED_RCPT_COMMAND, sizeof (NEED_RCPT_COMMAND) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -416,7 +507,7 @@ int handle_command (connection_t *connection)
 
 			if (error == 501) {
 				/* 501 5.5.4 Syntax: "DATA". */
-				if (buffer_append_size_bounded_string (&connection->output, DATA_SYNTAX, sizeof (DATA_SYNTAX) - 1) < 0) {
+				if (connection_reply (connection, DATA_SYNTAX, sizeof (DATA_SYNTAX) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -424,7 +515,7 @@ int handle_command (connection_t *connection)
 				return prepare_for_writing (connection);
 			}
 
-			if (prepare_message_file (connection) < 0) {
+			if (prepare_message_file (connection, 0) < 0) {
 				connection->next_state = DISCARDING_DATA;
 			} else {
 				connection->filesize = 0;
@@ -433,7 +524,7 @@ int handle_command (connection_t *connection)
 			}
 
 			/* 354 Enter mail, end with "." on a line by itself. */
-			if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_354, sizeof (REPLY_CODE_354) - 1) < 0) {
+			if (connection_reply (connection, REPLY_CODE_354, sizeof (REPLY_CODE_354) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -442,7 +533,7 @@ int handle_command (connection_t *connection)
 		case EHLO:
 			if (error == 501) {
 				/* 501 5.0.0 ehlo requires domain address. */
-				if (buffer_append_size_bounded_string (&connection->output, EHLO_REQUIRES_DOMAIN_ADDRESS, sizeof (EHLO_REQUIRES_DOMAIN_ADDRESS) - 1) < 0) {
+				if (connection_reply (connection, EHLO_REQUIRES_DOMAIN_ADDRESS, sizeof (EHLO_REQUIRES_DOMAIN_ADDRESS) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -453,7 +544,7 @@ int handle_command (connection_t *connection)
 			/* Valid domain? */
 			if (parse_domain (argument, &domainlen) < 0) {
 				/* 501 5.0.0 Invalid domain name. */
-				if (buffer_append_size_bounded_string (&connection->output, INVALID_DOMAIN_NAME, sizeof (INVALID_DOMAIN_NAME) - 1) < 0) {
+				if (connection_reply (connection, INVALID_DOMAIN_NAME, sizeof (INVALID_DOMAIN_NAME) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -474,7 +565,8 @@ int handle_command (connection_t *connection)
 
 			reset_mail_transaction (connection);
 
-			if (buffer_format (&connection->output, EHLO_RESPONSE, domainlist_get_first_domain (&server.domainlist), server.max_message_size) < 0) {
+			reply = replies_get (EHLO_REPLY);
+			if (connection_reply_copy (connection, reply->data, reply->used) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -482,7 +574,7 @@ int handle_command (connection_t *connection)
 			return prepare_for_writing (connection);
 		case EXPN:
 			/* 502 5.5.1 Command not implemented. */
-			if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_502, sizeof (REPLY_CODE_502) - 1) < 0) {
+			if (connection_reply (connection, REPLY_CODE_502, sizeof (REPLY_CODE_502) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -491,7 +583,7 @@ int handle_command (connection_t *connection)
 		case HELO:
 			if (error == 501) {
 				/* 501 5.0.0 helo requires domain address. */
-				if (buffer_append_size_bounded_string (&connection->output, HELO_REQUIRES_DOMAIN_ADDRESS, sizeof (HELO_REQUIRES_DOMAIN_ADDRESS) - 1) < 0) {
+				if (connection_reply (connection, HELO_REQUIRES_DOMAIN_ADDRESS, sizeof (HELO_REQUIRES_DOMAIN_ADDRESS) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -502,7 +594,7 @@ int handle_command (connection_t *connection)
 			/* Valid domain? */
 			if (parse_domain (argument, &domainlen) < 0) {
 				/* 501 5.0.0 Invalid domain name. */
-				if (buffer_append_size_bounded_string (&connection->output, INVALID_DOMAIN_NAME, sizeof (INVALID_DOMAIN_NAME) - 1) < 0) {
+				if (connection_reply (connection, INVALID_DOMAIN_NAME, sizeof (INVALID_DOMAIN_NAME) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -523,7 +615,8 @@ int handle_command (connection_t *connection)
 
 			reset_mail_transaction (connection);
 
-			if (buffer_format (&connection->output, HELO_RESPONSE, domainlist_get_first_domain (&server.domainlist)) < 0) {
+			reply = replies_get (HELO_REPLY);
+			if (connection_reply_copy (connection, reply->data, reply->used) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -531,7 +624,7 @@ int handle_command (connection_t *connection)
 			return prepare_for_writing (connection);
 		case HELP:
 			/* 502 5.5.1 Command not implemented. */
-			if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_502, sizeof (REPLY_CODE_502) - 1) < 0) {
+			if (connection_reply (connection, REPLY_CODE_502, sizeof (REPLY_CODE_502) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -541,7 +634,7 @@ int handle_command (connection_t *connection)
 			/* If the client has already issued the "MAIL FROM:" command... */
 			if (mail_transaction->reverse_path[0]) {
 				/* 503 5.5.0 Sender already specified. */
-				if (buffer_append_size_bounded_string (&connection->output, SENDER_ALREADY_SPECIFIED, sizeof (SENDER_ALREADY_SPECIFIED) - 1) < 0) {
+				if (connection_reply (connection, SENDER_ALREADY_SPECIFIED, sizeof (SENDER_ALREADY_SPECIFIED) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -551,7 +644,7 @@ int handle_command (connection_t *connection)
 				/* If the client hasn't issued neither the "EHLO" nor the "HELO" command... */
 				if (connection->domain.used == 0) {
 					/* 503 5.0.0 Polite people say HELO first. */
-					if (buffer_append_size_bounded_string (&connection->output, NEED_HELO_COMMAND, sizeof (NEED_HELO_COMMAND) - 1) < 0) {
+					if (connection_reply (connection, NEED_HELO_COMMAND, sizeof (NEED_HELO_COMMAND) - 1) < 0) {
 						/* Couldn't allocate memory. */
 						return -1;
 					}
@@ -562,7 +655,7 @@ int handle_command (connection_t *connection)
 
 			if (error == 501) {
 				/* 501 5.5.2 Syntax error in parameters scanning "from". */
-				if (buffer_append_size_bounded_string (&connection->output, SYNTAX_ERROR_MAIL_FROM, sizeof (SYNTAX_ERROR_MAIL_FROM) - 1) < 0) {
+				if (connection_reply (connection, SYNTAX_ERROR_MAIL_FROM, sizeof (SYNTAX_ERROR_MAIL_FROM) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -573,7 +666,7 @@ int handle_command (connection_t *connection)
 			/* Valid reverse path? */
 			if (parse_reverse_path (argument, &local_part, &local_part_len, &domain, &domainlen, &size_parameter, &size_value) < 0) {
 				/* 501 5.1.7 Bad sender address syntax. */
-				if (buffer_append_size_bounded_string (&connection->output, BAD_SENDER, sizeof (BAD_SENDER) - 1) < 0) {
+				if (connection_reply (connection, BAD_SENDER, sizeof (BAD_SENDER) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -583,8 +676,9 @@ int handle_command (connection_t *connection)
 
 			/* Too many mails? */
 			if (connection->ntransactions >= server.max_transactions) {
-				/* 450 4.7.1 Error: too much mail from <domain>. */
-				if (buffer_format (&connection->output, TOO_MANY_TRANSACTIONS, connection->domain.data) < 0) {
+				/* 450 4.7.1 <domain> Error: too much mail. */
+				reply = replies_get (TOO_MANY_TRANSACTIONS_REPLY);
+				if (connection_reply_copy (connection, reply->data, reply->used) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -595,13 +689,35 @@ int handle_command (connection_t *connection)
 			if (size_parameter) {
 				if (size_value > server.max_message_size) {
 					/* 552 5.2.3 Message size exceeds maximum value. */
-					if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_552, sizeof (REPLY_CODE_552) - 1) < 0) {
+					if (connection_reply (connection, REPLY_CODE_552, sizeof (REPLY_CODE_552) - 1) < 0) {
 						/* Couldn't allocate memory. */
 						return -1;
 					}
 
 					return prepare_for_writing (connection);
 				}
+			} else {
+				size_value = 0;
+			}
+
+			/* Reserve disk space for the message. */
+			if (spool_file_reserve (&connection->spool_file, size_value) < 0) {
+				/* 452 4.4.5 Insufficient disk space; try again later. */
+				if (connection_reply (connection, INSUFFICIENT_DISK_SPACE, sizeof (INSUFFICIENT_DISK_SPACE) - 1) < 0) {
+					/* Couldn't allocate memory. */
+					return -1;
+				}
+
+				return prepare_for_writing (connection);
+			}
+
+			/* If the client has announced the size of the message,
+			 * create the file now and allocate its blocks in one go.
+			 */
+			if (size_value > 0) {
+				if (spool_file_open (&connection->spool_file, size_value) == 0) {
+					spool_file_preallocate (&connection->spool_file, size_value);
+				}
 			}
 
 			/* Null reverse path? */
@@ -612,7 +728,7 @@ int handle_command (connection_t *connection)
 			}
 
 			/* 250 2.1.0 Sender ok. */
-			if (buffer_append_size_bounded_string (&connection->output, SENDER_OK, sizeof (SENDER_OK) - 1) < 0) {
+			if (connection_reply (connection, SENDER_OK, sizeof (SENDER_OK) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -620,7 +736,7 @@ int handle_command (connection_t *connection)
 			return prepare_for_writing (connection);
 		case NOOP:
 			/* 250 2.0.0 OK. */
-			if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_250_2_0_0, sizeof (REPLY_CODE_250_2_0_0) - 1) < 0) {
+			if (connection_reply (connection, REPLY_CODE_250_2_0_0, sizeof (REPLY_CODE_250_2_0_0) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -630,7 +746,8 @@ int handle_command (connection_t *connection)
 			connection->quit = 1;
 
 			/* 221 2.0.0 <domain> closing connection. */
-			if (buffer_format (&connection->output, REPLY_CODE_221, domainlist_get_first_domain (&server.domainlist)) < 0) {
+			reply = replies_get (CLOSING_REPLY);
+			if (connection_reply_copy (connection, reply->data, reply->used) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -640,7 +757,7 @@ int handle_command (connection_t *connection)
 			/* If we are handling BDAT... */
 			if ((connection->next_state == BDAT_STATE) || (connection->next_state == DISCARDING_BDAT)) {
 				/* 503 5.5.1 Error: MAIL transaction in progress. */
-				if (buffer_append_size_bounded_string (&connection->output, MAIL_TRANSACTION_IN_PROGRESS, sizeof (MAIL_TRANSACTION_IN_PROGRESS) - 1) < 0) {
+				if (connection_reply (connection, MAIL_TRANSACTION_IN_PROGRESS, sizeof (MAIL_TRANSACTION_IN_PROGRESS) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -651,7 +768,7 @@ int handle_command (connection_t *connection)
 			/* If the client hasn't issued the "MAIL FROM:" command... */
 			if (!mail_transaction->reverse_path[0]) {
 				/* 503 5.0.0 Need MAIL before RCPT. */
-				if (buffer_append_size_bounded_string (&connection->output, NEED_MAIL_COMMAND, sizeof (NEED_MAIL_COMMAND) - 1) < 0) {
+				if (connection_reply (connection, NEED_MAIL_COMMAND, sizeof (NEED_MAIL_COMMAND) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -661,7 +778,7 @@ int handle_command (connection_t *connection)
 
 			if (error == 501) {
 				/* 501 5.5.2 Syntax error in parameters scanning "to". */
-				if (buffer_append_size_bounded_string (&connection->output, SYNTAX_ERROR_RCPT_TO, sizeof (SYNTAX_ERROR_RCPT_TO) - 1) < 0) {
+				if (connection_reply (connection, SYNTAX_ERROR_RCPT_TO, sizeof (SYNTAX_ERROR_RCPT_TO) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -672,7 +789,7 @@ int handle_command (connection_t *connection)
 			/* Valid forward path? */
 			if (parse_forward_path (argument, &local_part, &local_part_len, &domain, &domainlen) < 0) {
 				/* 501 5.1.3 Syntax error in mailbox address. */
-				if (buffer_append_size_bounded_string (&connection->output, BAD_RECIPIENT, sizeof (BAD_RECIPIENT) - 1) < 0) {
+				if (connection_reply (connection, BAD_RECIPIENT, sizeof (BAD_RECIPIENT) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -683,7 +800,7 @@ int handle_command (connection_t *connection)
 			/* Too many recipients? */
 			if (mail_transaction->forward_paths.used >= server.max_recipients) {
 				/* 452 4.5.3 Too many recipients. */
-				if (buffer_append_size_bounded_string (&connection->output, TOO_MANY_RECIPIENTS, sizeof (TOO_MANY_RECIPIENTS) - 1) < 0) {
+				if (connection_reply (connection, TOO_MANY_RECIPIENTS, sizeof (TOO_MANY_RECIPIENTS) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -706,7 +823,7 @@ int handle_command (connection_t *connection)
 					/* If I handle the recipient's domain... */
 					if (ret == -1) {
 						/* 550 5.1.1 Addressee unknown. */
-						if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_550, sizeof (REPLY_CODE_550) - 1) < 0) {
+						if (connection_reply (connection, REPLY_CODE_550, sizeof (REPLY_CODE_550) - 1) < 0) {
 							/* Couldn't allocate memory. */
 							return -1;
 						}
@@ -717,7 +834,7 @@ int handle_command (connection_t *connection)
 					/* If relay is not allowed for this IP... */
 					if (ip_list_search (&server.ip_list, ntohl (connection->sin.sin_addr.s_addr)) < 0) {
 						/* 550 5.1.1 Addressee unknown. */
-						if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_550, sizeof (REPLY_CODE_550) - 1) < 0) {
+						if (connection_reply (connection, REPLY_CODE_550, sizeof (REPLY_CODE_550) - 1) < 0) {
 							/* Couldn't allocate memory. */
 							return -1;
 						}
@@ -728,7 +845,7 @@ int handle_command (connection_t *connection)
 					/* If I don't know how to deliver/relay a message to this forward-path... */
 					if (!domain_is_reachable ((const char *) domain)) {
 						/* 550 5.1.1 Addressee unknown. */
-						if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_550, sizeof (REPLY_CODE_550) - 1) < 0) {
+						if (connection_reply (connection, REPLY_CODE_550, sizeof (REPLY_CODE_550) - 1) < 0) {
 							/* Couldn't allocate memory. */
 							return -1;
 						}
@@ -744,7 +861,7 @@ int handle_command (connection_t *connection)
 			}
 
 			/* 250 2.1.5 Recipient ok. */
-			if (buffer_append_size_bounded_string (&connection->output, RECIPIENT_OK, sizeof (RECIPIENT_OK) - 1) < 0) {
+			if (connection_reply (connection, RECIPIENT_OK, sizeof (RECIPIENT_OK) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -753,7 +870,7 @@ int handle_command (connection_t *connection)
 		case RSET:
 			if (error == 501) {
 				/* 501 5.5.4 Syntax: "RSET". */
-				if (buffer_append_size_bounded_string (&connection->output, RSET_SYNTAX, sizeof (RSET_SYNTAX) - 1) < 0) {
+				if (connection_reply (connection, RSET_SYNTAX, sizeof (RSET_SYNTAX) - 1) < 0) {
 					/* Couldn't allocate memory. */
 					return -1;
 				}
@@ -764,7 +881,7 @@ int handle_command (connection_t *connection)
 			reset_mail_transaction (connection);
 
 			/* 250 2.0.0 Reset state. */
-			if (buffer_append_size_bounded_string (&connection->output, RESET_STATE, sizeof (RESET_STATE) - 1) < 0) {
+			if (connection_reply (connection, RESET_STATE, sizeof (RESET_STATE) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -772,7 +889,7 @@ int handle_command (connection_t *connection)
 			return prepare_for_writing (connection);
 		case VRFY:
 			/* 502 5.5.1 Command not implemented. */
-			if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_502, sizeof (REPLY_CODE_502) - 1) < 0) {
+			if (connection_reply (connection, REPLY_CODE_502, sizeof (REPLY_CODE_502) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -786,8 +903,6 @@ int handle_command (connection_t *connection)
 int handle_data_command (connection_t *connection)
 {
 	input_stream_t *input_stream;
-	char oldpath[PATH_MAX + 1];
-	char newpath[PATH_MAX + 1];
 	size_t len;
 
 	input_stream = &connection->input_stream;
@@ -832,11 +947,10 @@ int handle_data_command (connection_t *connection)
 		}
 
 		/* Write line to disk. */
-		if (write (connection->fd, connection->input, connection->offset) != connection->offset) {
+		if ((spool_file_grow (&connection->spool_file, connection->filesize + connection->offset) < 0) || (write (connection->spool_file.fd, connection->input, connection->offset) != connection->offset)) {
 			/* Couldn't write. */
 			/* 452 4.4.5 Insufficient disk space; try again later. */
-			buffer_reset (&connection->output);
-			if (buffer_append_size_bounded_string (&connection->output, INSUFFICIENT_DISK_SPACE, sizeof (INSUFFICIENT_DISK_SPACE) - 1) < 0) {
+			if (connection_reply (connection, INSUFFICIENT_DISK_SPACE, sizeof (INSUFFICIENT_DISK_SPACE) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -852,8 +966,7 @@ int handle_data_command (connection_t *connection)
 		/* If the message is too large... */
 		if (connection->filesize > server.max_message_size) {
 			/* 552 5.2.3 Message size exceeds maximum value. */
-			buffer_reset (&connection->output);
-			if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_552, sizeof (REPLY_CODE_552) - 1) < 0) {
+			if (connection_reply (connection, REPLY_CODE_552, sizeof (REPLY_CODE_552) - 1) < 0) {
 				/* Couldn't allocate memory. */
 				return -1;
 			}
@@ -867,36 +980,7 @@ int handle_data_command (connection_t *connection)
 		connection->offset = 0;
 	} while (1);
 
-	close (connection->fd);
-	connection->fd = -1;
-
-	snprintf (oldpath, sizeof (oldpath), "%s/%lu-%u.eml", server.incoming_directory, connection->file_timestamp, connection->nfile);
-
-	/* 250 2.0.0 Message accepted for delivery. */
-	buffer_reset (&connection->output);
-	if (buffer_append_size_bounded_string (&connection->output, MESSAGE_ACCEPTED_FOR_DELIVERY, sizeof (MESSAGE_ACCEPTED_FOR_DELIVERY) - 1) < 0) {
-		/* Couldn't allocate memory. */
-		unlink (oldpath);
-		return -1;
-	}
-
-	/* Move file from incoming to received directory. */
-	snprintf (newpath, sizeof (newpath), "%s/%lu-%u.eml", server.received_directory, connection->file_timestamp, connection->nfile);
-	rename (oldpath, newpath);
-
-	/* Notify delivery process. */
-	kill (server.delivery_pid, SIGUSR1);
-
-	if (server.log_mails) {
-		log_mail (&server.local_time, connection);
-	}
-
-	connection->ntransactions++;
-
-	mail_transaction_free (&connection->mail_transaction);
-	connection->next_state = INITIAL_STATE;
-
-	return prepare_for_writing (connection);
+	return finish_message (connection);
 }
 
 int discard_data (connection_t *connection)
@@ -957,13 +1041,20 @@ int handle_bdat_command (connection_t *connection)
 {
 	input_stream_t *input_stream;
 	stream_copy_t stream_copy;
-	char oldpath[PATH_MAX + 1];
-	char newpath[PATH_MAX + 1];
 	size_t chunk_size;
 
 	input_stream = &connection->input_stream;
 
-	stream_copy_init (&stream_copy, input_stream, connection->fd);
+	/* Make room for the rest of the chunk. */
+	if (spool_file_grow (&connection->spool_file, connection->filesize + connection->chunk_size) < 0) {
+		/* 452 4.4.5 Insufficient disk space; try again later. */
+		connection->state = DISCARDING_BDAT;
+		connection->next_state = DISCARDING_BDAT;
+
+		return discard_bdat (connection);
+	}
+
+	stream_copy_init (&stream_copy, input_stream, connection->spool_file.fd);
 
 	/* Save chunk size. */
 	chunk_size = connection->chunk_size;
@@ -997,12 +1088,10 @@ int handle_bdat_command (connection_t *connection)
 
 	connection->filesize += chunk_size;
 
-	buffer_reset (&connection->output);
-
 	/* If the message is too large... */
 	if (connection->filesize > server.max_message_size) {
 		/* 552 5.2.3 Message size exceeds maximum value. */
-		if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_552, sizeof (REPLY_CODE_552) - 1) < 0) {
+		if (connection_reply (connection, REPLY_CODE_552, sizeof (REPLY_CODE_552) - 1) < 0) {
 			/* Couldn't allocate memory. */
 			return -1;
 		}
@@ -1015,7 +1104,7 @@ int handle_bdat_command (connection_t *connection)
 	/* If it's not the last chunk... */
 	if (!connection->last) {
 		/* 250 2.0.0 OK. */
-		if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_250_2_0_0, sizeof (REPLY_CODE_250_2_0_0) - 1) < 0) {
+		if (connection_reply (connection, REPLY_CODE_250_2_0_0, sizeof (REPLY_CODE_250_2_0_0) - 1) < 0) {
 			/* Couldn't allocate memory. */
 			return -1;
 		}
@@ -1023,35 +1112,7 @@ int handle_bdat_command (connection_t *connection)
 		return prepare_for_writing (connection);
 	}
 
-	close (connection->fd);
-	connection->fd = -1;
-
-	snprintf (oldpath, sizeof (oldpath), "%s/%lu-%u.eml", server.incoming_directory, connection->file_timestamp, connection->nfile);
-
-	/* 250 2.0.0 Message accepted for delivery. */
-	if (buffer_append_size_bounded_string (&connection->output, MESSAGE_ACCEPTED_FOR_DELIVERY, sizeof (MESSAGE_ACCEPTED_FOR_DELIVERY) - 1) < 0) {
-		/* Couldn't allocate memory. */
-		unlink (oldpath);
-		return -1;
-	}
-
-	/* Move file from incoming to received directory. */
-	snprintf (newpath, sizeof (newpath), "%s/%lu-%u.eml", server.received_directory, connection->file_timestamp, connection->nfile);
-	rename (oldpath, newpath);
-
-	/* Notify delivery process. */
-	kill (server.delivery_pid, SIGUSR1);
-
-	if (server.log_mails) {
-		log_mail (&server.local_time, connection);
-	}
-
-	connection->ntransactions++;
-
-	mail_transaction_free (&connection->mail_transaction);
-	connection->next_state = INITIAL_STATE;
-
-	return prepare_for_writing (connection);
+	return finish_message (connection);
 }
 
 int discard_bdat (connection_t *connection)
@@ -1079,12 +1140,10 @@ int discard_bdat (connection_t *connection)
 		return -1;
 	}
 
-	buffer_reset (&connection->output);
-
 	/* If it's not the last chunk... */
 	if (!connection->last) {
 		/* 250 2.0.0 OK. */
-		if (buffer_append_size_bounded_string (&connection->output, REPLY_CODE_250_2_0_0, sizeof (REPLY_CODE_250_2_0_0) - 1) < 0) {
+		if (connection_reply (connection, REPLY_CODE_250_2_0_0, sizeof (REPLY_CODE_250_2_0_0) - 1) < 0) {
 			/* Couldn't allocate memory. */
 			return -1;
 		}
@@ -1093,7 +1152,7 @@ int discard_bdat (connection_t *connection)
 	}
 
 	/* 452 4.4.5 Insufficient disk space; try again later. */
-	if (buffer_append_size_bounded_string (&connection->output, INSUFFICIENT_DISK_SPACE, sizeof (INSUFFICIENT_DISK_SPACE) - 1) < 0) {
+	if (connection_reply (connection, INSUFFICIENT_DISK_SPACE, sizeof (INSUFFICIENT_DISK_SPACE) - 1) < 0) {
 		/* Couldn't allocate memory. */
 		return -1;
 	}
@@ -1103,98 +1162,255 @@ int discard_bdat (connection_t *connection)
 	return prepare_for_writing (connection);
 }
 
-int prepare_message_file (connection_t *connection)
+int prepare_message_file (connection_t *connection, uint32_t flags)
 {
 	buffer_t buffer;
+	const buffer_t *received_by;
 	mail_transaction_t *mail_transaction;
-	domainlist_t *forward_paths;
-	domain_t *domain;
-	struct tm *stm;
-	char *data;
-	char filename[PATH_MAX + 1];
 	char peer[20];
-	struct stat buf;
-	size_t i, j;
 
 	/* Get peer IP. */
 	if (!inet_ntop (AF_INET, &(connection->sin.sin_addr), peer, sizeof (peer))) {
 		return -1;
 	}
 
-	/* Seek an available filename. */
-	do {
-		snprintf (filename, sizeof (filename), "%s/%lu-%u.eml", server.incoming_directory, server.current_time, server.nfile);
-		if (stat (filename, &buf) < 0) {
-			connection->file_timestamp = server.current_time;
-			connection->nfile = server.nfile++;
-
-			break;
+	/* Open file where we will store the message (if not already open). */
+	if (connection->spool_file.fd == -1) {
+		if (spool_file_open (&connection->spool_file, 0) < 0) {
+			return -1;
 		}
-
-		server.nfile++;
-	} while (1);
-
-	/* Open file where we will store the message. */
-	connection->fd = open (filename, O_CREAT | O_WRONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (connection->fd < 0) {
-		return -1;
 	}
 
-	/* Build a pre-header with reverse-path and forward-paths for the delivery program. */
+	/* Build the envelope for the delivery program. */
 	buffer_init (&buffer, 1024);
 	mail_transaction = &connection->mail_transaction;
 
-	/* Add reverse path to the pre-header. */
-	if (buffer_format (&buffer, "MAIL FROM: %s\r\n", mail_transaction->reverse_path) < 0) {
+	if (envelope_build (&buffer, mail_transaction->reverse_path, &mail_transaction->forward_paths, &server.domainlist, flags) < 0) {
 		/* Couldn't allocate memory. */
 		buffer_free (&buffer);
 		return -1;
 	}
 
-	forward_paths = &mail_transaction->forward_paths;
-	data = forward_paths->data.data;
+	/* Message starts here. */
+	/* Add Received field. */
+	if (((received_by = replies_received_by (server.current_time, &server.stm)) == NULL) || (buffer_append_string (&buffer, "Received: FROM ") < 0) || (buffer_append_string (&buffer, peer) < 0) || (buffer_append_string (&buffer, "\r\n") < 0) || (buffer_append_size_bounded_string (&buffer, received_by->data, received_by->used) < 0)) {
+		/* Couldn't allocate memory. */
+		buffer_free (&buffer);
+		return -1;
+	}
+
+	/* Write buffer to disk. */
+	if (write (connection->spool_file.fd, buffer.data, buffer.used) != buffer.used) {
+		/* Couldn't write. */
+		buffer_free (&buffer);
+		return -1;
+	}
+
+	buffer_free (&buffer);
+
+	return 0;
+}
+
+int finish_message (connection_t *connection)
+{
+	struct epoll_event ev;
+	int committed;
+
+	/* The reply to the end of a message is sent right away. */
+	connection->pipelined = 0;
+
+	if (!server.group_commit) {
+		/* Deliver small messages for local recipients right away or make
+		 * the message visible to the delivery process.
+		 */
+		if (deliver_directly (connection) == 0) {
+			committed = 1;
+		} else {
+			committed = (spool_file_publish (&connection->spool_file) == 0);
+		}
+
+		if (reply_message (connection, committed) < 0) {
+			return -1;
+		}
+
+		if (committed) {
+			/* Notify delivery process. */
+			handoff_notify ();
+		}
+
+		return prepare_for_writing (connection);
+	}
+
+	/* Don't notify me of any event until the message has been committed. */
+	ev.events = 0;
+	ev.data.u64 = 0;
+	ev.data.fd = connection->sd;
+
+	if (epoll_ctl (server.epoll_fd, EPOLL_CTL_MOD, connection->sd, &ev) < 0) {
+		return -1;
+	}
+
+	connection->state = COMMITTING_STATE;
+
+	/* Add ourself to the list of connections waiting for the next commit. */
+	server.committing_connections[server.number_committing_connections++] = connection;
+
+	return 0;
+}
+
+int deliver_directly (connection_t *connection)
+{
+	domainlist_t *forward_paths;
+	domain_t *domain;
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	size_t nrecipients;
+	size_t i;
+
+	/* Only small messages: the other connections wait meanwhile. */
+	if ((server.direct_delivery_size == 0) || (connection->filesize > server.direct_delivery_size) || ((server.lmtp_server) && (*server.lmtp_server))) {
+		return -1;
+	}
 
-	/* Add forward paths to the pre-header. */
+	/* Are all the recipients local (and not too many)? */
+	forward_paths = &connection->mail_transaction.forward_paths;
+
+	nrecipients = 0;
 	for (i = 0; i < forward_paths->used; i++) {
 		domain = &(forward_paths->records[i]);
-		for (j = 0; j < domain->used; j++) {
-			if (buffer_format (&buffer, "RCPT TO: %s@%s\r\n", data + domain->local_parts[j], data + domain->domain_name) < 0) {
-				/* Couldn't allocate memory. */
-				buffer_free (&buffer);
-				return -1;
-			}
+		if (domainlist_search_domain (&server.domainlist, forward_paths->data.data + domain->domain_name) != 0) {
+			return -1;
 		}
+
+		nrecipients += domain->used;
 	}
 
-	/* Add an empty line to the pre-header. */
-	if (buffer_append_size_bounded_string (&buffer, "\r\n", 2) < 0) {
-		/* Couldn't allocate memory. */
-		buffer_free (&buffer);
+	if ((nrecipients == 0) || (nrecipients > DIRECT_DELIVERY_MAX_RECIPIENTS)) {
 		return -1;
 	}
 
-	stm = &server.stm;
+	snprintf (filename, sizeof (filename), "%s%s", connection->spool_file.queue_id, MESSAGE_EXTENSION);
 
-	/* Message starts here. */
-	/* Add Received field. */
-	if (buffer_format (&buffer, "Received: FROM %s\r\n\tBY %s;\r\n\t%s, %d %s %d %02d:%02d:%02d GMT\r\n", peer, domainlist_get_first_domain (&server.domainlist), days[stm->tm_wday], stm->tm_mday, months[stm->tm_mon], 1900 + stm->tm_year, stm->tm_hour, stm->tm_min, stm->tm_sec) < 0) {
-		/* Couldn't allocate memory. */
-		buffer_free (&buffer);
+	/* If some recipients have been deferred, the message is queued as usual. */
+	if (deliver_direct (connection->spool_file.fd, filename) != 0) {
 		return -1;
 	}
 
-	/* Write buffer to disk. */
-	if (write (connection->fd, buffer.data, buffer.used) != buffer.used) {
-		/* Couldn't write. */
-		buffer_free (&buffer);
+	/* The spool file isn't needed any more. */
+	spool_file_abort (&connection->spool_file);
+
+	return 0;
+}
+
+int reply_message (connection_t *connection, int committed)
+{
+	if (!committed) {
+		/* 451 4.3.2 Please try again later. */
+		if (connection_reply (connection, REPLY_CODE_451, sizeof (REPLY_CODE_451) - 1) < 0) {
+			/* Couldn't allocate memory. */
+			return -1;
+		}
+
+		reset_mail_transaction (connection);
+
+		return 0;
+	}
+
+	/* 250 2.0.0 Message accepted for delivery. */
+	if (connection_reply (connection, MESSAGE_ACCEPTED_FOR_DELIVERY, sizeof (MESSAGE_ACCEPTED_FOR_DELIVERY) - 1) < 0) {
+		/* Couldn't allocate memory. */
 		return -1;
 	}
 
-	buffer_free (&buffer);
+	if (server.log_mails) {
+		log_mail (&server.local_time, connection);
+	}
+
+	connection->ntransactions++;
+
+	mail_transaction_free (&connection->mail_transaction);
+	connection->next_state = INITIAL_STATE;
 
 	return 0;
 }
 
+void commit_messages (void)
+{
+	connection_t **connections;
+	connection_t *connection;
+	size_t nconnections;
+	size_t committed;
+	uint64_t shards;
+	int synced;
+	size_t i;
+
+	connections = server.committing_connections;
+	nconnections = server.number_committing_connections;
+
+	/* Flush the data of all the messages with a single call. */
+	synced = (syncfs (server.received_directory_fd) == 0);
+
+	/* Give names to the messages... */
+	committed = 0;
+	shards = 0;
+	for (i = 0; i < nconnections; i++) {
+		connection = connections[i];
+
+		if (synced) {
+			shards |= (uint64_t) 1 << spool_directory_shard (connection->spool_file.queue_id);
+
+			if (spool_file_link (&connection->spool_file) == 0) {
+				connections[committed++] = connection;
+				continue;
+			}
+		} else {
+			spool_file_abort (&connection->spool_file);
+		}
+
+		reply_committed_message (connection, 0);
+	}
+
+	/* and flush the directory entries of their shards. */
+	if ((committed > 0) && (spool_directory_sync (server.received_directory, shards) < 0)) {
+		synced = 0;
+	}
+
+	/* The journal has to know about them after a crash as well. */
+	if ((committed > 0) && (synced) && (server.queue_journal) && (journal_sync () < 0)) {
+		synced = 0;
+	}
+
+	/* Hand the messages over to the delivery process, or take them back:
+	 * the client will send them again after the 451.
+	 */
+	for (i = 0; i < committed; i++) {
+		if (synced) {
+			spool_file_enqueue (&connections[i]->spool_file);
+		} else {
+			spool_file_unlink (&connections[i]->spool_file);
+		}
+
+		reply_committed_message (connections[i], synced);
+	}
+
+	server.number_committing_connections = 0;
+
+	if ((committed > 0) && (synced)) {
+		/* Notify delivery process. */
+		handoff_notify ();
+	}
+}
+
+void reply_committed_message (connection_t *connection, int committed)
+{
+	/* If we fail, the connection keeps the COMMITTING_STATE and the server will remove it. */
+	if (reply_message (connection, committed) == 0) {
+		prepare_for_writing (connection);
+	}
+
+	/* Send the reply right away. */
+	server.interrupted_connections[server.number_interrupted_connections++] = connection;
+}
+
 int domain_is_reachable (const char *domain)
 {
 	eDnsStatus status;
@@ -6,4 +6,7 @@
 
 int handle_connection (connection_t *connection, struct epoll_event *event);
 
+/* Commit the messages of the connections in COMMITTING_STATE and send their replies. */
+void commit_messages (void);
+
 #endif /* HANDLE_CONNECTION_H */
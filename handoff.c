@@ -0,0 +1,148 @@
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "handoff.h"
+
+typedef struct {
+	/* Written by the producer. */
+	unsigned head;
+	int overflow; /* Some message didn't fit in the ring. */
+
+	char padding[64 - sizeof (unsigned) - sizeof (int)];
+
+	/* Written by the consumer. */
+	unsigned tail;
+	unsigned released; /* In-memory messages delivered, their memory is free again. */
+
+	handoff_entry_t entries[HANDOFF_RING_SIZE];
+} handoff_ring_t;
+
+static handoff_ring_t *ring = NULL;
+static int event_fd = -1;
+static int wakeup = 0;
+
+int handoff_create (void)
+{
+	ring = (handoff_ring_t *) mmap (NULL, sizeof (handoff_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		ring = NULL;
+		return -1;
+	}
+
+	if ((event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		munmap (ring, sizeof (handoff_ring_t));
+		ring = NULL;
+		return -1;
+	}
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->overflow = 0;
+	ring->released = 0;
+
+	return 0;
+}
+
+void handoff_destroy (void)
+{
+	if (ring) {
+		munmap (ring, sizeof (handoff_ring_t));
+		ring = NULL;
+	}
+
+	if (event_fd != -1) {
+		close (event_fd);
+		event_fd = -1;
+	}
+}
+
+int handoff_push (const char *queue_id)
+{
+	handoff_entry_t *entry;
+	unsigned head, tail;
+
+	head = ring->head;
+	tail = __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+
+	/* If the ring is full, the delivery process will have to scan the directory. */
+	if (head - tail == HANDOFF_RING_SIZE) {
+		__atomic_store_n (&ring->overflow, 1, __ATOMIC_SEQ_CST);
+		wakeup = 1;
+		return -1;
+	}
+
+	entry = &(ring->entries[head & (HANDOFF_RING_SIZE - 1)]);
+	strncpy (entry->queue_id, queue_id, QUEUE_ID_MAXLEN);
+	entry->queue_id[QUEUE_ID_MAXLEN] = 0;
+
+	__atomic_store_n (&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+	/* Wake up the consumer only if it might have seen the ring empty. */
+	if (__atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST) == head) {
+		wakeup = 1;
+	}
+
+	return 0;
+}
+
+void handoff_notify (void)
+{
+	uint64_t value = 1;
+
+	if (wakeup) {
+		write (event_fd, &value, sizeof (value));
+		wakeup = 0;
+	}
+}
+
+int handoff_fd (void)
+{
+	return event_fd;
+}
+
+int handoff_pop (handoff_entry_t *entry)
+{
+	unsigned head, tail;
+
+	tail = __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+
+	do {
+		head = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST);
+		if (tail == head) {
+			return -1;
+		}
+
+		memcpy (entry, &(ring->entries[tail & (HANDOFF_RING_SIZE - 1)]), sizeof (handoff_entry_t));
+
+		/* Claim the entry (another worker might have been faster, then the
+		 * entry we have just copied might have been overwritten, try again).
+		 */
+	} while (!__atomic_compare_exchange_n (&ring->tail, &tail, tail + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	return 0;
+}
+
+int handoff_overflowed (void)
+{
+	return __atomic_exchange_n (&ring->overflow, 0, __ATOMIC_SEQ_CST);
+}
+
+void handoff_release (void)
+{
+	__atomic_add_fetch (&ring->released, 1, __ATOMIC_SEQ_CST);
+}
+
+unsigned handoff_released (void)
+{
+	return __atomic_exchange_n (&ring->released, 0, __ATOMIC_SEQ_CST);
+}
+
+void handoff_clear (void)
+{
+	uint64_t value;
+
+	/* Reset the eventfd counter. */
+	read (event_fd, &value, sizeof (value));
+}
@@ -0,0 +1,43 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "queue_id.h"
+
+/* Ring of messages received by the receiver and waiting for the delivery process.
+ * It lives in shared memory (created before forking the delivery process), the
+ * receiver is the only producer, the delivery workers claim the entries atomically.
+ * Wakeups go through an eventfd and are coalesced: the consumers are only woken
+ * up when the ring was empty.
+ */
+
+#define HANDOFF_RING_SIZE 4096 /* Power of 2. */
+
+/* Only the queue ID: the workers read the envelope at the head of the
+ * message file anyway (a single pread()), copying it here would not save
+ * them a system call.
+ */
+typedef struct {
+	char queue_id[QUEUE_ID_MAXLEN + 1];
+} handoff_entry_t;
+
+int handoff_create (void);
+void handoff_destroy (void);
+
+/* Receiver. */
+int handoff_push (const char *queue_id);
+void handoff_notify (void);
+
+/* Delivery workers. */
+int handoff_fd (void);
+int handoff_pop (handoff_entry_t *entry);
+int handoff_overflowed (void);
+void handoff_clear (void);
+
+/* In-memory messages (handed over through the delivery socket): the workers
+ * count those they are done with, the receiver takes the count back (and
+ * resets it) when it runs out of memory for new ones.
+ */
+void handoff_release (void);
+unsigned handoff_released (void);
+
+#endif /* HANDOFF_H */
@@ -1,184 +1,650 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "ip_list.h"
 
-#define IP_ALLOC 10
-
-static int allocate (ip_list_t *ip_list);
-static uint32_t compute_mask (uint8_t n);
-static int search (ip_list_t *ip_list, uint32_t ip, uint32_t mask, unsigned int *position);
-static int insert (ip_list_t *ip_list, uint32_t ip, uint32_t mask);
+#define PREFIX_ALLOC 10
+
+#define DIRECT_BITS 12 /* Bits of the direct table. */
+#define DIRECT_SIZE (1 << DIRECT_BITS)
+#define DIRECT_LEAF 0x80000000 /* The entry is a value, not a node. */
+
+#define STRIDE      6 /* Bits per node. */
+#define SLOTS       (1 << STRIDE)
+
+#define IP_LIST_MAGIC 0x31504c49 /* "ILP1" */
+
+/* Header of the file written by ip_list_write(), followed by the direct table,
+ * the nodes and the leaves of the IPv4 trie, then of the IPv6 trie.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t ndirect4;
+	uint64_t nnodes4;
+	uint64_t nleaves4;
+	uint64_t ndirect6;
+	uint64_t nnodes6;
+	uint64_t nleaves6;
+} ip_list_header_t;
+
+static void trie_init (ip_trie_t *trie);
+static void trie_free (ip_trie_t *trie);
+static int compare_prefixes (const void *p1, const void *p2);
+static unsigned int chunk (uint64_t hi, uint64_t lo, unsigned int offset, unsigned int width);
+static int allocate_nodes (ip_trie_t *trie, size_t count);
+static int allocate_leaves (ip_trie_t *trie, size_t count);
+static int build_trie (ip_trie_t *trie, ip_prefix_t *prefixes, size_t n);
+static int build_node (ip_trie_t *trie, uint32_t index, const ip_prefix_t *prefixes, size_t n, unsigned int offset, uint32_t inherited);
+static uint32_t lookup (const ip_trie_t *trie, uint64_t hi, uint64_t lo);
+static int write_all (int fd, const void *data, size_t len);
+static int read_trie (ip_trie_t *trie, int fd, off_t *offset, size_t ndirect, size_t nnodes, size_t nleaves);
 
 void ip_list_init (ip_list_t *ip_list)
 {
-	ip_list->ips = NULL;
+	ip_list->prefixes = NULL;
 	ip_list->size = 0;
 	ip_list->used = 0;
+
+	trie_init (&ip_list->ipv4);
+	trie_init (&ip_list->ipv6);
 }
 
 void ip_list_free (ip_list_t *ip_list)
 {
-	if (ip_list->ips) {
-		free (ip_list->ips);
-		ip_list->ips = NULL;
+	if (ip_list->prefixes) {
+		free (ip_list->prefixes);
+		ip_list->prefixes = NULL;
 	}
 
 	ip_list->size = 0;
 	ip_list->used = 0;
+
+	trie_free (&ip_list->ipv4);
+	trie_free (&ip_list->ipv6);
+}
+
+void trie_init (ip_trie_t *trie)
+{
+	trie->direct = NULL;
+
+	trie->nodes = NULL;
+	trie->nnodes = 0;
+	trie->nodes_size = 0;
+
+	trie->leaves = NULL;
+	trie->nleaves = 0;
+	trie->leaves_size = 0;
+}
+
+void trie_free (ip_trie_t *trie)
+{
+	if (trie->direct) {
+		free (trie->direct);
+	}
+
+	if (trie->nodes) {
+		free (trie->nodes);
+	}
+
+	if (trie->leaves) {
+		free (trie->leaves);
+	}
+
+	trie_init (trie);
 }
 
-int allocate (ip_list_t *ip_list)
+int ip_list_insert (ip_list_t *ip_list, const char *string, uint32_t value)
 {
-	ip_t *ips;
+	ip_prefix_t *prefix;
+	unsigned char addr[16];
+	char ip[INET6_ADDRSTRLEN];
+	const char *ptr;
+	char *end;
+	unsigned long length;
+	unsigned long n;
+	size_t len;
 	size_t size;
+	int i;
+
+	if ((value == 0) || (value & DIRECT_LEAF)) {
+		return -1;
+	}
 
 	if (ip_list->used == ip_list->size) {
-		size = ip_list->size + IP_ALLOC;
-		ips = (ip_t *) realloc (ip_list->ips, size * sizeof (ip_t));
-		if (!ips) {
-			return -1;
+		size = (ip_list->size + PREFIX_ALLOC) * 2;
+		prefix = (ip_prefix_t *) realloc (ip_list->prefixes, size * sizeof (ip_prefix_t));
+		if (!prefix) {
+			return -2;
 		}
 
-		ip_list->ips = ips;
+		ip_list->prefixes = prefix;
 		ip_list->size = size;
 	}
 
+	prefix = &(ip_list->prefixes[ip_list->used]);
+
+	ptr = strchr (string, '/');
+	len = (ptr) ? (size_t) (ptr - string) : strlen (string);
+	if ((len == 0) || (len >= sizeof (ip))) {
+		return -1;
+	}
+
+	memcpy (ip, string, len);
+	ip[len] = 0;
+
+	if (inet_pton (AF_INET, ip, addr) == 1) {
+		prefix->ipv6 = 0;
+		prefix->hi = (uint64_t) (((uint32_t) addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3]) << 32;
+		prefix->lo = 0;
+		n = 32;
+	} else if (inet_pton (AF_INET6, ip, addr) == 1) {
+		prefix->ipv6 = 1;
+		prefix->hi = 0;
+		prefix->lo = 0;
+		for (i = 0; i < 8; i++) {
+			prefix->hi = (prefix->hi << 8) | addr[i];
+			prefix->lo = (prefix->lo << 8) | addr[8 + i];
+		}
+
+		n = 128;
+	} else {
+		return -1;
+	}
+
+	if (ptr) {
+		if ((ptr[1] < '0') || (ptr[1] > '9') || ((length = strtoul (ptr + 1, &end, 10)) > n) || (*end)) {
+			return -1;
+		}
+
+		n = length;
+	}
+
+	/* Clear the bits after the prefix. */
+	if (n == 0) {
+		prefix->hi = 0;
+		prefix->lo = 0;
+	} else if (n <= 64) {
+		prefix->hi &= ~((uint64_t) 0) << (64 - n);
+		prefix->lo = 0;
+	} else if (n < 128) {
+		prefix->lo &= ~((uint64_t) 0) << (128 - n);
+	}
+
+	prefix->len = n;
+	prefix->value = value;
+
+	ip_list->used++;
+
 	return 0;
 }
 
-uint32_t compute_mask (uint8_t n)
+int ip_list_build (ip_list_t *ip_list)
 {
-	uint32_t mask;
-	uint8_t i;
+	size_t n4;
 
-	mask = 0;
-	for (i = 0; i < n; i++) {
-		mask |= (0x80000000 >> i);
+	trie_free (&ip_list->ipv4);
+	trie_free (&ip_list->ipv6);
+
+	/* IPv4 first, then by address, length (the shorter first) and value. */
+	qsort (ip_list->prefixes, ip_list->used, sizeof (ip_prefix_t), compare_prefixes);
+
+	for (n4 = 0; (n4 < ip_list->used) && (!ip_list->prefixes[n4].ipv6); n4++);
+
+	if ((build_trie (&ip_list->ipv4, ip_list->prefixes, n4) < 0) || (build_trie (&ip_list->ipv6, ip_list->prefixes + n4, ip_list->used - n4) < 0)) {
+		trie_free (&ip_list->ipv4);
+		trie_free (&ip_list->ipv6);
+
+		return -1;
+	}
+
+	/* The prefixes aren't needed anymore. */
+	if (ip_list->prefixes) {
+		free (ip_list->prefixes);
+		ip_list->prefixes = NULL;
 	}
 
-	return mask;
+	ip_list->size = 0;
+	ip_list->used = 0;
+
+	return 0;
 }
 
-int search (ip_list_t *ip_list, uint32_t ip, uint32_t mask, unsigned int *position)
+int compare_prefixes (const void *p1, const void *p2)
 {
-	int i, j, pivot;
+	const ip_prefix_t *prefix1, *prefix2;
 
-	i = 0;
-	j = ip_list->used - 1;
+	prefix1 = (const ip_prefix_t *) p1;
+	prefix2 = (const ip_prefix_t *) p2;
 
-	while (i <= j) {
-		pivot = (i + j) / 2;
+	if (prefix1->ipv6 != prefix2->ipv6) {
+		return (prefix1->ipv6 < prefix2->ipv6) ? -1 : 1;
+	}
 
-		if ((ip & mask) < (ip_list->ips[pivot].ip & ip_list->ips[pivot].mask)) {
-			j = pivot - 1;
-		} else if ((ip & mask) == (ip_list->ips[pivot].ip & ip_list->ips[pivot].mask)) {
-			*position = (unsigned int) pivot;
-			return 0;
-		} else {
-			i = pivot + 1;
+	if (prefix1->hi != prefix2->hi) {
+		return (prefix1->hi < prefix2->hi) ? -1 : 1;
+	}
+
+	if (prefix1->lo != prefix2->lo) {
+		return (prefix1->lo < prefix2->lo) ? -1 : 1;
+	}
+
+	if (prefix1->len != prefix2->len) {
+		return (int) prefix1->len - (int) prefix2->len;
+	}
+
+	/* The same prefix more than once: the highest value is painted last. */
+	if (prefix1->value != prefix2->value) {
+		return (prefix1->value < prefix2->value) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+unsigned int chunk (uint64_t hi, uint64_t lo, unsigned int offset, unsigned int width)
+{
+	/* Bits [offset, offset + width) of the address (zeros after the 128th). */
+	if (offset + width <= 64) {
+		return (hi >> (64 - width - offset)) & ((1 << width) - 1);
+	} else if (offset < 64) {
+		return ((hi << (offset + width - 64)) | (lo >> (128 - width - offset))) & ((1 << width) - 1);
+	} else if (offset + width <= 128) {
+		return (lo >> (128 - width - offset)) & ((1 << width) - 1);
+	} else {
+		return (lo << (offset + width - 128)) & ((1 << width) - 1);
+	}
+}
+
+int allocate_nodes (ip_trie_t *trie, size_t count)
+{
+	ip_node_t *nodes;
+	size_t size;
+
+	if (trie->nnodes + count > trie->nodes_size) {
+		size = (trie->nnodes + count) * 2;
+		nodes = (ip_node_t *) realloc (trie->nodes, size * sizeof (ip_node_t));
+		if (!nodes) {
+			return -1;
 		}
+
+		trie->nodes = nodes;
+		trie->nodes_size = size;
 	}
 
-	*position = (unsigned int) i;
+	return 0;
+}
+
+int allocate_leaves (ip_trie_t *trie, size_t count)
+{
+	uint32_t *leaves;
+	size_t size;
 
-	return -1;
+	if (trie->nleaves + count > trie->leaves_size) {
+		size = (trie->nleaves + count) * 2;
+		leaves = (uint32_t *) realloc (trie->leaves, size * sizeof (uint32_t));
+		if (!leaves) {
+			return -1;
+		}
+
+		trie->leaves = leaves;
+		trie->leaves_size = size;
+	}
+
+	return 0;
 }
 
-int insert (ip_list_t *ip_list, uint32_t ip, uint32_t mask)
+int build_trie (ip_trie_t *trie, ip_prefix_t *prefixes, size_t n)
 {
-	unsigned int position;
+	uint32_t inherited;
+	unsigned int first;
+	unsigned int count;
+	unsigned int slot;
+	size_t i, j;
 
-	if (search (ip_list, ip, mask, &position) == 0) {
+	if (n == 0) {
 		return 0;
 	}
 
-	if (allocate (ip_list) < 0) {
+	/* The first DIRECT_BITS bits index the direct table (as a node would). */
+	trie->direct = (uint32_t *) malloc (DIRECT_SIZE * sizeof (uint32_t));
+	if (!trie->direct) {
 		return -1;
 	}
 
-	if (position < ip_list->used) {
-		memmove (&(ip_list->ips[position + 1]), &(ip_list->ips[position]), (ip_list->used - position) * sizeof (ip_t));
+	for (i = 0; i < DIRECT_SIZE; i++) {
+		trie->direct[i] = DIRECT_LEAF;
 	}
 
-	ip_list->ips[position].ip = ip;
-	ip_list->ips[position].mask = mask;
+	for (i = 0; i < n; i++) {
+		if (prefixes[i].len <= DIRECT_BITS) {
+			first = chunk (prefixes[i].hi, prefixes[i].lo, 0, DIRECT_BITS);
+			count = 1 << (DIRECT_BITS - prefixes[i].len);
 
-	ip_list->used++;
+			for (j = first; j < first + count; j++) {
+				trie->direct[j] = DIRECT_LEAF | prefixes[i].value;
+			}
+		}
+	}
+
+	/* A node for each entry with longer prefixes. */
+	i = 0;
+	while (i < n) {
+		if (prefixes[i].len <= DIRECT_BITS) {
+			i++;
+			continue;
+		}
+
+		slot = chunk (prefixes[i].hi, prefixes[i].lo, 0, DIRECT_BITS);
+
+		for (j = i + 1; (j < n) && (prefixes[j].len > DIRECT_BITS) && (chunk (prefixes[j].hi, prefixes[j].lo, 0, DIRECT_BITS) == slot); j++);
+
+		if (allocate_nodes (trie, 1) < 0) {
+			return -1;
+		}
+
+		inherited = trie->direct[slot] & ~DIRECT_LEAF;
+		trie->direct[slot] = trie->nnodes++;
+
+		if (build_node (trie, trie->direct[slot], prefixes + i, j - i, DIRECT_BITS, inherited) < 0) {
+			return -1;
+		}
+
+		i = j;
+	}
 
 	return 0;
 }
 
-int ip_list_load (ip_list_t *ip_list, configuration_t *conf)
+int build_node (ip_trie_t *trie, uint32_t index, const ip_prefix_t *prefixes, size_t n, unsigned int offset, uint32_t inherited)
 {
-	struct in_addr addr;
-	const char *string;
-	const char *ptr;
-	char ip[16];
-	int n;
-	size_t len;
-	size_t i;
+	/* "prefixes" are sorted and all of them are within the node. */
+	uint32_t values[SLOTS];
+	ip_node_t *node;
+	uint64_t vector;
+	uint64_t leafvec;
+	uint32_t base0;
+	uint32_t base1;
+	unsigned int end;
+	unsigned int first;
+	unsigned int count;
+	unsigned int slot;
+	size_t i, j;
+
+	end = offset + STRIDE;
+
+	/* The prefixes ending in this node cover a range of slots. A prefix
+	 * comes before the longer ones it contains: they overwrite it.
+	 */
+	for (i = 0; i < SLOTS; i++) {
+		values[i] = inherited;
+	}
 
-	ip_list_free (ip_list);
+	vector = 0;
 
-	for (i = 0; ((string = configuration_get_child (conf, i, "General", "IPsForRelay", NULL)) != NULL); i++) {
-		ptr = strchr (string, '/');
-		if (ptr) {
-			len = ptr - string;
+	for (i = 0; i < n; i++) {
+		if (prefixes[i].len <= end) {
+			first = chunk (prefixes[i].hi, prefixes[i].lo, offset, STRIDE);
+			count = 1 << (end - prefixes[i].len);
 
-			n = atoi (ptr + 1);
-			if ((n < 0) || (n > 32)) {
-				fprintf (stderr, "Ignoring IP: [%s].\n", string);
-				continue;
+			for (j = first; j < first + count; j++) {
+				values[j] = prefixes[i].value;
 			}
 		} else {
-			len = strlen (string);
+			vector |= (uint64_t) 1 << chunk (prefixes[i].hi, prefixes[i].lo, offset, STRIDE);
+		}
+	}
+
+	/* Leaves: one per run of equal values. */
+	leafvec = 0;
+
+	if (allocate_leaves (trie, SLOTS) < 0) {
+		return -1;
+	}
+
+	base0 = trie->nleaves;
 
-			n = 32;
+	for (i = 0; i < SLOTS; i++) {
+		if ((i == 0) || (values[i] != values[i - 1])) {
+			leafvec |= (uint64_t) 1 << i;
+			trie->leaves[trie->nleaves++] = values[i];
 		}
+	}
+
+	/* Children: consecutive. */
+	count = __builtin_popcountll (vector);
 
-		if ((len < 7) || (len > 15)) {
-			fprintf (stderr, "Ignoring IP: [%s].\n", string);
+	if (allocate_nodes (trie, count) < 0) {
+		return -1;
+	}
+
+	base1 = trie->nnodes;
+	trie->nnodes += count;
+
+	node = &(trie->nodes[index]);
+	node->vector = vector;
+	node->leafvec = leafvec;
+	node->base0 = base0;
+	node->base1 = base1;
+
+	/* The longer prefixes of a slot are together (they are sorted). */
+	i = 0;
+	while (i < n) {
+		if (prefixes[i].len <= end) {
+			i++;
 			continue;
 		}
 
-		memcpy (ip, string, len);
-		ip[len] = 0;
-		if (inet_aton (ip, &addr) < 0) {
-			fprintf (stderr, "Ignoring IP: [%s].\n", string);
-			continue;
+		slot = chunk (prefixes[i].hi, prefixes[i].lo, offset, STRIDE);
+
+		for (j = i + 1; (j < n) && (prefixes[j].len > end) && (chunk (prefixes[j].hi, prefixes[j].lo, offset, STRIDE) == slot); j++);
+
+		if (build_node (trie, base1++, prefixes + i, j - i, end, values[slot]) < 0) {
+			return -1;
 		}
 
-		if (insert (ip_list, ntohl (addr.s_addr), compute_mask (n)) < 0) {
+		i = j;
+	}
+
+	return 0;
+}
+
+int ip_list_load (ip_list_t *ip_list, configuration_t *conf)
+{
+	const char *string;
+	size_t i;
+	int ret;
+
+	ip_list_free (ip_list);
+
+	for (i = 0; ((string = configuration_get_child (conf, i, "General", "IPsForRelay", NULL)) != NULL); i++) {
+		if ((ret = ip_list_insert (ip_list, string, 1)) < 0) {
+			if (ret == -1) {
+				fprintf (stderr, "Ignoring IP: [%s].\n", string);
+				continue;
+			}
+
 			/* Couldn't allocate memory. */
 			fprintf (stderr, "[ip_list_load] Couldn't allocate memory.\n");
 			return -1;
 		}
 	}
 
+	if (ip_list_build (ip_list) < 0) {
+		fprintf (stderr, "[ip_list_load] Couldn't allocate memory.\n");
+		return -1;
+	}
+
 	return 0;
 }
 
+uint32_t lookup (const ip_trie_t *trie, uint64_t hi, uint64_t lo)
+{
+	const ip_node_t *node;
+	uint64_t mask;
+	uint32_t entry;
+	unsigned int offset;
+	unsigned int slot;
+
+	if (!trie->direct) {
+		return 0;
+	}
+
+	entry = trie->direct[chunk (hi, lo, 0, DIRECT_BITS)];
+	if (entry & DIRECT_LEAF) {
+		return entry & ~DIRECT_LEAF;
+	}
+
+	node = &(trie->nodes[entry]);
+
+	for (offset = DIRECT_BITS; ; offset += STRIDE) {
+		slot = chunk (hi, lo, offset, STRIDE);
+
+		/* Slots up to this one. */
+		mask = ((uint64_t) 2 << slot) - 1;
+
+		if (!(node->vector & ((uint64_t) 1 << slot))) {
+			return trie->leaves[node->base0 + __builtin_popcountll (node->leafvec & mask) - 1];
+		}
+
+		node = &(trie->nodes[node->base1 + __builtin_popcountll (node->vector & mask) - 1]);
+	}
+}
+
+uint32_t ip_list_lookup (ip_list_t *ip_list, uint32_t ip)
+{
+	return lookup (&ip_list->ipv4, (uint64_t) ip << 32, 0);
+}
+
+uint32_t ip_list_lookup6 (ip_list_t *ip_list, const uint8_t *ip)
+{
+	uint64_t hi, lo;
+	int i;
+
+	/* IPv4-mapped address (::ffff:a.b.c.d)? */
+	if ((memcmp (ip, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12) == 0)) {
+		return ip_list_lookup (ip_list, ((uint32_t) ip[12] << 24) | (ip[13] << 16) | (ip[14] << 8) | ip[15]);
+	}
+
+	hi = 0;
+	lo = 0;
+	for (i = 0; i < 8; i++) {
+		hi = (hi << 8) | ip[i];
+		lo = (lo << 8) | ip[8 + i];
+	}
+
+	return lookup (&ip_list->ipv6, hi, lo);
+}
+
 int ip_list_search (ip_list_t *ip_list, uint32_t ip)
 {
-	int i, j, pivot;
+	return (ip_list_lookup (ip_list, ip) != 0) ? 0 : -1;
+}
 
-	i = 0;
-	j = ip_list->used - 1;
+int ip_list_write (ip_list_t *ip_list, int fd)
+{
+	ip_list_header_t header;
+
+	memset (&header, 0, sizeof (header));
+	header.magic = IP_LIST_MAGIC;
+	header.ndirect4 = (ip_list->ipv4.direct) ? DIRECT_SIZE : 0;
+	header.nnodes4 = ip_list->ipv4.nnodes;
+	header.nleaves4 = ip_list->ipv4.nleaves;
+	header.ndirect6 = (ip_list->ipv6.direct) ? DIRECT_SIZE : 0;
+	header.nnodes6 = ip_list->ipv6.nnodes;
+	header.nleaves6 = ip_list->ipv6.nleaves;
+
+	if ((write_all (fd, &header, sizeof (header)) < 0) ||
+	    (write_all (fd, ip_list->ipv4.direct, header.ndirect4 * sizeof (uint32_t)) < 0) || (write_all (fd, ip_list->ipv4.nodes, ip_list->ipv4.nnodes * sizeof (ip_node_t)) < 0) || (write_all (fd, ip_list->ipv4.leaves, ip_list->ipv4.nleaves * sizeof (uint32_t)) < 0) ||
+	    (write_all (fd, ip_list->ipv6.direct, header.ndirect6 * sizeof (uint32_t)) < 0) || (write_all (fd, ip_list->ipv6.nodes, ip_list->ipv6.nnodes * sizeof (ip_node_t)) < 0) || (write_all (fd, ip_list->ipv6.leaves, ip_list->ipv6.nleaves * sizeof (uint32_t)) < 0)) {
+		return -1;
+	}
 
-	while (i <= j) {
-		pivot = (i + j) / 2;
+	return 0;
+}
 
-		if ((ip & ip_list->ips[pivot].mask) < (ip_list->ips[pivot].ip & ip_list->ips[pivot].mask)) {
-			j = pivot - 1;
-		} else if ((ip & ip_list->ips[pivot].mask) == (ip_list->ips[pivot].ip & ip_list->ips[pivot].mask)) {
-			return 0;
-		} else {
-			i = pivot + 1;
+int ip_list_read (ip_list_t *ip_list, int fd, off_t *offset)
+{
+	ip_list_header_t header;
+	struct stat buf;
+
+	ip_list_free (ip_list);
+
+	if ((fstat (fd, &buf) < 0) || (pread (fd, &header, sizeof (header), *offset) != sizeof (header)) || (header.magic != IP_LIST_MAGIC)) {
+		return -1;
+	}
+
+	if (((header.ndirect4 != 0) && (header.ndirect4 != DIRECT_SIZE)) || ((header.ndirect6 != 0) && (header.ndirect6 != DIRECT_SIZE)) || (header.nnodes4 > buf.st_size) || (header.nnodes6 > buf.st_size) || (header.nleaves4 > buf.st_size) || (header.nleaves6 > buf.st_size) ||
+	    (buf.st_size - *offset < sizeof (header) + (header.nnodes4 + header.nnodes6) * sizeof (ip_node_t) + (header.ndirect4 + header.ndirect6 + header.nleaves4 + header.nleaves6) * sizeof (uint32_t))) {
+		return -1;
+	}
+
+	*offset += sizeof (header);
+
+	if ((read_trie (&ip_list->ipv4, fd, offset, header.ndirect4, header.nnodes4, header.nleaves4) < 0) || (read_trie (&ip_list->ipv6, fd, offset, header.ndirect6, header.nnodes6, header.nleaves6) < 0)) {
+		ip_list_free (ip_list);
+		return -1;
+	}
+
+	return 0;
+}
+
+int read_trie (ip_trie_t *trie, int fd, off_t *offset, size_t ndirect, size_t nnodes, size_t nleaves)
+{
+	size_t len;
+
+	if (ndirect == 0) {
+		return 0;
+	}
+
+	if (((trie->direct = (uint32_t *) malloc (ndirect * sizeof (uint32_t))) == NULL) || (allocate_nodes (trie, nnodes) < 0) || (allocate_leaves (trie, nleaves) < 0)) {
+		return -1;
+	}
+
+	len = ndirect * sizeof (uint32_t);
+	if (pread (fd, trie->direct, len, *offset) != (ssize_t) len) {
+		return -1;
+	}
+
+	*offset += len;
+
+	len = nnodes * sizeof (ip_node_t);
+	if (pread (fd, trie->nodes, len, *offset) != (ssize_t) len) {
+		return -1;
+	}
+
+	*offset += len;
+	trie->nnodes = nnodes;
+
+	len = nleaves * sizeof (uint32_t);
+	if (pread (fd, trie->leaves, len, *offset) != (ssize_t) len) {
+		return -1;
+	}
+
+	*offset += len;
+	trie->nleaves = nleaves;
+
+	return 0;
+}
+
+int write_all (int fd, const void *data, size_t len)
+{
+	const char *ptr;
+	ssize_t bytes;
+
+	ptr = (const char *) data;
+
+	while (len > 0) {
+		if ((bytes = write (fd, ptr, len)) < 0) {
+			return -1;
 		}
+
+		ptr += bytes;
+		len -= bytes;
 	}
 
-	return -1;
+	return 0;
 }
@@ -1,25 +1,84 @@
 #ifndef IP_LIST_H
 #define IP_LIST_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include "configuration.h"
 
+/* List of IPv4 and IPv6 prefixes, each with a value (not 0), looked up by
+ * longest prefix match.
+ * The prefixes are added with ip_list_insert() and compiled by ip_list_build()
+ * into a multibit trie (Poptrie): the first 12 bits of the address index a
+ * direct table, then each node covers 6 bits and holds a bitmap of its children
+ * and a bitmap of the runs of equal leaves, both indexed with popcount. The
+ * values of the shorter prefixes are pushed down into the leaves, so a lookup
+ * stops at the first leaf (at most 4 nodes for IPv4, 20 for IPv6).
+ */
+
+typedef struct {
+	uint64_t hi; /* Address, most significant bits first (IPv4: in the upper 32 bits). */
+	uint64_t lo;
+	uint32_t value;
+	uint8_t len;
+	uint8_t ipv6;
+} ip_prefix_t;
+
 typedef struct {
-	uint32_t ip;
-	uint32_t mask;
-} ip_t;
+	uint64_t vector; /* Slots with a child. */
+	uint64_t leafvec; /* Slots starting a run of leaves. */
+	uint32_t base1; /* First child (the children are consecutive). */
+	uint32_t base0; /* First leaf. */
+} ip_node_t;
 
 typedef struct {
-	ip_t *ips;
+	uint32_t *direct; /* First bits: a value (DIRECT_LEAF) or a node. */
+
+	ip_node_t *nodes;
+	size_t nnodes;
+	size_t nodes_size;
+
+	uint32_t *leaves;
+	size_t nleaves;
+	size_t leaves_size;
+} ip_trie_t;
+
+typedef struct {
+	/* Prefixes to be compiled. */
+	ip_prefix_t *prefixes;
 	size_t size;
 	size_t used;
+
+	ip_trie_t ipv4;
+	ip_trie_t ipv6;
 } ip_list_t;
 
 void ip_list_init (ip_list_t *ip_list);
 void ip_list_free (ip_list_t *ip_list);
 
+/* "<ip>[/<length>]" (IPv4 or IPv6), "value" < 2^31. If the same prefix is
+ * inserted more than once, the highest value is kept.
+ * Returns -1 if it is not valid, -2 if out of memory.
+ */
+int ip_list_insert (ip_list_t *ip_list, const char *string, uint32_t value);
+int ip_list_build (ip_list_t *ip_list);
+
+/* IPsForRelay. */
 int ip_list_load (ip_list_t *ip_list, configuration_t *conf);
 
+/* Value of the longest prefix matching the address (host byte order for IPv4,
+ * 16 bytes for IPv6), 0 if none.
+ */
+uint32_t ip_list_lookup (ip_list_t *ip_list, uint32_t ip);
+uint32_t ip_list_lookup6 (ip_list_t *ip_list, const uint8_t *ip);
+
 int ip_list_search (ip_list_t *ip_list, uint32_t ip);
 
+/* Copy the compiled list to / from a file (passed between processes).
+ * ip_list_write() appends it, ip_list_read() reads it at "offset" and moves
+ * "offset" past it.
+ */
+int ip_list_write (ip_list_t *ip_list, int fd);
+int ip_list_read (ip_list_t *ip_list, int fd, off_t *offset);
+
 #endif /* IP_LIST_H */
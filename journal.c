@@ -0,0 +1,621 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+#define JOURNAL_FILE     ".journal"
+#define SNAPSHOT_FILE    ".snapshot"
+#define TEMPORARY_SUFFIX ".tmp"
+
+#define RECORDS_PER_READ 256
+#define INDEX_MIN_SIZE   1024
+
+typedef struct {
+	unsigned generation; /* Bumped every time the journal is replaced. */
+} journal_shared_t;
+
+static journal_shared_t *shared = NULL;
+
+static char directory_path[PATH_MAX + 1];
+static char journal_path[PATH_MAX + 1];
+static char snapshot_path[PATH_MAX + 1];
+
+/* Journal opened by this process. */
+static int journal_fd = -1;
+static unsigned journal_generation = 0;
+
+static int open_journal (void);
+static int lock_journal (int operation);
+static uint32_t checksum (const journal_record_t *record);
+static int load (journal_index_t *index);
+static int read_records (int fd, journal_index_t *index, off_t *offset);
+static int apply (journal_index_t *index, const journal_record_t *record);
+static int write_snapshot (journal_index_t *index);
+static int write_records (int fd, const journal_record_t *records, size_t nrecords);
+static int replace_journal (void);
+
+static size_t hash (int spool, const char *queue_id);
+static int index_insert (journal_index_t *index, int spool, const char *queue_id);
+static void index_remove (journal_index_t *index, int spool, const char *queue_id);
+static int index_grow (journal_index_t *index);
+
+int journal_create (const char *directory)
+{
+	struct stat buf;
+
+	shared = (journal_shared_t *) mmap (NULL, sizeof (journal_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		shared = NULL;
+		return -1;
+	}
+
+	shared->generation = 0;
+
+	snprintf (directory_path, sizeof (directory_path), "%s", directory);
+	snprintf (journal_path, sizeof (journal_path), "%s/%s", directory, JOURNAL_FILE);
+	snprintf (snapshot_path, sizeof (snapshot_path), "%s/%s", directory, SNAPSHOT_FILE);
+
+	/* The files are created by the processes which use them (after switching user).
+	 * Without a journal, the queue has to be rebuilt from the spool directories.
+	 */
+	if (stat (journal_path, &buf) < 0) {
+		return (errno == ENOENT) ? 1 : -1;
+	}
+
+	return 0;
+}
+
+void journal_destroy (void)
+{
+	if (journal_fd != -1) {
+		close (journal_fd);
+		journal_fd = -1;
+	}
+
+	if (shared) {
+		munmap (shared, sizeof (journal_shared_t));
+		shared = NULL;
+	}
+}
+
+int open_journal (void)
+{
+	struct stat buf;
+	unsigned generation;
+
+	generation = __atomic_load_n (&shared->generation, __ATOMIC_ACQUIRE);
+
+	if (journal_fd != -1) {
+		if (journal_generation == generation) {
+			return 0;
+		}
+
+		close (journal_fd);
+	}
+
+	journal_generation = generation;
+
+	journal_fd = open (journal_path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (journal_fd < 0) {
+		return -1;
+	}
+
+	/* Drop the incomplete record a crash might have left at the end. */
+	if (flock (journal_fd, LOCK_EX) == 0) {
+		if ((fstat (journal_fd, &buf) == 0) && (buf.st_size % sizeof (journal_record_t) != 0)) {
+			ftruncate (journal_fd, buf.st_size - buf.st_size % sizeof (journal_record_t));
+		}
+
+		flock (journal_fd, LOCK_UN);
+	}
+
+	return 0;
+}
+
+int lock_journal (int operation)
+{
+	do {
+		if (open_journal () < 0) {
+			return -1;
+		}
+
+		if (flock (journal_fd, operation) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		/* Has the journal been replaced while we were waiting? */
+		if (journal_generation == __atomic_load_n (&shared->generation, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+
+		flock (journal_fd, LOCK_UN);
+	} while (1);
+}
+
+uint32_t checksum (const journal_record_t *record)
+{
+	const unsigned char *data;
+	uint32_t hash;
+	size_t i;
+
+	data = (const unsigned char *) record;
+
+	/* FNV-1a of the record, skipping the checksum itself. */
+	hash = 2166136261u;
+	for (i = 0; i < sizeof (journal_record_t); i++) {
+		if ((i >= offsetof (journal_record_t, checksum)) && (i < offsetof (journal_record_t, checksum) + sizeof (uint32_t))) {
+			continue;
+		}
+
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+int journal_append (int type, int spool, const char *queue_id, unsigned recipient, unsigned state)
+{
+	journal_record_t record;
+	size_t len;
+	int ret;
+
+	if (!shared) {
+		return -1;
+	}
+
+	memset (&record, 0, sizeof (record));
+
+	record.time = time (NULL);
+	record.recipient = recipient;
+	record.type = type;
+	record.spool = spool;
+	record.state = state;
+
+	for (len = 0; (queue_id[len]) && (queue_id[len] != '.') && (len < QUEUE_ID_MAXLEN); len++) {
+		record.queue_id[len] = queue_id[len];
+	}
+
+	record.checksum = checksum (&record);
+
+	if (lock_journal (LOCK_SH) < 0) {
+		return -1;
+	}
+
+	/* Records are written with a single write(), O_APPEND keeps them whole. */
+	ret = (write (journal_fd, &record, sizeof (record)) == sizeof (record)) ? 0 : -1;
+
+	flock (journal_fd, LOCK_UN);
+
+	return ret;
+}
+
+int journal_sync (void)
+{
+	if (journal_fd == -1) {
+		return 0;
+	}
+
+	return fdatasync (journal_fd);
+}
+
+int journal_compact (off_t size)
+{
+	journal_index_t index;
+	struct stat buf;
+
+	if ((!shared) || (open_journal () < 0) || (fstat (journal_fd, &buf) < 0)) {
+		return -1;
+	}
+
+	if (buf.st_size < size) {
+		return 0;
+	}
+
+	/* Nobody writes while we replace the journal. */
+	if (lock_journal (LOCK_EX) < 0) {
+		return -1;
+	}
+
+	journal_index_init (&index);
+
+	if ((load (&index) < 0) || (write_snapshot (&index) < 0) || (replace_journal () < 0)) {
+		journal_index_free (&index);
+
+		flock (journal_fd, LOCK_UN);
+		return -1;
+	}
+
+	journal_index_free (&index);
+
+	/* The processes waiting for the lock will open the new journal. */
+	__atomic_add_fetch (&shared->generation, 1, __ATOMIC_RELEASE);
+
+	flock (journal_fd, LOCK_UN);
+
+	close (journal_fd);
+	journal_fd = -1;
+
+	return 0;
+}
+
+int write_snapshot (journal_index_t *index)
+{
+	journal_record_t records[RECORDS_PER_READ];
+	char path[PATH_MAX + sizeof (TEMPORARY_SUFFIX)];
+	size_t nrecords;
+	size_t i;
+	int fd;
+
+	snprintf (path, sizeof (path), "%s%s", snapshot_path, TEMPORARY_SUFFIX);
+
+	fd = open (path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* The snapshot is a journal with the messages still queued. */
+	nrecords = 0;
+	for (i = 0; i < index->size; i++) {
+		if (!index->entries[i].used) {
+			continue;
+		}
+
+		memset (&records[nrecords], 0, sizeof (journal_record_t));
+
+		records[nrecords].type = JOURNAL_ENQUEUE;
+		records[nrecords].spool = index->entries[i].spool;
+		memcpy (records[nrecords].queue_id, index->entries[i].queue_id, sizeof (records[nrecords].queue_id));
+		records[nrecords].checksum = checksum (&records[nrecords]);
+
+		/* Write full batches... */
+		if ((++nrecords == RECORDS_PER_READ) && (write_records (fd, records, nrecords) < 0)) {
+			close (fd);
+			unlink (path);
+			return -1;
+		}
+
+		nrecords %= RECORDS_PER_READ;
+	}
+
+	/* and the last one. */
+	if ((nrecords > 0) && (write_records (fd, records, nrecords) < 0)) {
+		close (fd);
+		unlink (path);
+		return -1;
+	}
+
+	if ((fsync (fd) < 0) || (close (fd) < 0)) {
+		unlink (path);
+		return -1;
+	}
+
+	if (rename (path, snapshot_path) < 0) {
+		unlink (path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int write_records (int fd, const journal_record_t *records, size_t nrecords)
+{
+	if (write (fd, records, nrecords * sizeof (journal_record_t)) != nrecords * sizeof (journal_record_t)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int replace_journal (void)
+{
+	char path[PATH_MAX + sizeof (TEMPORARY_SUFFIX)];
+	int fd;
+
+	snprintf (path, sizeof (path), "%s%s", journal_path, TEMPORARY_SUFFIX);
+
+	fd = open (path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		return -1;
+	}
+
+	close (fd);
+
+	/* If we crash before the rename, replaying the old journal over the new snapshot gives the same queue. */
+	if (rename (path, journal_path) < 0) {
+		unlink (path);
+		return -1;
+	}
+
+	/* Flush the directory entries. */
+	if ((fd = open (directory_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	fsync (fd);
+	close (fd);
+
+	return 0;
+}
+
+void journal_index_init (journal_index_t *index)
+{
+	index->entries = NULL;
+	index->size = 0;
+	index->used = 0;
+
+	index->generation = 0;
+	index->offset = 0;
+}
+
+void journal_index_free (journal_index_t *index)
+{
+	if (index->entries) {
+		free (index->entries);
+	}
+
+	journal_index_init (index);
+}
+
+int journal_load (journal_index_t *index)
+{
+	int ret;
+
+	if ((!shared) || (lock_journal (LOCK_SH) < 0)) {
+		return -1;
+	}
+
+	ret = load (index);
+
+	flock (journal_fd, LOCK_UN);
+
+	return ret;
+}
+
+int load (journal_index_t *index)
+{
+	off_t offset;
+	int ret;
+	int fd;
+
+	journal_index_free (index);
+
+	index->generation = journal_generation;
+
+	/* First the snapshot... */
+	if ((fd = open (snapshot_path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT) {
+			return -1;
+		}
+	} else {
+		offset = 0;
+		ret = read_records (fd, index, &offset);
+
+		close (fd);
+
+		if (ret < 0) {
+			return -1;
+		}
+	}
+
+	/* then the journal. */
+	return read_records (journal_fd, index, &index->offset);
+}
+
+int journal_update (journal_index_t *index)
+{
+	int ret;
+
+	if ((!shared) || (lock_journal (LOCK_SH) < 0)) {
+		return -1;
+	}
+
+	/* If the journal has been compacted, start over. */
+	if (index->generation != journal_generation) {
+		ret = load (index);
+	} else {
+		ret = read_records (journal_fd, index, &index->offset);
+	}
+
+	flock (journal_fd, LOCK_UN);
+
+	return ret;
+}
+
+int read_records (int fd, journal_index_t *index, off_t *offset)
+{
+	journal_record_t records[RECORDS_PER_READ];
+	ssize_t bytes;
+	size_t nrecords;
+	size_t i;
+
+	do {
+		if ((bytes = pread (fd, records, sizeof (records), *offset)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		nrecords = bytes / sizeof (journal_record_t);
+
+		for (i = 0; i < nrecords; i++) {
+			/* Skip damaged records. */
+			if (records[i].checksum != checksum (&records[i])) {
+				continue;
+			}
+
+			if (apply (index, &records[i]) < 0) {
+				return -1;
+			}
+		}
+
+		/* A partial record (being written) is read next time. */
+		*offset += nrecords * sizeof (journal_record_t);
+
+		if (bytes < sizeof (records)) {
+			return 0;
+		}
+	} while (1);
+}
+
+int apply (journal_index_t *index, const journal_record_t *record)
+{
+	char queue_id[QUEUE_ID_MAXLEN + 1];
+
+	memcpy (queue_id, record->queue_id, QUEUE_ID_MAXLEN);
+	queue_id[QUEUE_ID_MAXLEN] = 0;
+
+	switch (record->type) {
+		case JOURNAL_ENQUEUE:
+			return index_insert (index, record->spool, queue_id);
+		case JOURNAL_DONE:
+			index_remove (index, record->spool, queue_id);
+			return 0;
+		default:
+			/* Claims and results don't change the queue. */
+			return 0;
+	}
+}
+
+size_t hash (int spool, const char *queue_id)
+{
+	uint32_t hash;
+
+	hash = 2166136261u ^ spool;
+	while (*queue_id) {
+		hash ^= (unsigned char) *queue_id++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+int index_insert (journal_index_t *index, int spool, const char *queue_id)
+{
+	journal_entry_t *entry;
+	size_t mask;
+	size_t i;
+
+	/* Keep the load factor under 1/2. */
+	if ((index->used + 1) * 2 > index->size) {
+		if (index_grow (index) < 0) {
+			return -1;
+		}
+	}
+
+	mask = index->size - 1;
+
+	for (i = hash (spool, queue_id) & mask; index->entries[i].used; i = (i + 1) & mask) {
+		entry = &(index->entries[i]);
+		if ((entry->spool == spool) && (strcmp (entry->queue_id, queue_id) == 0)) {
+			/* Already there. */
+			return 0;
+		}
+	}
+
+	entry = &(index->entries[i]);
+
+	snprintf (entry->queue_id, sizeof (entry->queue_id), "%s", queue_id);
+	entry->spool = spool;
+	entry->used = 1;
+
+	index->used++;
+
+	return 0;
+}
+
+void index_remove (journal_index_t *index, int spool, const char *queue_id)
+{
+	journal_entry_t *entry;
+	size_t mask;
+	size_t i, j, k;
+
+	if (index->used == 0) {
+		return;
+	}
+
+	mask = index->size - 1;
+
+	for (i = hash (spool, queue_id) & mask; index->entries[i].used; i = (i + 1) & mask) {
+		entry = &(index->entries[i]);
+		if ((entry->spool == spool) && (strcmp (entry->queue_id, queue_id) == 0)) {
+			break;
+		}
+	}
+
+	if (!index->entries[i].used) {
+		/* Not found. */
+		return;
+	}
+
+	/* Move back the entries of the cluster which would become unreachable. */
+	j = i;
+	do {
+		j = (j + 1) & mask;
+		if (!index->entries[j].used) {
+			break;
+		}
+
+		k = hash (index->entries[j].spool, index->entries[j].queue_id) & mask;
+
+		/* Is the natural position of the entry cyclically in (i, j]? */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) {
+			continue;
+		}
+
+		index->entries[i] = index->entries[j];
+		i = j;
+	} while (1);
+
+	index->entries[i].used = 0;
+	index->used--;
+}
+
+int index_grow (journal_index_t *index)
+{
+	journal_entry_t *entries;
+	journal_entry_t *old_entries;
+	size_t old_size;
+	size_t size;
+	size_t i;
+
+	size = (index->size > 0) ? index->size * 2 : INDEX_MIN_SIZE;
+
+	entries = (journal_entry_t *) calloc (size, sizeof (journal_entry_t));
+	if (!entries) {
+		return -1;
+	}
+
+	old_entries = index->entries;
+	old_size = index->size;
+
+	index->entries = entries;
+	index->size = size;
+	index->used = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old_entries[i].used) {
+			index_insert (index, old_entries[i].spool, old_entries[i].queue_id);
+		}
+	}
+
+	if (old_entries) {
+		free (old_entries);
+	}
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "queue_id.h"
+
+/* Append-only journal of the queue, shared by the receiver, the delivery
+ * workers and the relay process. It lives in the received directory:
+ *   .journal   fixed-size records, appended with O_APPEND under a shared flock().
+ *   .snapshot  the messages still queued when the journal was last compacted
+ *              (as JOURNAL_ENQUEUE records).
+ * Compaction takes the exclusive lock, writes a new snapshot, replaces the
+ * journal by an empty one and bumps a generation number kept in shared
+ * memory, so the other processes reopen it.
+ * The files remain the reference: the journal is an index to find them
+ * without walking the spool directories.
+ * Per-recipient results (JOURNAL_RESULT) cover local delivery only: the relay
+ * process records its messages as claimed and done, it doesn't keep the
+ * outcome of each recipient (a message leaves the relay spool after a single
+ * attempt).
+ */
+
+#define JOURNAL_COMPACT_SIZE (4 * 1024 * 1024) /* bytes. */
+
+/* Record types. */
+#define JOURNAL_ENQUEUE 1 /* The message is in the spool. */
+#define JOURNAL_CLAIM   2 /* A worker has started processing it. */
+#define JOURNAL_RESULT  3 /* Result for one local recipient (ENVELOPE_* state). */
+#define JOURNAL_DONE    4 /* The message has left the spool. */
+
+/* Spools. */
+#define JOURNAL_RECEIVED 0
+#define JOURNAL_RELAY    1
+
+typedef struct {
+	int64_t time;
+	uint32_t checksum;
+	uint32_t recipient;
+	uint8_t type;
+	uint8_t spool;
+	uint8_t state;
+	char queue_id[QUEUE_ID_MAXLEN + 1];
+	char padding[64 - 8 - 4 - 4 - 3 - (QUEUE_ID_MAXLEN + 1)];
+} journal_record_t;
+
+/* Messages in the queue (hash table keyed by spool and queue ID). */
+typedef struct {
+	char queue_id[QUEUE_ID_MAXLEN + 1];
+	uint8_t spool;
+	uint8_t used;
+} journal_entry_t;
+
+typedef struct {
+	journal_entry_t *entries;
+	size_t size; /* Power of 2. */
+	size_t used;
+
+	/* Position in the journal. */
+	unsigned generation;
+	off_t offset;
+} journal_index_t;
+
+/* Before forking. */
+int journal_create (const char *directory);
+void journal_destroy (void);
+
+/* "queue_id" may be followed by the extension of the file name. */
+int journal_append (int type, int spool, const char *queue_id, unsigned recipient, unsigned state);
+int journal_sync (void);
+
+/* Compact the journal if it has grown larger than "size" bytes. */
+int journal_compact (off_t size);
+
+void journal_index_init (journal_index_t *index);
+void journal_index_free (journal_index_t *index);
+
+/* Rebuild the index from the snapshot and the journal. */
+int journal_load (journal_index_t *index);
+
+/* Apply the records appended since the last call. */
+int journal_update (journal_index_t *index);
+
+#endif /* JOURNAL_H */
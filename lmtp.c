@@ -0,0 +1,538 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "lmtp.h"
+#include "buffer.h"
+
+#define HOSTNAME_MAXLEN 64
+
+static struct sockaddr_storage address;
+static socklen_t addrlen = 0;
+
+static char hostname[HOSTNAME_MAXLEN + 1];
+
+/* Connection to the LMTP server. */
+static int sd = -1;
+static char input[LMTP_BUFFER_SIZE];
+static size_t input_offset = 0;
+static size_t input_used = 0;
+
+static int lmtp_connect (void);
+static void lmtp_disconnect (void);
+static int read_reply (void);
+static int write_all (const char *data, size_t len);
+static int send_message (int fd, off_t offset, uint32_t message_flags);
+static int send_dot_stuffed (int fd, off_t offset, off_t size);
+static int transaction (int fd, off_t offset, envelope_t *envelope, uint32_t flags, buffer_t *commands);
+static envelope_recipient_t *next_pending (envelope_t *envelope, uint32_t flags, size_t *domain_index, size_t *recipient_index, envelope_domain_t **domain);
+static int reply_state (int code);
+
+int lmtp_init (const char *server, unsigned short port)
+{
+	struct sockaddr_un *sun;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char service[8];
+
+	memset (&address, 0, sizeof (address));
+
+	if (*server == '/') {
+		/* UNIX socket. */
+		sun = (struct sockaddr_un *) &address;
+		if (strlen (server) >= sizeof (sun->sun_path)) {
+			return -1;
+		}
+
+		sun->sun_family = AF_UNIX;
+		strcpy (sun->sun_path, server);
+
+		addrlen = sizeof (struct sockaddr_un);
+	} else {
+		snprintf (service, sizeof (service), "%u", port);
+
+		memset (&hints, 0, sizeof (hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		if ((getaddrinfo (server, service, &hints, &res) != 0) || (!res)) {
+			return -1;
+		}
+
+		memcpy (&address, res->ai_addr, res->ai_addrlen);
+		addrlen = res->ai_addrlen;
+
+		freeaddrinfo (res);
+	}
+
+	if (gethostname (hostname, sizeof (hostname)) < 0) {
+		strcpy (hostname, "localhost");
+	}
+
+	hostname[HOSTNAME_MAXLEN] = 0;
+
+	return 0;
+}
+
+void lmtp_free (void)
+{
+	if (sd != -1) {
+		write_all ("QUIT\r\n", 6);
+		lmtp_disconnect ();
+	}
+
+	addrlen = 0;
+}
+
+int lmtp_deliver (int fd, off_t offset, envelope_t *envelope, uint32_t flags)
+{
+	buffer_t commands;
+	int reused;
+	int ret;
+
+	if (addrlen == 0) {
+		return -1;
+	}
+
+	buffer_init (&commands, 512);
+
+	/* If the server has closed an idle connection, connect again. */
+	do {
+		reused = (sd != -1);
+
+		if ((!reused) && (lmtp_connect () < 0)) {
+			buffer_free (&commands);
+			return -1;
+		}
+
+		ret = transaction (fd, offset, envelope, flags, &commands);
+		if (ret < 0) {
+			lmtp_disconnect ();
+		}
+	} while ((ret == -2) && (reused));
+
+	buffer_free (&commands);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+int transaction (int fd, off_t offset, envelope_t *envelope, uint32_t flags, buffer_t *commands)
+{
+	/* Return values:
+	 * -2: The connection was closed before the first reply (nothing done).
+	 * -1: Error.
+	 *  0: Every recipient has a state.
+	 */
+
+	envelope_domain_t *domain;
+	envelope_recipient_t *recipient;
+	const char *reverse_path;
+	size_t naccepted;
+	size_t first_domain, first_recipient; /* Cursor at the beginning of the batch. */
+	size_t next_domain, next_recipient; /* Cursor after the batch. */
+	size_t n, k;
+	int last;
+	int mail;
+	int code;
+	size_t i, j;
+
+	mail = -1;
+	naccepted = 0;
+
+	next_domain = 0;
+	next_recipient = 0;
+
+	/* The commands are pipelined, the recipients in batches of LMTP_RCPT_BATCH. */
+	do {
+		buffer_reset (commands);
+
+		/* The first batch starts with "MAIL FROM:" (the null reverse-path is stored with its brackets). */
+		if (mail < 0) {
+			reverse_path = envelope_string (envelope, envelope->header->reverse_path);
+
+			if (((strcmp (reverse_path, "<>") == 0) ? buffer_append_size_bounded_string (commands, "MAIL FROM:<>\r\n", 14) : buffer_format (commands, "MAIL FROM:<%s>\r\n", reverse_path)) < 0) {
+				return -1;
+			}
+		}
+
+		first_domain = next_domain;
+		first_recipient = next_recipient;
+
+		for (n = 0; n < LMTP_RCPT_BATCH; n++) {
+			if ((recipient = next_pending (envelope, flags, &next_domain, &next_recipient, &domain)) == NULL) {
+				break;
+			}
+
+			if (buffer_format (commands, "RCPT TO:<%s@%s>\r\n", envelope_string (envelope, recipient->local_part), envelope_string (envelope, domain->name)) < 0) {
+				return -1;
+			}
+		}
+
+		/* Is there another batch? */
+		i = next_domain;
+		j = next_recipient;
+		last = (next_pending (envelope, flags, &i, &j, &domain) == NULL);
+
+		/* The last one ends with "DATA". */
+		if ((last) && (buffer_append_size_bounded_string (commands, "DATA\r\n", 6) < 0)) {
+			return -1;
+		}
+
+		if (write_all (commands->data, commands->used) < 0) {
+			return (mail < 0) ? -2 : -1;
+		}
+
+		/* Reply to "MAIL FROM:". */
+		if ((mail < 0) && ((mail = read_reply ()) < 0)) {
+			return -2;
+		}
+
+		/* Replies to "RCPT TO:" (one per recipient of the batch, in order). */
+		for (k = 0; k < n; k++) {
+			recipient = next_pending (envelope, flags, &first_domain, &first_recipient, &domain);
+
+			if ((code = read_reply ()) < 0) {
+				return -1;
+			}
+
+			if ((mail / 100 == 2) && (code / 100 == 2)) {
+				/* Accepted: the final state comes after the message. */
+				naccepted++;
+			} else {
+				recipient->state = reply_state ((mail / 100 == 2) ? code : mail);
+			}
+		}
+	} while (!last);
+
+	/* Reply to "DATA". */
+	if ((code = read_reply ()) < 0) {
+		return -1;
+	}
+
+	if (naccepted == 0) {
+		return 0;
+	}
+
+	if (code != 354) {
+		/* Nothing will be delivered. */
+		for (i = 0; i < envelope->header->ndomains; i++) {
+			domain = &(envelope->domains[i]);
+			if (!(domain->flags & flags)) {
+				continue;
+			}
+
+			for (j = 0; j < domain->count; j++) {
+				recipient = &(envelope->recipients[domain->first + j]);
+				if (recipient->state == ENVELOPE_PENDING) {
+					recipient->state = reply_state (code);
+				}
+			}
+		}
+
+		return 0;
+	}
+
+	if (send_message (fd, offset, envelope_flags (envelope)) < 0) {
+		return -1;
+	}
+
+	/* One reply per accepted recipient. */
+	for (i = 0; i < envelope->header->ndomains; i++) {
+		domain = &(envelope->domains[i]);
+		if (!(domain->flags & flags)) {
+			continue;
+		}
+
+		for (j = 0; j < domain->count; j++) {
+			recipient = &(envelope->recipients[domain->first + j]);
+			if (recipient->state != ENVELOPE_PENDING) {
+				continue;
+			}
+
+			if ((code = read_reply ()) < 0) {
+				return -1;
+			}
+
+			recipient->state = reply_state (code);
+		}
+	}
+
+	return 0;
+}
+
+envelope_recipient_t *next_pending (envelope_t *envelope, uint32_t flags, size_t *domain_index, size_t *recipient_index, envelope_domain_t **domain)
+{
+	envelope_recipient_t *recipient;
+
+	/* Pending recipients of the domains having any of "flags", from the cursor on. */
+	for (; *domain_index < envelope->header->ndomains; (*domain_index)++, *recipient_index = 0) {
+		*domain = &(envelope->domains[*domain_index]);
+		if (!((*domain)->flags & flags)) {
+			continue;
+		}
+
+		while (*recipient_index < (*domain)->count) {
+			recipient = &(envelope->recipients[(*domain)->first + (*recipient_index)++]);
+			if (recipient->state == ENVELOPE_PENDING) {
+				return recipient;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+int reply_state (int code)
+{
+	switch (code / 100) {
+		case 2:
+			return ENVELOPE_DELIVERED;
+		case 5:
+			return ENVELOPE_FAILED;
+		default:
+			return ENVELOPE_DEFERRED;
+	}
+}
+
+int lmtp_connect (void)
+{
+	struct timeval timeout;
+	int optval;
+
+	input_offset = 0;
+	input_used = 0;
+
+	if ((sd = socket (address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
+	}
+
+	/* The delivery workers block: don't wait forever. */
+	timeout.tv_sec = LMTP_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+	setsockopt (sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+	if (address.ss_family != AF_UNIX) {
+		/* Disable the Nagle algorithm. */
+		optval = 1;
+		setsockopt (sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof (optval));
+	}
+
+	if (connect (sd, (struct sockaddr *) &address, addrlen) < 0) {
+		lmtp_disconnect ();
+		return -1;
+	}
+
+	/* Greeting. */
+	if (read_reply () / 100 != 2) {
+		lmtp_disconnect ();
+		return -1;
+	}
+
+	snprintf (input, sizeof (input), "LHLO %s\r\n", hostname);
+	if ((write_all (input, strlen (input)) < 0) || (read_reply () / 100 != 2)) {
+		lmtp_disconnect ();
+		return -1;
+	}
+
+	return 0;
+}
+
+void lmtp_disconnect (void)
+{
+	if (sd != -1) {
+		close (sd);
+		sd = -1;
+	}
+
+	input_offset = 0;
+	input_used = 0;
+}
+
+int read_reply (void)
+{
+	/* Returns the reply code (of the last line of a multiline reply) or -1. */
+	char *line;
+	char *end;
+	ssize_t bytes;
+	int code;
+
+	do {
+		/* Complete line in the buffer? */
+		line = input + input_offset;
+		end = memchr (line, '\n', input_used - input_offset);
+		if (!end) {
+			/* Make room and read. */
+			if (input_offset > 0) {
+				memmove (input, line, input_used - input_offset);
+				input_used -= input_offset;
+				input_offset = 0;
+			}
+
+			if (input_used == sizeof (input)) {
+				return -1;
+			}
+
+			bytes = read (sd, input + input_used, sizeof (input) - input_used);
+			if (bytes < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				return -1;
+			} else if (bytes == 0) {
+				return -1;
+			}
+
+			input_used += bytes;
+			continue;
+		}
+
+		input_offset = end + 1 - input;
+
+		if ((end - line < 3) || (line[0] < '1') || (line[0] > '5') || (line[1] < '0') || (line[1] > '9') || (line[2] < '0') || (line[2] > '9')) {
+			return -1;
+		}
+
+		code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+
+		/* "250-..." is followed by more lines. */
+		if ((end - line > 3) && (line[3] == '-')) {
+			continue;
+		}
+
+		return code;
+	} while (1);
+}
+
+int write_all (const char *data, size_t len)
+{
+	ssize_t bytes;
+
+	while (len > 0) {
+		bytes = send (sd, data, len, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		data += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+int send_message (int fd, off_t offset, uint32_t message_flags)
+{
+	struct stat buf;
+	ssize_t bytes;
+	off_t start;
+	char last;
+
+	if (fstat (fd, &buf) < 0) {
+		return -1;
+	}
+
+	start = offset;
+
+	if (message_flags & ENVELOPE_CHUNKED) {
+		/* Received with BDAT: stored as sent, the dots have to be added. */
+		if (send_dot_stuffed (fd, offset, buf.st_size) < 0) {
+			return -1;
+		}
+	} else {
+		/* Received with DATA: stored dot-stuffed, without the final dot. */
+		while (offset < buf.st_size) {
+			bytes = sendfile (sd, fd, &offset, buf.st_size - offset);
+			if (bytes < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				return -1;
+			} else if (bytes == 0) {
+				return -1;
+			}
+		}
+	}
+
+	/* The final dot has to be on a line by itself. */
+	if ((buf.st_size > start) && ((pread (fd, &last, 1, buf.st_size - 1) != 1) || (last != '\n'))) {
+		return write_all ("\r\n.\r\n", 5);
+	}
+
+	return write_all (".\r\n", 3);
+}
+
+int send_dot_stuffed (int fd, off_t offset, off_t size)
+{
+	char data[LMTP_BUFFER_SIZE];
+	const char *ptr;
+	const char *end;
+	const char *start;
+	const char *eol;
+	ssize_t bytes;
+	int bol;
+
+	/* At the beginning of a line? */
+	bol = 1;
+
+	while (offset < size) {
+		bytes = pread (fd, data, ((size - offset) < (off_t) sizeof (data)) ? (size_t) (size - offset) : sizeof (data), offset);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		} else if (bytes == 0) {
+			return -1;
+		}
+
+		offset += bytes;
+
+		ptr = data;
+		end = data + bytes;
+		start = data;
+
+		while (ptr < end) {
+			/* Double the dot starting a line (after CRLF or a bare LF). */
+			if ((bol) && (*ptr == '.')) {
+				if ((write_all (start, ptr - start) < 0) || (write_all (".", 1) < 0)) {
+					return -1;
+				}
+
+				start = ptr;
+			}
+
+			if ((eol = (const char *) memchr (ptr, '\n', end - ptr)) == NULL) {
+				bol = 0;
+				break;
+			}
+
+			ptr = eol + 1;
+			bol = 1;
+		}
+
+		if (write_all (start, end - start) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
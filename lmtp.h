@@ -0,0 +1,33 @@
+#ifndef LMTP_H
+#define LMTP_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "envelope.h"
+#include "constants.h"
+
+/* Local delivery through an LMTP server (RFC 2033).
+ * "server" is either the path of a UNIX socket or a host name / address.
+ * Each delivery worker keeps its own persistent connection; it is opened on
+ * first use and reopened whenever the server has closed it.
+ */
+
+#define LMTP_DEFAULT_PORT 24
+#define LMTP_TIMEOUT      60 /* seconds. */
+#define LMTP_BUFFER_SIZE  4096
+#define LMTP_RCPT_BATCH   MAX_RECIPIENTS /* RCPT commands per write (servers limit pipelining). */
+
+int lmtp_init (const char *server, unsigned short port);
+void lmtp_free (void);
+
+/* Deliver the message of "fd" (starting at "offset") to the pending recipients
+ * of the domains having any of "flags". The MAIL, RCPT and DATA commands are
+ * pipelined (the RCPT commands in batches of LMTP_RCPT_BATCH), the message is sent with sendfile() (dot-stuffed on the way if it
+ * was received with BDAT) and the state of each recipient
+ * is set from its reply (ENVELOPE_DELIVERED, ENVELOPE_FAILED or ENVELOPE_DEFERRED).
+ * Returns -1 if the transaction couldn't be completed (the recipients without a
+ * reply are left pending).
+ */
+int lmtp_deliver (int fd, off_t offset, envelope_t *envelope, uint32_t flags);
+
+#endif /* LMTP_H */
@@ -0,0 +1,396 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "mailbox.h"
+
+#define MAILBOX_BUCKETS (2 * MAILBOX_CACHE_SIZE)
+#define HOSTNAME_MAXLEN 64
+
+typedef struct {
+	char name[DOMAIN_MAXLEN + 1 + LOCAL_PART_MAXLEN + 1]; /* "<domain>/<local part>" */
+	uint32_t hash;
+
+	/* Flat: both are the mailbox directory. */
+	int tmp_fd; /* Where messages are written (Maildir: "tmp"). */
+	int new_fd; /* Where messages are published (Maildir: "new"). */
+
+	int next; /* Next entry in the bucket. */
+
+	/* LRU list. */
+	int lru_prev;
+	int lru_next;
+} mailbox_t;
+
+static int directory_fd = -1;
+static int mailbox_format = MAILBOX_FLAT;
+static char hostname[HOSTNAME_MAXLEN + 1];
+
+static mailbox_t *mailboxes = NULL;
+static int buckets[MAILBOX_BUCKETS];
+static int nmailboxes = 0;
+static int lru_head = -1; /* Most recently used. */
+static int lru_tail = -1; /* Least recently used. */
+
+static mailbox_t *lookup (const char *domain, const char *local_part);
+static int open_mailbox (mailbox_t *mailbox);
+static void close_mailbox (mailbox_t *mailbox);
+static void lru_unlink (int i);
+static void lru_push (int i);
+static void message_names (const char *filename, char *tmpname, char *newname, size_t size);
+
+int mailbox_init (const char *directory, int format)
+{
+	char *ptr;
+	int i;
+
+	directory_fd = open (directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (directory_fd < 0) {
+		return -1;
+	}
+
+	mailboxes = (mailbox_t *) malloc (MAILBOX_CACHE_SIZE * sizeof (mailbox_t));
+	if (!mailboxes) {
+		close (directory_fd);
+		directory_fd = -1;
+
+		return -1;
+	}
+
+	for (i = 0; i < MAILBOX_BUCKETS; i++) {
+		buckets[i] = -1;
+	}
+
+	nmailboxes = 0;
+	lru_head = -1;
+	lru_tail = -1;
+
+	mailbox_format = format;
+
+	/* Maildir names carry the host name ('/' and ':' aren't allowed). */
+	if (gethostname (hostname, sizeof (hostname)) < 0) {
+		strcpy (hostname, "localhost");
+	}
+
+	hostname[HOSTNAME_MAXLEN] = 0;
+
+	for (ptr = hostname; *ptr; ptr++) {
+		if ((*ptr == '/') || (*ptr == ':')) {
+			*ptr = '_';
+		}
+	}
+
+	return 0;
+}
+
+void mailbox_free (void)
+{
+	int i;
+
+	if (mailboxes) {
+		for (i = 0; i < nmailboxes; i++) {
+			close_mailbox (&(mailboxes[i]));
+		}
+
+		free (mailboxes);
+		mailboxes = NULL;
+	}
+
+	nmailboxes = 0;
+	lru_head = -1;
+	lru_tail = -1;
+
+	if (directory_fd != -1) {
+		close (directory_fd);
+		directory_fd = -1;
+	}
+}
+
+int mailbox_create (const char *domain, const char *local_part, const char *filename)
+{
+	mailbox_t *mailbox;
+	char tmpname[NAME_MAX + 1];
+	char newname[NAME_MAX + 1];
+	int retry;
+	int fd;
+
+	message_names (filename, tmpname, newname, sizeof (tmpname));
+
+	/* If the mailbox has been removed or replaced since we opened it, try again. */
+	for (retry = 0; retry < 2; retry++) {
+		if ((mailbox = lookup (domain, local_part)) == NULL) {
+			return -1;
+		}
+
+		fd = openat (mailbox->tmp_fd, tmpname, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if ((fd != -1) || (errno != ENOENT)) {
+			return fd;
+		}
+
+		/* It is reopened by name the next time it is looked up. */
+		close_mailbox (mailbox);
+	}
+
+	return -1;
+}
+
+int mailbox_publish (const char *domain, const char *local_part, const char *filename)
+{
+	mailbox_t *mailbox;
+	char tmpname[NAME_MAX + 1];
+	char newname[NAME_MAX + 1];
+
+	message_names (filename, tmpname, newname, sizeof (tmpname));
+
+	if ((mailbox = lookup (domain, local_part)) == NULL) {
+		return -1;
+	}
+
+	/* A copy delivered before (but not removed from the queue) is replaced. */
+	return renameat (mailbox->tmp_fd, tmpname, mailbox->new_fd, newname);
+}
+
+int mailbox_link (const char *path, const char *domain, const char *local_part, const char *filename)
+{
+	mailbox_t *mailbox;
+	char tmpname[NAME_MAX + 1];
+	char newname[NAME_MAX + 1];
+	int retry;
+
+	message_names (filename, tmpname, newname, sizeof (tmpname));
+
+	for (retry = 0; retry < 2; retry++) {
+		if ((mailbox = lookup (domain, local_part)) == NULL) {
+			return -1;
+		}
+
+		if (linkat (AT_FDCWD, path, mailbox->new_fd, newname, AT_SYMLINK_FOLLOW) == 0) {
+			return 0;
+		}
+
+		/* Delivered before (but not removed from the queue)? */
+		if (errno == EEXIST) {
+			if ((unlinkat (mailbox->new_fd, newname, 0) < 0) || (linkat (AT_FDCWD, path, mailbox->new_fd, newname, AT_SYMLINK_FOLLOW) < 0)) {
+				return -1;
+			}
+
+			return 0;
+		}
+
+		if (errno != ENOENT) {
+			return -1;
+		}
+
+		close_mailbox (mailbox);
+	}
+
+	return -1;
+}
+
+void mailbox_remove (const char *domain, const char *local_part, const char *filename)
+{
+	mailbox_t *mailbox;
+	char tmpname[NAME_MAX + 1];
+	char newname[NAME_MAX + 1];
+
+	message_names (filename, tmpname, newname, sizeof (tmpname));
+
+	if ((mailbox = lookup (domain, local_part)) == NULL) {
+		return;
+	}
+
+	unlinkat (mailbox->tmp_fd, tmpname, 0);
+	unlinkat (mailbox->new_fd, newname, 0);
+}
+
+mailbox_t *lookup (const char *domain, const char *local_part)
+{
+	mailbox_t *mailbox;
+	mailbox_t candidate;
+	char name[sizeof (candidate.name)];
+	const char *ptr;
+	uint32_t hash;
+	int bucket;
+	int *link;
+	int i;
+
+	if (!mailboxes) {
+		return NULL;
+	}
+
+	if (snprintf (name, sizeof (name), "%s/%s", domain, local_part) >= sizeof (name)) {
+		return NULL;
+	}
+
+	/* FNV-1a. */
+	hash = 2166136261u;
+	for (ptr = name; *ptr; ptr++) {
+		hash ^= (unsigned char) *ptr;
+		hash *= 16777619u;
+	}
+
+	bucket = hash % MAILBOX_BUCKETS;
+
+	for (i = buckets[bucket]; i != -1; i = mailboxes[i].next) {
+		if ((mailboxes[i].hash == hash) && (strcmp (mailboxes[i].name, name) == 0)) {
+			mailbox = &(mailboxes[i]);
+
+			/* Closed after an error? */
+			if ((mailbox->tmp_fd == -1) && (open_mailbox (mailbox) < 0)) {
+				return NULL;
+			}
+
+			/* Most recently used. */
+			if (i != lru_head) {
+				lru_unlink (i);
+				lru_push (i);
+			}
+
+			return mailbox;
+		}
+	}
+
+	/* Open the mailbox before giving it an entry. */
+	strcpy (candidate.name, name);
+	candidate.hash = hash;
+
+	if (open_mailbox (&candidate) < 0) {
+		return NULL;
+	}
+
+	/* Take a free entry or the least recently used one. */
+	if (nmailboxes < MAILBOX_CACHE_SIZE) {
+		i = nmailboxes++;
+	} else {
+		i = lru_tail;
+		mailbox = &(mailboxes[i]);
+
+		close_mailbox (mailbox);
+		lru_unlink (i);
+
+		for (link = &buckets[mailbox->hash % MAILBOX_BUCKETS]; *link != i; link = &(mailboxes[*link].next));
+		*link = mailbox->next;
+	}
+
+	mailbox = &(mailboxes[i]);
+	*mailbox = candidate;
+
+	mailbox->next = buckets[bucket];
+	buckets[bucket] = i;
+
+	lru_push (i);
+
+	return mailbox;
+}
+
+int open_mailbox (mailbox_t *mailbox)
+{
+	static const char *subdirectories[] = {"tmp", "new", "cur"};
+	size_t i;
+	int fd;
+
+	mailbox->tmp_fd = -1;
+	mailbox->new_fd = -1;
+
+	if ((fd = openat (directory_fd, mailbox->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	if (mailbox_format == MAILBOX_FLAT) {
+		mailbox->tmp_fd = fd;
+		mailbox->new_fd = fd;
+
+		return 0;
+	}
+
+	/* Maildir: only "tmp" and "new" are kept open. */
+	for (i = 0; i < sizeof (subdirectories) / sizeof (const char *); i++) {
+		if ((mkdirat (fd, subdirectories[i], S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0) && (errno != EEXIST)) {
+			close (fd);
+			return -1;
+		}
+	}
+
+	if (((mailbox->tmp_fd = openat (fd, "tmp", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) || ((mailbox->new_fd = openat (fd, "new", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)) {
+		close (fd);
+		close_mailbox (mailbox);
+		return -1;
+	}
+
+	close (fd);
+
+	return 0;
+}
+
+void close_mailbox (mailbox_t *mailbox)
+{
+	if (mailbox->tmp_fd != -1) {
+		close (mailbox->tmp_fd);
+	}
+
+	if ((mailbox->new_fd != -1) && (mailbox->new_fd != mailbox->tmp_fd)) {
+		close (mailbox->new_fd);
+	}
+
+	mailbox->tmp_fd = -1;
+	mailbox->new_fd = -1;
+}
+
+void lru_unlink (int i)
+{
+	mailbox_t *mailbox;
+
+	mailbox = &(mailboxes[i]);
+
+	if (mailbox->lru_prev != -1) {
+		mailboxes[mailbox->lru_prev].lru_next = mailbox->lru_next;
+	} else {
+		lru_head = mailbox->lru_next;
+	}
+
+	if (mailbox->lru_next != -1) {
+		mailboxes[mailbox->lru_next].lru_prev = mailbox->lru_prev;
+	} else {
+		lru_tail = mailbox->lru_prev;
+	}
+}
+
+void lru_push (int i)
+{
+	mailbox_t *mailbox;
+
+	mailbox = &(mailboxes[i]);
+
+	mailbox->lru_prev = -1;
+	mailbox->lru_next = lru_head;
+
+	if (lru_head != -1) {
+		mailboxes[lru_head].lru_prev = i;
+	} else {
+		lru_tail = i;
+	}
+
+	lru_head = i;
+}
+
+void message_names (const char *filename, char *tmpname, char *newname, size_t size)
+{
+	size_t len;
+
+	if (mailbox_format == MAILBOX_FLAT) {
+		snprintf (tmpname, size, ".%s", filename);
+		snprintf (newname, size, "%s", filename);
+		return;
+	}
+
+	/* Maildir: "<queue ID>.<host>" (the same name in "tmp" and "new"). */
+	for (len = 0; (filename[len]) && (filename[len] != '.'); len++);
+
+	snprintf (newname, size, "%.*s.%s", (int) len, filename, hostname);
+	snprintf (tmpname, size, "%s", newname);
+}
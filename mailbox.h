@@ -0,0 +1,38 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include "constants.h"
+
+/* Local mailboxes ("<domains directory>/<domain>/<local part>").
+ * Messages are written to a temporary name and made visible with a single
+ * renameat(), so mail readers never see partial files:
+ *   Flat:    "<mailbox>/.<queue ID>.eml" -> "<mailbox>/<queue ID>.eml".
+ *   Maildir: "<mailbox>/tmp/<queue ID>.<host>" -> "<mailbox>/new/<queue ID>.<host>"
+ *            ("tmp", "new" and "cur" are created if needed).
+ * The directory file descriptors of the most recently used mailboxes are
+ * cached, so paths are only resolved by the kernel when a mailbox is first used.
+ */
+
+#define MAILBOX_CACHE_SIZE 256 /* Open mailboxes (Maildir: 2 file descriptors each). */
+
+#define MAILBOX_FLAT    0
+#define MAILBOX_MAILDIR 1
+
+int mailbox_init (const char *directory, int format);
+void mailbox_free (void);
+
+/* "filename" is "<queue ID>.eml". */
+
+/* Create the message file under its temporary name. */
+int mailbox_create (const char *domain, const char *local_part, const char *filename);
+
+/* Give the message its final name. */
+int mailbox_publish (const char *domain, const char *local_part, const char *filename);
+
+/* Link the file "path" into the mailbox under the final name. */
+int mailbox_link (const char *path, const char *domain, const char *local_part, const char *filename);
+
+/* Remove the message (both names). */
+void mailbox_remove (const char *domain, const char *local_part, const char *filename);
+
+#endif /* MAILBOX_H */
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -9,14 +10,17 @@
 #include "configuration.h"
 #include "parser.h"
 #include "dnscache.h"
+#include "mailbox.h"
+#include "lmtp.h"
+#include "replies.h"
 
-#define CONFIG_FILE     "SmtpServer.conf"
 #define MIME_TYPES_FILE "mime.conf"
 
 #define MAX_IDLE_TIME   300
 
 static void stop (int nsignal);
 static void handle_alarm (int nsignal);
+static void handle_sighup (int nsignal);
 
 server_t server;
 configuration_t conf;
@@ -34,6 +38,7 @@ int main ()
 	size_t max_recipients;
 	size_t max_message_size;
 	size_t max_transactions;
+	size_t min_free_disk_space;
 	char filename[PATH_MAX + 1];
 	unsigned char *local_part;
 	size_t local_part_len;
@@ -110,6 +115,25 @@ int main ()
 		return -1;
 	}
 
+	/* Compiled image of the domains directory. */
+	server.domains_image = configuration_get_value (&conf, "General", "DomainsImage", NULL);
+	if ((server.domains_image) && (!server.domains_image[0])) {
+		server.domains_image = NULL;
+	}
+
+	/* Reload the domains when a domain or a mailbox is added or removed? */
+	string = configuration_get_value (&conf, "General", "WatchDomainsDirectory", NULL);
+	if (!string) {
+		server.watch_domains = 0;
+	} else if (strcasecmp (string, "Enabled") == 0) {
+		server.watch_domains = 1;
+	} else if (strcasecmp (string, "Disabled") == 0) {
+		server.watch_domains = 0;
+	} else {
+		fprintf (stderr, "WatchDomainsDirectory is neither \"Enabled\" nor \"Disabled\"... taking \"Disabled\".\n");
+		server.watch_domains = 0;
+	}
+
 	/* Get directory where incoming messages will be stored. */
 	server.incoming_directory = configuration_get_value (&conf, "General", "IncomingDirectory", NULL);
 	if ((!server.incoming_directory) || (!server.incoming_directory[0])) {
@@ -302,6 +326,14 @@ int main ()
 		}
 	}
 
+	/* Get the minimum free disk space. */
+	string = configuration_get_value (&conf, "General", "MinFreeDiskSpace", NULL);
+	if (!string) {
+		min_free_disk_space = MIN_FREE_DISK_SPACE;
+	} else {
+		min_free_disk_space = strtoull (string, NULL, 10);
+	}
+
 	/* Get the maximum number of transactions. */
 	string = configuration_get_value (&conf, "General", "MaxTransactions", NULL);
 	if (!string) {
@@ -313,6 +345,130 @@ int main ()
 		}
 	}
 
+	/* Get the size of the in-memory spool. */
+	string = configuration_get_value (&conf, "General", "MemorySpoolSize", NULL);
+	if (!string) {
+		server.memory_spool_size = MEMORY_SPOOL_SIZE;
+	} else {
+		server.memory_spool_size = strtoull (string, NULL, 10);
+	}
+
+	/* Get the maximum size of an in-memory message. */
+	string = configuration_get_value (&conf, "General", "MemorySpoolMessageSize", NULL);
+	if (!string) {
+		server.memory_spool_message_size = MEMORY_SPOOL_MESSAGE_SIZE;
+	} else {
+		server.memory_spool_message_size = strtoull (string, NULL, 10);
+	}
+
+	/* Get the maximum size of a message delivered by the receiver. */
+	string = configuration_get_value (&conf, "General", "DirectDeliverySize", NULL);
+	if (!string) {
+		server.direct_delivery_size = DIRECT_DELIVERY_SIZE;
+	} else {
+		server.direct_delivery_size = strtoull (string, NULL, 10);
+	}
+
+	/* Get the number of delivery workers. */
+	string = configuration_get_value (&conf, "General", "DeliveryWorkers", NULL);
+	if (!string) {
+		server.delivery_workers = DELIVERY_WORKERS;
+	} else {
+		server.delivery_workers = atoi (string);
+		if ((server.delivery_workers < 1) || (server.delivery_workers > MAX_DELIVERY_WORKERS)) {
+			server.delivery_workers = DELIVERY_WORKERS;
+		}
+	}
+
+	/* Single-instance store? */
+	string = configuration_get_value (&conf, "General", "SingleInstanceStore", NULL);
+	if (!string) {
+		server.single_instance_store = 0;
+	} else if (strcasecmp (string, "Enabled") == 0) {
+		server.single_instance_store = 1;
+	} else if (strcasecmp (string, "Disabled") == 0) {
+		server.single_instance_store = 0;
+	} else {
+		fprintf (stderr, "SingleInstanceStore is neither \"Enabled\" nor \"Disabled\"... taking \"Disabled\".\n");
+		server.single_instance_store = 0;
+	}
+
+	/* Mailbox format. */
+	string = configuration_get_value (&conf, "General", "MailboxFormat", NULL);
+	if (!string) {
+		server.mailbox_format = MAILBOX_FLAT;
+	} else if (strcasecmp (string, "Flat") == 0) {
+		server.mailbox_format = MAILBOX_FLAT;
+	} else if (strcasecmp (string, "Maildir") == 0) {
+		server.mailbox_format = MAILBOX_MAILDIR;
+	} else {
+		fprintf (stderr, "MailboxFormat is neither \"Flat\" nor \"Maildir\"... taking \"Flat\".\n");
+		server.mailbox_format = MAILBOX_FLAT;
+	}
+
+	/* LMTP server for the local recipients. */
+	server.lmtp_server = configuration_get_value (&conf, "General", "LmtpServer", NULL);
+
+	string = configuration_get_value (&conf, "General", "LmtpPort", NULL);
+	if (!string) {
+		server.lmtp_port = LMTP_DEFAULT_PORT;
+	} else {
+		server.lmtp_port = (unsigned short) atoi (string);
+		if (server.lmtp_port == 0) {
+			server.lmtp_port = LMTP_DEFAULT_PORT;
+		}
+	}
+
+	/* Queue journal? */
+	string = configuration_get_value (&conf, "General", "QueueJournal", NULL);
+	if (!string) {
+		server.queue_journal = 1;
+	} else if (strcasecmp (string, "Enabled") == 0) {
+		server.queue_journal = 1;
+	} else if (strcasecmp (string, "Disabled") == 0) {
+		server.queue_journal = 0;
+	} else {
+		fprintf (stderr, "QueueJournal is neither \"Enabled\" nor \"Disabled\"... taking \"Enabled\".\n");
+		server.queue_journal = 1;
+	}
+
+	/* Walk the spool directories at start-up? */
+	string = configuration_get_value (&conf, "General", "QueueCheck", NULL);
+	if (!string) {
+		server.queue_check = 0;
+	} else if (strcasecmp (string, "Enabled") == 0) {
+		server.queue_check = 1;
+	} else if (strcasecmp (string, "Disabled") == 0) {
+		server.queue_check = 0;
+	} else {
+		fprintf (stderr, "QueueCheck is neither \"Enabled\" nor \"Disabled\"... taking \"Disabled\".\n");
+		server.queue_check = 0;
+	}
+
+	/* Get the durability mode. */
+	string = configuration_get_value (&conf, "General", "Durability", NULL);
+	if (!string) {
+		server.group_commit = 0;
+	} else if (strcasecmp (string, "None") == 0) {
+		server.group_commit = 0;
+	} else if (strcasecmp (string, "GroupCommit") == 0) {
+		server.group_commit = 1;
+	} else {
+		fprintf (stderr, "Durability is neither \"None\" nor \"GroupCommit\"... taking \"None\".\n");
+		server.group_commit = 0;
+	}
+
+	/* Get the commit latency. */
+	string = configuration_get_value (&conf, "General", "CommitLatency", NULL);
+	if (!string) {
+		server.commit_latency = COMMIT_LATENCY;
+	} else {
+		server.commit_latency = atoi (string);
+		if ((server.commit_latency < 0) || (server.commit_latency > MAX_COMMIT_LATENCY)) {
+			server.commit_latency = COMMIT_LATENCY;
+		}
+	}
+
 	/* Get whether we have to log mails. */
 	string = configuration_get_value (&conf, "General", "LogMails", NULL);
 	if (!string) {
@@ -352,10 +508,20 @@ int main ()
 		return -1;
 	}
 
-	server.nfile = 0;
 	server.max_recipients = max_recipients;
 	server.max_message_size = max_message_size;
 	server.max_transactions = max_transactions;
+	server.min_free_disk_space = min_free_disk_space;
+
+	/* Format the replies naming the server. */
+	if (replies_build () < 0) {
+		delete_server (&server);
+
+		configuration_free (&mime_types);
+		configuration_free (&conf);
+
+		return -1;
+	}
 
 	/* Install signal handlers. */
 	sigemptyset (&act.sa_mask);
@@ -370,6 +536,9 @@ int main ()
 	act.sa_handler = handle_alarm;
 	sigaction (SIGALRM, &act, NULL);
 
+	act.sa_handler = handle_sighup;
+	sigaction (SIGHUP, &act, NULL);
+
 	/* Set alarm every second. */
 	interval.it_interval.tv_sec = 1;
 	interval.it_interval.tv_usec = 0;
@@ -414,3 +583,8 @@ void handle_alarm (int nsignal)
 {
 	server.handle_alarm = 1;
 }
+
+void handle_sighup (int nsignal)
+{
+	server.handle_reload = 1;
+}
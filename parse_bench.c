@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <time.h>
+
+/* The dispatch and the scanners are static: build them in this file. */
+#include "parser.c"
+
+/* Times the recognition of the SMTP verbs (the strncasecmp() binary search
+ * of the previous parser against the case-folded 32-bit words of get_command())
+ * and the address scanners (span_scalar() against span_ssse3()).
+ *
+ * Usage: parse_bench [iterations]
+ */
+
+#define DEFAULT_ITERATIONS 1000000
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x)      (sizeof (x) / sizeof (*x))
+#endif
+
+typedef struct {
+	const char *command;
+	size_t len;
+} old_command_t;
+
+/* Table of the previous parser (sorted, indexed by eSmtpCommand). */
+static const old_command_t old_commands[] = {
+	{"BDAT", 4},
+	{"DATA", 4},
+	{"EHLO", 4},
+	{"EXPN", 4},
+	{"HELO", 4},
+	{"HELP", 4},
+	{"MAIL", 4},
+	{"NOOP", 4},
+	{"QUIT", 4},
+	{"RCPT", 4},
+	{"RSET", 4},
+	{"VRFY", 4}
+};
+
+static const char *lines[] = {
+	"EHLO client.example.org\r\n",
+	"MAIL FROM:<sender@client.example.org> SIZE=12345\r\n",
+	"RCPT TO:<alice@example.com>\r\n",
+	"RCPT TO:<bob@example.com>\r\n",
+	"rcpt to:<carol@example.com>\r\n",
+	"DATA\r\n",
+	"RSET\r\n",
+	"mail from:<>\r\n",
+	"NOOP\r\n",
+	"VRFY postmaster\r\n",
+	"HELP\r\n",
+	"QUIT\r\n"
+};
+
+static const char *addresses[] = {
+	"alice@example.com>",
+	"first.last+tag@mail.example.org>",
+	"a.very.long.local.part.of.an.address@sub.domain.example.com>",
+	"postmaster@localhost>",
+	"x@y.z>"
+};
+
+typedef int (*dispatch_function_t) (const unsigned char *line);
+typedef size_t (*span_function_t) (const unsigned char *ptr, const span_class_t *class);
+
+static int old_dispatch (const unsigned char *line);
+static int new_dispatch (const unsigned char *line);
+static void run_dispatch (const char *name, dispatch_function_t dispatch, unsigned char **copies, size_t iterations);
+static void run_span (const char *name, span_function_t scan, unsigned char **copies, size_t iterations);
+
+static volatile size_t sink;
+
+int main (int argc, char **argv)
+{
+	unsigned char *line_copies[ARRAY_SIZE (lines)];
+	unsigned char *address_copies[ARRAY_SIZE (addresses)];
+	size_t iterations;
+	size_t i;
+
+	iterations = (argc > 1) ? strtoul (argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+	if (iterations == 0) {
+		fprintf (stderr, "Usage: %s [iterations]\n", argv[0]);
+		return -1;
+	}
+
+	/* The parser works on writable copies (padded like the input buffer of a connection). */
+	for (i = 0; i < ARRAY_SIZE (lines); i++) {
+		line_copies[i] = (unsigned char *) calloc (1, TEXT_LINE_MAXLEN + 1);
+		strcpy ((char *) line_copies[i], lines[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE (addresses); i++) {
+		address_copies[i] = (unsigned char *) calloc (1, TEXT_LINE_MAXLEN + 1);
+		strcpy ((char *) address_copies[i], addresses[i]);
+	}
+
+	/* Both dispatches must agree before their timings mean anything. */
+	for (i = 0; i < ARRAY_SIZE (lines); i++) {
+		if (old_dispatch (line_copies[i]) != new_dispatch (line_copies[i])) {
+			fprintf (stderr, "The dispatches disagree on \"%.*s\".\n", (int) strcspn (lines[i], "\r"), lines[i]);
+			return -1;
+		}
+	}
+
+	printf ("%lu iterations over %lu command lines and %lu addresses.\n", (unsigned long) iterations, (unsigned long) ARRAY_SIZE (lines), (unsigned long) ARRAY_SIZE (addresses));
+
+	run_dispatch ("strncasecmp", old_dispatch, line_copies, iterations);
+	run_dispatch ("folded words", new_dispatch, line_copies, iterations);
+
+	run_span ("span_scalar", span_scalar, address_copies, iterations);
+#if HAVE_SSSE3_SPAN
+	if (__builtin_cpu_supports ("ssse3")) {
+		run_span ("span_ssse3", span_ssse3, address_copies, iterations);
+	} else {
+		printf ("%-14s not supported by this CPU.\n", "span_ssse3");
+	}
+#endif
+
+	for (i = 0; i < ARRAY_SIZE (lines); i++) {
+		free (line_copies[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE (addresses); i++) {
+		free (address_copies[i]);
+	}
+
+	return 0;
+}
+
+int old_dispatch (const unsigned char *line)
+{
+	const unsigned char *end;
+	size_t command_len;
+	int i, j, pivot;
+	int ret;
+
+	end = line;
+	while (*end > ' ') {
+		end++;
+	}
+
+	command_len = end - line;
+	if (command_len < 4) {
+		return -1;
+	}
+
+	i = 0;
+	j = ARRAY_SIZE (old_commands) - 1;
+
+	while (i <= j) {
+		pivot = (i + j) / 2;
+		ret = strncasecmp ((const char *) line, old_commands[pivot].command, command_len);
+		if (ret < 0) {
+			j = pivot - 1;
+		} else if ((ret > 0) || (command_len > old_commands[pivot].len)) {
+			i = pivot + 1;
+		} else if (command_len < old_commands[pivot].len) {
+			j = pivot - 1;
+		} else {
+			SKIP_WHITE_SPACES (end);
+
+			if ((pivot == MAIL) && (strncasecmp ((const char *) end, "FROM:", 5) != 0)) {
+				return -1;
+			} else if ((pivot == RCPT) && (strncasecmp ((const char *) end, "TO:", 3) != 0)) {
+				return -1;
+			}
+
+			return pivot;
+		}
+	}
+
+	return -1;
+}
+
+int new_dispatch (const unsigned char *line)
+{
+	const unsigned char *end;
+	int command;
+
+	end = line;
+	while (*end > ' ') {
+		end++;
+	}
+
+	if ((command = get_command (line, end - line)) < 0) {
+		return -1;
+	}
+
+	SKIP_WHITE_SPACES (end);
+
+	if ((command == MAIL) && ((get_word (end) != WORD ('f', 'r', 'o', 'm')) || (end[4] != ':'))) {
+		return -1;
+	} else if ((command == RCPT) && (((get_word (end) & 0xffff) != WORD ('t', 'o', 0, 0)) || (end[2] != ':'))) {
+		return -1;
+	}
+
+	return command;
+}
+
+void run_dispatch (const char *name, dispatch_function_t dispatch, unsigned char **copies, size_t iterations)
+{
+	struct timespec start, end;
+	double elapsed;
+	size_t total;
+	size_t i, j;
+
+	total = 0;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < ARRAY_SIZE (lines); j++) {
+			total += dispatch (copies[j]);
+		}
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	sink = total;
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf ("%-14s %8.1f ns/line\n", name, elapsed * 1e9 / (iterations * ARRAY_SIZE (lines)));
+}
+
+void run_span (const char *name, span_function_t scan, unsigned char **copies, size_t iterations)
+{
+	struct timespec start, end;
+	const unsigned char *at;
+	double elapsed;
+	size_t total;
+	size_t i, j;
+
+	total = 0;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < ARRAY_SIZE (addresses); j++) {
+			/* Local part (atoms), then the domain (sub-domains). */
+			at = copies[j] + scan (copies[j], &atoms);
+			total += scan (at + 1, &sub_domains);
+		}
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	sink = total;
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf ("%-14s %8.1f ns/address\n", name, elapsed * 1e9 / (iterations * ARRAY_SIZE (addresses)));
+}
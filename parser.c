@@ -1,22 +1,69 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "parser.h"
 #include "constants.h"
 
-#ifndef ARRAY_SIZE
-#define ARRAY_SIZE(x)        (sizeof (x) / sizeof (*x))
-#endif
+/* Character classes (RFC 2821 4.1.2). */
+#define CHAR_ALPHA       0x01
+#define CHAR_DIGIT       0x02
+#define CHAR_WHITE_SPACE 0x04
+#define CHAR_ATEXT       0x08
+#define CHAR_TEXT        0x10
+#define CHAR_NO_WS_CTL   0x20
+#define CHAR_QTEXT       0x40
+
+#define ___ 0
+#define CTL (CHAR_TEXT | CHAR_NO_WS_CTL | CHAR_QTEXT)
+#define WSP (CHAR_TEXT | CHAR_WHITE_SPACE)
+#define TXT (CHAR_TEXT)
+#define SPC (CHAR_TEXT | CHAR_QTEXT)
+#define ATX (CHAR_TEXT | CHAR_QTEXT | CHAR_ATEXT)
+#define DIG (CHAR_TEXT | CHAR_QTEXT | CHAR_ATEXT | CHAR_DIGIT)
+#define ALP (CHAR_TEXT | CHAR_QTEXT | CHAR_ATEXT | CHAR_ALPHA)
+
+static const unsigned char char_class[256] = {
+	___, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, WSP, ___, CTL, CTL, ___, CTL, CTL,
+	CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL, CTL,
+	WSP, ATX, TXT, ATX, ATX, ATX, ATX, ATX, SPC, SPC, ATX, ATX, SPC, ATX, SPC, ATX,
+	DIG, DIG, DIG, DIG, DIG, DIG, DIG, DIG, DIG, DIG, SPC, SPC, SPC, ATX, SPC, ATX,
+	SPC, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP,
+	ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, SPC, TXT, SPC, ATX, ATX,
+	ATX, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP,
+	ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ALP, ATX, ATX, ATX, ATX, CTL,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___,
+	___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___, ___
+};
+
+#undef ___
+#undef CTL
+#undef WSP
+#undef TXT
+#undef SPC
+#undef ATX
+#undef DIG
+#undef ALP
 
 #ifndef IS_ALPHA
-#define IS_ALPHA(x)          (((x >= 'A') && (x <= 'Z')) || ((x >= 'a') && (x <= 'z')))
+#define IS_ALPHA(x)          (char_class[(unsigned char) (x)] & CHAR_ALPHA)
 #endif
 
 #ifndef IS_DIGIT
-#define IS_DIGIT(x)          ((x >= '0') && (x <= '9'))
+#define IS_DIGIT(x)          (char_class[(unsigned char) (x)] & CHAR_DIGIT)
+#endif
+
+#ifndef IS_LET_DIG
+#define IS_LET_DIG(x)        (char_class[(unsigned char) (x)] & (CHAR_ALPHA | CHAR_DIGIT))
 #endif
 
 #ifndef IS_WHITE_SPACE
-#define IS_WHITE_SPACE(x)    ((x == ' ') || (x == '\t'))
+#define IS_WHITE_SPACE(x)    (char_class[(unsigned char) (x)] & CHAR_WHITE_SPACE)
 #endif
 
 #ifndef SKIP_WHITE_SPACES
@@ -24,51 +71,75 @@
 #endif
 
 #ifndef IS_ATEXT
-#define IS_ATEXT(x)          ((IS_ALPHA(x)) || (IS_DIGIT(x)) || (x == '!') || \
-                             (x == '#') || (x == '$') || (x == '%') || (x == '&') || \
-                             (x == '\'') || (x == '*') || (x == '+') || (x == '-') || \
-                             (x == '/') || (x == '=') || (x == '?') || (x == '^') || \
-                             (x == '_' ) || (x == '`') || (x == '{') || (x == '|') || \
-                             (x == '}') || (x == '~'))
+#define IS_ATEXT(x)          (char_class[(unsigned char) (x)] & CHAR_ATEXT)
 #endif
 
 #ifndef IS_TEXT
-#define IS_TEXT(x)           (((x >= 1) && (x <= 9)) || (x == 11) || (x == 12) || ((x >= 14) && (x <= 127)))
+#define IS_TEXT(x)           (char_class[(unsigned char) (x)] & CHAR_TEXT)
 #endif
 
 #ifndef IS_NO_WS_CTL
-#define IS_NO_WS_CTL(x)      (((x >= 1) && (x <= 8)) || (x == 11) || (x == 12) || ((x >= 14) && (x <= 31)) || (x == 127))
+#define IS_NO_WS_CTL(x)      (char_class[(unsigned char) (x)] & CHAR_NO_WS_CTL)
 #endif
 
 #ifndef IS_QTEXT
-#define IS_QTEXT(x)          ((IS_NO_WS_CTL(x)) || (x == 33) || ((x >= 35) && (x <= 91)) || ((x >= 93) && (x <= 126)))
+#define IS_QTEXT(x)          (char_class[(unsigned char) (x)] & CHAR_QTEXT)
 #endif
 
+/* Four lowercase letters as returned by get_word(). */
+#define WORD(a, b, c, d)     ((uint32_t) (a) | ((uint32_t) (b) << 8) | ((uint32_t) (c) << 16) | ((uint32_t) (d) << 24))
+
+/* Setting bit 5 of a letter makes it lowercase (and doesn't turn anything
+ * else into a letter).
+ */
+#define FOLD_CASE            0x20202020
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#include <immintrin.h>
+#define HAVE_SSSE3_SPAN 1
+#endif
+
+/* Characters scanned by span(): a class (the bits of char_class and, for the
+ * SSSE3 version, the high nibbles - one bit each, 0 to 7 - present with each
+ * low nibble) and the separators allowed between two of them.
+ */
+typedef struct {
+	unsigned char mask;
+	unsigned char separators[2];
+	unsigned char low_nibbles[16];
+} span_class_t;
+
+/* Dot-string = Atom *("." Atom), Atom = 1*atext */
+static const span_class_t atoms = {
+	CHAR_ATEXT,
+	{'.', '.'},
+	{0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xf8, 0xf8, 0xf4, 0xd4, 0xd0, 0xdc, 0xf0, 0x7c}
+};
 
-static smtp_command_t smtp_commands[] = {
-	{"BDAT", 4},
-	{"DATA", 4},
-	{"EHLO", 4},
-	{"EXPN", 4},
-	{"HELO", 4},
-	{"HELP", 4},
-	{"MAIL", 4},
-	{"NOOP", 4},
-	{"QUIT", 4},
-	{"RCPT", 4},
-	{"RSET", 4},
-	{"VRFY", 4}
+/* sub-domain *("." sub-domain), sub-domain = Let-dig [Ldh-str]
+ * (a '-' must be followed by a Let-dig).
+ */
+static const span_class_t sub_domains = {
+	CHAR_ALPHA | CHAR_DIGIT,
+	{'-', '.'},
+	{0xa8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf0, 0x50, 0x50, 0x50, 0x50, 0x50}
 };
 
-static unsigned char *get_parameter (unsigned char *ptr, const char *param, size_t paramlen, unsigned char **value, size_t *valuelen);
+static size_t span (const unsigned char *ptr, const span_class_t *class);
+static size_t span_scalar (const unsigned char *ptr, const span_class_t *class);
+#if HAVE_SSSE3_SPAN
+static size_t span_ssse3 (const unsigned char *ptr, const span_class_t *class);
+#endif
+static size_t dot_string (const unsigned char *ptr, size_t maxlen);
+static size_t domain_name (const unsigned char *ptr);
+static uint32_t get_word (const unsigned char *ptr);
+static int get_command (const unsigned char *command, size_t len);
+static unsigned char *get_parameter (unsigned char *ptr, uint32_t param, unsigned char **value, size_t *valuelen);
 
 int parse_smtp_command (unsigned char *line, unsigned char **argument, int *error)
 {
-	eSmtpCommand smtp_command;
 	unsigned char *end;
-	size_t command_len;
-	int i, j, pivot;
-	int ret;
+	int smtp_command;
 
 	while (IS_WHITE_SPACE (*line)) {
 		line++;
@@ -79,157 +150,289 @@ int parse_smtp_command (unsigned char *line, unsigned char **argument, int *erro
 		end++;
 	}
 
-	command_len = end - line;
-	if (command_len < 4) {
+	if ((smtp_command = get_command (line, end - line)) < 0) {
 		/* 500 Syntax error, command unrecognized. */
 		*error = 500;
 		return -1;
 	}
 
-	i = 0;
-	j = ARRAY_SIZE (smtp_commands) - 1;
-
-	while (i <= j) {
-		pivot = (i + j) / 2;
-		ret = strncasecmp ((const char *) line, smtp_commands[pivot].command, command_len);
-		if (ret < 0) {
-			j = pivot - 1;
-		} else if (ret == 0) {
-			if (command_len < smtp_commands[pivot].len) {
-				j = pivot - 1;
-			} else if (command_len == smtp_commands[pivot].len) {
-				SKIP_WHITE_SPACES (end);
+	SKIP_WHITE_SPACES (end);
 
-				smtp_command = (eSmtpCommand) pivot;
-				switch (smtp_command) {
-					case BDAT:
-						if (*end == '\r') {
-							/* 501 Syntax error in parameters or arguments. */
-							*error = 501;
-						} else {
-							*argument = end;
-						}
+	/* The line ends with "\r\n": get_word() can read from anywhere before the '\r'. */
+	switch ((eSmtpCommand) smtp_command) {
+		case BDAT:
+			if (*end == '\r') {
+				/* 501 Syntax error in parameters or arguments. */
+				*error = 501;
+			} else {
+				*argument = end;
+			}
 
-						break;
-					case DATA:
-						/* RFC 2821
-						 * http://www.faqs.org/rfcs/rfc2821.html
-						 * 4.1.1 Command Semantics and Syntax.
-						 * Several commands (RSET, DATA, QUIT) are specified as not permitting
-						 * parameters. In the absence of specific extensions offered by the
-						 * server and accepted by the client, clients MUST NOT send such
-						 * parameters and servers SHOULD reject commands containing them as
-						 * having invalid syntax.
-						 */
-						if ((*end != '\r') || (*(end + 1) != '\n')) {
-							/* 501 Syntax error in parameters or arguments. */
-							*error = 501;
-						}
+			break;
+		case DATA:
+			/* RFC 2821
+			 * http://www.faqs.org/rfcs/rfc2821.html
+			 * 4.1.1 Command Semantics and Syntax.
+			 * Several commands (RSET, DATA, QUIT) are specified as not permitting
+			 * parameters. In the absence of specific extensions offered by the
+			 * server and accepted by the client, clients MUST NOT send such
+			 * parameters and servers SHOULD reject commands containing them as
+			 * having invalid syntax.
+			 */
+			if ((*end != '\r') || (*(end + 1) != '\n')) {
+				/* 501 Syntax error in parameters or arguments. */
+				*error = 501;
+			}
 
-						break;
-					case EHLO:
-					case HELO:
-						if (*end == '\r') {
-							/* 501 Syntax error in parameters or arguments. */
-							*error = 501;
-						} else {
-							*argument = end;
-						}
+			break;
+		case EHLO:
+		case HELO:
+			if (*end == '\r') {
+				/* 501 Syntax error in parameters or arguments. */
+				*error = 501;
+			} else {
+				*argument = end;
+			}
 
-						break;
-					case EXPN:
-						if (*end == '\r') {
-							/* 501 Syntax error in parameters or arguments. */
-							*error = 501;
-						} else {
-							*argument = end;
-						}
+			break;
+		case EXPN:
+			if (*end == '\r') {
+				/* 501 Syntax error in parameters or arguments. */
+				*error = 501;
+			} else {
+				*argument = end;
+			}
 
-						break;
-					case HELP:
-						/* If the HELP command has an argument... */
-						if (*end != '\r') {
-							*argument = end;
-						} else {
-							*argument = NULL;
-						}
+			break;
+		case HELP:
+			/* If the HELP command has an argument... */
+			if (*end != '\r') {
+				*argument = end;
+			} else {
+				*argument = NULL;
+			}
 
-						break;
-					case MAIL:
-						if (strncasecmp ((const char *) end, "FROM:", 5) != 0) {
-							/* 500 Syntax error, command unrecognized. */
-							*error = 500;
-						} else {
-							end += 5;
-							SKIP_WHITE_SPACES (end);
-							if (*end == '\r') {
-								/* 501 Syntax error in parameters or arguments. */
-								*error = 501;
-							} else {
-								*argument = end;
-							}
-						}
+			break;
+		case MAIL:
+			if ((*end == '\r') || (get_word (end) != WORD ('f', 'r', 'o', 'm')) || (end[4] != ':')) {
+				/* 500 Syntax error, command unrecognized. */
+				*error = 500;
+			} else {
+				end += 5;
+				SKIP_WHITE_SPACES (end);
+				if (*end == '\r') {
+					/* 501 Syntax error in parameters or arguments. */
+					*error = 501;
+				} else {
+					*argument = end;
+				}
+			}
 
-						break;
-					case NOOP:
-						break;
-					case QUIT:
-						if ((*end != '\r') || (*(end + 1) != '\n')) {
-							/* 501 Syntax error in parameters or arguments. */
-							*error = 501;
-						}
+			break;
+		case NOOP:
+			break;
+		case QUIT:
+			if ((*end != '\r') || (*(end + 1) != '\n')) {
+				/* 501 Syntax error in parameters or arguments. */
+				*error = 501;
+			}
 
-						break;
-					case RCPT:
-						if (strncasecmp ((const char *) end, "TO:", 3) != 0) {
-							/* 500 Syntax error, command unrecognized. */
-							*error = 500;
-						} else {
-							end += 3;
-							SKIP_WHITE_SPACES (end);
-							if (*end == '\r') {
-								/* 501 Syntax error in parameters or arguments. */
-								*error = 501;
-							} else {
-								*argument = end;
-							}
-						}
+			break;
+		case RCPT:
+			if ((*end == '\r') || ((get_word (end) & 0xffff) != WORD ('t', 'o', 0, 0)) || (end[2] != ':')) {
+				/* 500 Syntax error, command unrecognized. */
+				*error = 500;
+			} else {
+				end += 3;
+				SKIP_WHITE_SPACES (end);
+				if (*end == '\r') {
+					/* 501 Syntax error in parameters or arguments. */
+					*error = 501;
+				} else {
+					*argument = end;
+				}
+			}
 
-						break;
-					case RSET:
-						if ((*end != '\r') || (*(end + 1) != '\n')) {
-							/* 501 Syntax error in parameters or arguments. */
-							*error = 501;
-						}
+			break;
+		case RSET:
+			if ((*end != '\r') || (*(end + 1) != '\n')) {
+				/* 501 Syntax error in parameters or arguments. */
+				*error = 501;
+			}
 
-						break;
-					case VRFY:
-						if (*end == '\r') {
-							/* 501 Syntax error in parameters or arguments. */
-							*error = 501;
-						} else {
-							*argument = end;
-						}
+			break;
+		case VRFY:
+			if (*end == '\r') {
+				/* 501 Syntax error in parameters or arguments. */
+				*error = 501;
+			} else {
+				*argument = end;
+			}
 
-						break;
-				}
+			break;
+	}
 
-				return (int) smtp_command;
-			} else {
-				i = pivot + 1;
+	return smtp_command;
+}
+
+size_t span (const unsigned char *ptr, const span_class_t *class)
+{
+	/* Length of the characters of the class, a separator being allowed
+	 * between two of them (0 if the first one is not of the class).
+	 */
+#if HAVE_SSSE3_SPAN
+	if (__builtin_cpu_supports ("ssse3")) {
+		return span_ssse3 (ptr, class);
+	}
+#endif
+
+	return span_scalar (ptr, class);
+}
+
+size_t span_scalar (const unsigned char *ptr, const span_class_t *class)
+{
+	size_t len;
+
+	len = 0;
+	while (char_class[ptr[len]] & class->mask) {
+		len++;
+
+		if ((ptr[len] == class->separators[0]) || (ptr[len] == class->separators[1])) {
+			if (!(char_class[ptr[len + 1]] & class->mask)) {
+				break;
 			}
-		} else {
-			i = pivot + 1;
+
+			len++;
 		}
 	}
 
-	/* 500 Syntax error, command unrecognized. */
-	*error = 500;
+	return len;
+}
+
+#if HAVE_SSSE3_SPAN
+__attribute__ ((target ("ssse3"), no_sanitize_address))
+size_t span_ssse3 (const unsigned char *ptr, const span_class_t *class)
+{
+	static const unsigned char high_nibbles[16] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0};
+	const __m128i *block;
+	__m128i low, high, nibble, separator0, separator1, bytes, in;
+	unsigned int chars, separators, stop, all;
+	unsigned int pending;
+	size_t offset;
+	size_t width;
+	size_t len;
+
+	low = _mm_loadu_si128 ((const __m128i *) class->low_nibbles);
+	high = _mm_loadu_si128 ((const __m128i *) high_nibbles);
+	nibble = _mm_set1_epi8 (0x0f);
+	separator0 = _mm_set1_epi8 ((char) class->separators[0]);
+	separator1 = _mm_set1_epi8 ((char) class->separators[1]);
+
+	/* Aligned loads don't cross a page: the bytes after the end of the string
+	 * (outside the class, as the NUL which ends it) can be read.
+	 */
+	offset = (uintptr_t) ptr & 15;
+	block = (const __m128i *) (ptr - offset);
+	len = 0;
+
+	/* The first character must be of the class, as one after a separator. */
+	pending = 1;
+
+	do {
+		bytes = _mm_load_si128 (block++);
+
+		/* Bit of the high nibble among those allowed with the low nibble (bytes >= 0x80: none). */
+		in = _mm_and_si128 (_mm_shuffle_epi8 (low, _mm_and_si128 (bytes, nibble)), _mm_shuffle_epi8 (high, _mm_and_si128 (_mm_srli_epi16 (bytes, 4), nibble)));
+		chars = (~(unsigned int) _mm_movemask_epi8 (_mm_cmpeq_epi8 (in, _mm_setzero_si128 ()))) & 0xffff;
+		separators = (unsigned int) _mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (bytes, separator0), _mm_cmpeq_epi8 (bytes, separator1)));
+
+		/* The first block starts before "ptr". */
+		chars >>= offset;
+		separators >>= offset;
+		width = 16 - offset;
+		all = 0xffff >> offset;
+
+		if ((pending) && (!(chars & 1))) {
+			return (len) ? len - 1 : 0;
+		}
+
+		/* Stop at the first character neither of the class nor a separator,
+		 * or at the first separator not followed by a character of the class
+		 * (the last one of the block is checked with the next block).
+		 */
+		stop = (~(chars | separators) & all) | (separators & ~(chars >> 1) & (all >> 1));
+		if (stop) {
+			return len + __builtin_ctz (stop);
+		}
+
+		pending = (separators >> (width - 1)) & 1;
+		len += width;
+		offset = 0;
+	} while (1);
+}
+#endif
+
+size_t dot_string (const unsigned char *ptr, size_t maxlen)
+{
+	size_t len;
+
+	len = span (ptr, &atoms);
+
+	return (len <= maxlen) ? len : 0;
+}
+
+size_t domain_name (const unsigned char *ptr)
+{
+	size_t len;
+
+	len = span (ptr, &sub_domains);
+
+	return (len <= DOMAIN_MAXLEN) ? len : 0;
+}
+
+uint32_t get_word (const unsigned char *ptr)
+{
+	/* Little endian (a single load on x86), lowercase. */
+	return ((uint32_t) ptr[0] | ((uint32_t) ptr[1] << 8) | ((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24)) | FOLD_CASE;
+}
+
+int get_command (const unsigned char *command, size_t len)
+{
+	if (len != 4) {
+		return -1;
+	}
 
-	return -1;
+	switch (get_word (command)) {
+		case WORD ('b', 'd', 'a', 't'):
+			return BDAT;
+		case WORD ('d', 'a', 't', 'a'):
+			return DATA;
+		case WORD ('e', 'h', 'l', 'o'):
+			return EHLO;
+		case WORD ('e', 'x', 'p', 'n'):
+			return EXPN;
+		case WORD ('h', 'e', 'l', 'o'):
+			return HELO;
+		case WORD ('h', 'e', 'l', 'p'):
+			return HELP;
+		case WORD ('m', 'a', 'i', 'l'):
+			return MAIL;
+		case WORD ('n', 'o', 'o', 'p'):
+			return NOOP;
+		case WORD ('q', 'u', 'i', 't'):
+			return QUIT;
+		case WORD ('r', 'c', 'p', 't'):
+			return RCPT;
+		case WORD ('r', 's', 'e', 't'):
+			return RSET;
+		case WORD ('v', 'r', 'f', 'y'):
+			return VRFY;
+		default:
+			return -1;
+	}
 }
 
-unsigned char *get_parameter (unsigned char *ptr, const char *param, size_t paramlen, unsigned char **value, size_t *valuelen)
+unsigned char *get_parameter (unsigned char *ptr, uint32_t param, unsigned char **value, size_t *valuelen)
 {
 	do {
 		SKIP_WHITE_SPACES (ptr);
@@ -237,8 +440,9 @@ unsigned char *get_parameter (unsigned char *ptr, const char *param, size_t para
 			break;
 		}
 
-		if ((strncasecmp ((const char *) ptr, param, paramlen) == 0) && (ptr[paramlen] == '=')) {
-			ptr += (paramlen + 1);
+		/* Keywords of 4 letters (before the '\r'). */
+		if ((get_word (ptr) == param) && (ptr[4] == '=')) {
+			ptr += 5;
 			if (*ptr <= ' ') {
 				return NULL;
 			}
@@ -387,38 +591,17 @@ int parse_path (unsigned char *path, unsigned char **local_part, size_t *local_p
 		}
 	} else {
 		/* Local-part = Dot-string */
-		if (!IS_ATEXT (*ptr)) {
+		*local_part = ptr;
+
+		if ((len = dot_string (ptr, LOCAL_PART_MAXLEN)) == 0) {
 			return -1;
 		}
 
-		*local_part = ptr++;
-		len = 1;
-
-		state = 0;
-
-		do {
-			if (state == 0) {
-				if (*ptr == '.') {
-					state = 1;
-				} else if (*ptr == '@') {
-					break;
-				} else if (!IS_ATEXT (*ptr)) {
-					return -1;
-				}
-			} else {
-				if (!IS_ATEXT (*ptr)) {
-					return -1;
-				}
-
-				state = 0;
-			}
+		ptr += len;
 
-			if (++len > LOCAL_PART_MAXLEN) {
-				return -1;
-			}
-
-			ptr++;
-		} while (1);
+		if (*ptr != '@') {
+			return -1;
+		}
 
 		*local_part_len = len;
 	}
@@ -484,55 +667,21 @@ int parse_path (unsigned char *path, unsigned char **local_part, size_t *local_p
 		}
 	} else {
 		/* Domain = (sub-domain 1*("." sub-domain)) */
-		if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
+		*domain = ptr;
+
+		if ((len = domain_name (ptr)) == 0) {
 			return -1;
 		}
 
-		*domain = ptr++;
-		len = 1;
-
-		state = 0;
-
-		do {
-			if (state == 0) {
-				if (*ptr == '-') {
-					state = 1;
-				} else if (*ptr == '.') {
-					state = 2;
-				} else if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					if (quoted) {
-						if (*ptr != last_char) {
-							return -1;
-						}
-
-						break;
-					} else if ((!*ptr) || (IS_WHITE_SPACE (*ptr)) || (*ptr == '\r')) {
-						break;
-					} else {
-						return -1;
-					}
-				}
-			} else if (state == 1) {
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					return -1;
-				}
-
-				state = 0;
-			} else {
-				/* state = 2 */
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					return -1;
-				}
-
-				state = 0;
-			}
+		ptr += len;
 
-			if (++len > DOMAIN_MAXLEN) {
+		if (quoted) {
+			if (*ptr != last_char) {
 				return -1;
 			}
-
-			ptr++;
-		} while (1);
+		} else if ((*ptr) && (!IS_WHITE_SPACE (*ptr)) && (*ptr != '\r')) {
+			return -1;
+		}
 	}
 
 	if (*local_part_len + 1 + len > PATH_MAXLEN) {
@@ -542,7 +691,7 @@ int parse_path (unsigned char *path, unsigned char **local_part, size_t *local_p
 	*domainlen = len;
 
 	if (size_parameter) {
-		if (!get_parameter (ptr, "size", 4, &value, &valuelen)) {
+		if (!get_parameter (ptr, WORD ('s', 'i', 'z', 'e'), &value, &valuelen)) {
 			return -1;
 		}
 
@@ -632,49 +781,15 @@ int parse_domain (const unsigned char *domain, size_t *domainlen)
 		}
 	} else {
 		/* Domain = (sub-domain 1*("." sub-domain)) */
-		if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
+		if ((len = domain_name (ptr)) == 0) {
 			return -1;
 		}
 
-		ptr++;
-		len = 1;
-
-		state = 0;
+		ptr += len;
 
-		do {
-			if (state == 0) {
-				if (*ptr == '-') {
-					state = 1;
-				} else if (*ptr == '.') {
-					state = 2;
-				} else if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					if ((IS_WHITE_SPACE (*ptr)) || (*ptr == '\r')) {
-						break;
-					} else {
-						return -1;
-					}
-				}
-			} else if (state == 1) {
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					return -1;
-				}
-
-				state = 0;
-			} else {
-				/* state = 2 */
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					return -1;
-				}
-
-				state = 0;
-			}
-
-			if (++len > DOMAIN_MAXLEN) {
-				return -1;
-			}
-
-			ptr++;
-		} while (1);
+		if ((!IS_WHITE_SPACE (*ptr)) && (*ptr != '\r')) {
+			return -1;
+		}
 	}
 
 	*domainlen = len;
@@ -706,7 +821,7 @@ int parse_reverse_path (unsigned char *path, unsigned char **local_part, size_t
 		*domainlen = 0;
 
 		if (size_parameter) {
-			if (!get_parameter (path + 2, "size", 4, &value, &valuelen)) {
+			if (!get_parameter (path + 2, WORD ('s', 'i', 'z', 'e'), &value, &valuelen)) {
 				return -1;
 			}
 
@@ -941,7 +1056,7 @@ int parse_forward_path (unsigned char *path, unsigned char **local_part, size_t
 		}
 	} else {
 		/* Domain = (sub-domain 1*("." sub-domain)) */
-		if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
+		if (!IS_LET_DIG (*ptr)) {
 			return -1;
 		}
 
@@ -956,7 +1071,7 @@ int parse_forward_path (unsigned char *path, unsigned char **local_part, size_t
 					state = 1;
 				} else if (*ptr == '.') {
 					state = 2;
-				} else if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
+				} else if (!IS_LET_DIG (*ptr)) {
 					if (quoted) {
 						if (*ptr != last_char) {
 							return -1;
@@ -970,14 +1085,14 @@ int parse_forward_path (unsigned char *path, unsigned char **local_part, size_t
 					}
 				}
 			} else if (state == 1) {
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
+				if (!IS_LET_DIG (*ptr)) {
 					return -1;
 				}
 
 				state = 0;
 			} else {
 				/* state = 2 */
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
+				if (!IS_LET_DIG (*ptr)) {
 					return -1;
 				}
 
@@ -1005,8 +1120,6 @@ int parse_help (const unsigned char *command)
 {
 	const unsigned char *ptr;
 	size_t len;
-	int i, j, pivot;
-	int ret;
 
 	len = 0;
 
@@ -1016,38 +1129,13 @@ int parse_help (const unsigned char *command)
 		ptr++;
 	}
 
-	if (len < 4) {
-		return -1;
-	}
-
 	SKIP_WHITE_SPACES (ptr);
 
 	if ((*ptr != '\r') || (*(ptr + 1) != '\n')) {
 		return -1;
 	}
 
-	i = 0;
-	j = ARRAY_SIZE (smtp_commands) - 1;
-
-	while (i <= j) {
-		pivot = (i + j) / 2;
-		ret = strncasecmp ((const char *) command, smtp_commands[pivot].command, len);
-		if (ret < 0) {
-			j = pivot - 1;
-		} else if (ret == 0) {
-			if (len < smtp_commands[pivot].len) {
-				j = pivot - 1;
-			} else if (len == smtp_commands[pivot].len) {
-				return pivot;
-			} else {
-				i = pivot + 1;
-			}
-		} else {
-			i = pivot + 1;
-		}
-	}
-
-	return -1;
+	return get_command (command, len);
 }
 
 int parse_bdat (const unsigned char *argument, size_t *chunk_size, int *last)
@@ -1077,7 +1165,7 @@ int parse_bdat (const unsigned char *argument, size_t *chunk_size, int *last)
 		return 0;
 	}
 
-	if (strncasecmp ((const char *) ptr, "LAST", 4) != 0) {
+	if ((*ptr == '\r') || (get_word (ptr) != WORD ('l', 'a', 's', 't'))) {
 		return -1;
 	}
 
@@ -1151,94 +1239,27 @@ int valid_domain (const unsigned char *domain)
 		ptr++;
 	} else {
 		/* Domain = (sub-domain 1*("." sub-domain)) */
-		if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
+		if ((len = domain_name (ptr)) == 0) {
 			return -1;
 		}
 
-		ptr++;
-		len = 1;
-
-		state = 0;
-
-		do {
-			if (state == 0) {
-				if (*ptr == '-') {
-					state = 1;
-				} else if (*ptr == '.') {
-					state = 2;
-				} else if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					break;
-				}
-			} else if (state == 1) {
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					return -1;
-				}
-
-				state = 0;
-			} else {
-				/* state = 2 */
-				if ((!IS_ALPHA (*ptr)) && (!IS_DIGIT (*ptr))) {
-					return -1;
-				}
-
-				state = 0;
-			}
-
-			if (++len > DOMAIN_MAXLEN) {
-				return -1;
-			}
-
-			ptr++;
-		} while (1);
+		ptr += len;
 	}
 
 	if (*ptr) {
 		return -1;
 	}
 
-	return 0;
+	return (int) (ptr - domain);
 }
 
 int valid_local_part (const unsigned char *local_part)
 {
-	const unsigned char *ptr;
-	int state;
 	size_t len;
 
-	ptr = local_part;
-
-	if (!IS_ATEXT (*ptr)) {
+	if (((len = dot_string (local_part, LOCAL_PART_MAXLEN)) == 0) || (local_part[len])) {
 		return -1;
 	}
 
-	ptr++;
-	len = 1;
-
-	state = 0;
-
-	do {
-		if (state == 0) {
-			if (*ptr == '.') {
-				state = 1;
-			} else if (!*ptr) {
-				break;
-			} else if (!IS_ATEXT (*ptr)) {
-				return -1;
-			}
-		} else {
-			if (!IS_ATEXT (*ptr)) {
-				return -1;
-			}
-
-			state = 0;
-		}
-
-		if (++len > LOCAL_PART_MAXLEN) {
-			return -1;
-		}
-
-		ptr++;
-	} while (1);
-
-	return 0;
+	return (int) len;
 }
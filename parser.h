@@ -15,11 +15,6 @@ typedef enum {
 	RSET,
 	VRFY} eSmtpCommand;
 
-typedef struct {
-	char *command;
-	size_t len;
-} smtp_command_t;
-
 int parse_smtp_command (unsigned char *line, unsigned char **argument, int *error);
 int parse_path (unsigned char *path, unsigned char **local_part, size_t *local_part_len, unsigned char **domain, size_t *domainlen, int *size_parameter, size_t *size_value);
 int parse_domain (const unsigned char *domain, size_t *domainlen);
@@ -28,6 +23,7 @@ int parse_forward_path (unsigned char *path, unsigned char **local_part, size_t
 int parse_help (const unsigned char *command);
 int parse_bdat (const unsigned char *argument, size_t *chunk_size, int *last);
 
+/* Length of the domain / local part, -1 if it is not valid. */
 int valid_domain (const unsigned char *domain);
 int valid_local_part (const unsigned char *local_part);
 
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "queue_id.h"
+
+static uint32_t nonce = 0;
+static unsigned worker_id = 0;
+static uint64_t sequence = 0;
+
+void queue_id_init (unsigned worker)
+{
+	/* The boot nonce makes the IDs unique across restarts of the same worker. */
+	if (getrandom (&nonce, sizeof (nonce), GRND_NONBLOCK) != sizeof (nonce)) {
+		nonce = (uint32_t) time (NULL) ^ ((uint32_t) getpid () << 16);
+	}
+
+	worker_id = worker;
+	sequence = 0;
+}
+
+void queue_id_generate (char *queue_id, size_t size)
+{
+	uint64_t n;
+
+	n = __atomic_fetch_add (&sequence, 1, __ATOMIC_RELAXED);
+
+	snprintf (queue_id, size, "%08x-%x-%llx", nonce, worker_id, (unsigned long long) n);
+}
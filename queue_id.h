@@ -0,0 +1,12 @@
+#ifndef QUEUE_ID_H
+#define QUEUE_ID_H
+
+#include <stddef.h>
+
+/* <boot nonce>-<worker id>-<sequence> in hexadecimal. */
+#define QUEUE_ID_MAXLEN 40
+
+void queue_id_init (unsigned worker);
+void queue_id_generate (char *queue_id, size_t size);
+
+#endif /* QUEUE_ID_H */
@@ -4,7 +4,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <dirent.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -15,7 +15,8 @@
 #include "server.h"
 #include "configuration.h"
 #include "handle_session.h"
-#include "parser.h"
+#include "envelope.h"
+#include "spool_directory.h"
 
 #define RELAY_EVERY            2 /* seconds. */
 #define MESSAGE_EXTENSION      ".eml"
@@ -37,7 +38,7 @@ static int relay_init (relay_t *relay);
 static void relay_free (relay_t *relay);
 
 static int do_relay (relay_t *relay);
-static int read_pre_header (input_stream_t *input_stream, mail_transaction_t *mail_transaction, off_t *offset);
+static const char *next_message (relay_t *relay);
 static void remove_session (relay_t *relay, int client);
 static int send_messages (relay_t *relay);
 
@@ -67,6 +68,9 @@ void relay_loop (void)
 	act.sa_handler = handle_alarm;
 	sigaction (SIGALRM, &act, NULL);
 
+	act.sa_handler = SIG_IGN;
+	sigaction (SIGHUP, &act, NULL);
+
 	/* Set alarm every second. */
 	interval.it_interval.tv_sec = 1;
 	interval.it_interval.tv_usec = 0;
@@ -152,6 +156,16 @@ int relay_init (relay_t *relay)
 	input_stream->end_of_file = 0;
 	input_stream->error = 0;
 
+	relay->scan.fd = -1;
+	relay->scan.buffer = NULL;
+
+	/* Without a journal, the relay directory is always walked. */
+	relay->check = ((!server.queue_journal) || (server.queue_check));
+
+	journal_index_init (&relay->queue);
+	relay->cursor = 0;
+	relay->remaining = 0;
+
 	/* Get the hard limit of the maximum number of file descriptors. */
 	if (getrlimit (RLIMIT_NOFILE, &rlim) < 0) {
 		perror ("getrlimit");
@@ -253,6 +267,30 @@ int relay_init (relay_t *relay)
 	input_stream->read_ptr = input_stream->buf_base;
 	input_stream->read_end = input_stream->buf_base;
 
+	/* Prepare the scan of the relay directory. */
+	if (spool_scan_init (&relay->scan, server.relay_directory) < 0) {
+		free (input_stream->buf_base);
+		input_stream->buf_base = NULL;
+
+		free (relay->interrupted_sessions);
+		relay->interrupted_sessions = NULL;
+
+		free (relay->sessions);
+		relay->sessions = NULL;
+
+		free (relay->events);
+		relay->events = NULL;
+
+		free (relay->index);
+		relay->index = NULL;
+
+		close (relay->epoll_fd);
+		relay->epoll_fd = -1;
+
+		fprintf (stderr, "Couldn't allocate memory for scanning the relay directory.\n");
+		return -1;
+	}
+
 	/* Initialize sessions. */
 	for (i = 0; i < relay->max_file_descriptors; i++) {
 		session_init (&(relay->sessions[i]));
@@ -314,64 +352,72 @@ void relay_free (relay_t *relay)
 
 	input_stream->end_of_file = 0;
 	input_stream->error = 0;
+
+	spool_scan_free (&relay->scan);
+
+	journal_index_free (&relay->queue);
 }
 
 int do_relay (relay_t *relay)
 {
-	DIR *relay_directory;
-	struct dirent *mail;
+	const char *filename;
+	char name[NAME_MAX + 1];
 	stringlist_t files;
 	size_t nmessages;
 	char oldpath[PATH_MAX + 1];
 	char newpath[PATH_MAX + 1];
-	input_stream_t *input_stream;
-	mail_transaction_t mail_transaction;
-	off_t offset;
+	envelope_t envelope;
+	envelope_domain_t *domain;
+	const char *domain_name;
 	off_t filesize;
-	domainlist_t *forward_paths;
-	domain_t *domain;
-	char *data;
 	off_t index;
 	session_t *session;
 	transaction_list_t *transaction_list;
 	transaction_t *transaction;
 	eDnsStatus status;
 	struct epoll_event ev;
-	size_t len;
 	int fd;
 	int sd;
 	size_t i, j, k;
 	int already_connected;
 
-	/* Open directory where are the messages to relay. */
-	relay_directory = opendir (server.relay_directory);
-	if (!relay_directory) {
-		fprintf (stderr, "Couldn't open relay directory %s.\n", server.relay_directory);
-		return -1;
-	}
-
 	stringlist_init (&files);
 	nmessages = 0;
 
-	/* Build a list of messages to relay. */
-	while (((mail = readdir (relay_directory)) != NULL) && (nmessages < MAX_MESSAGES_PER_BURST)) {
-		if (mail->d_name[0] == '.') {
-			continue;
+	/* Build a list of messages to relay (going on from where the last one stopped). */
+	if (!relay->check) {
+		/* If the journal can't be read, walk the relay directory. */
+		if (journal_update (&relay->queue) < 0) {
+			relay->check = 1;
+		} else {
+			relay->remaining = relay->queue.size;
 		}
+	}
 
-		/* If not a message... */
-		len = strlen (mail->d_name);
-		if ((len < sizeof (MESSAGE_EXTENSION)) || (strcmp (mail->d_name + len - (sizeof (MESSAGE_EXTENSION) - 1), MESSAGE_EXTENSION) != 0)) {
+	if (relay->check) {
+		spool_scan_start (&relay->scan);
+	}
+
+	while ((nmessages < MAX_MESSAGES_PER_BURST) && ((filename = next_message (relay)) != NULL)) {
+		/* Seen twice in the same pass? */
+		if (stringlist_search_string (&files, filename, NULL) >= 0) {
 			continue;
 		}
 
-		snprintf (oldpath, sizeof (oldpath), "%s/%s", server.relay_directory, mail->d_name);
+		spool_directory_path (oldpath, sizeof (oldpath), server.relay_directory, filename);
 		fd = open (oldpath, O_RDONLY);
 		if (fd < 0) {
+			/* Already relayed? */
+			if (errno == ENOENT) {
+				journal_append (JOURNAL_DONE, JOURNAL_RELAY, filename, 0, 0);
+			}
+
 			continue;
 		}
 
-		if (stringlist_insert_string (&files, mail->d_name, fd) < 0) {
+		journal_append (JOURNAL_CLAIM, JOURNAL_RELAY, filename, 0, 0);
+
+		if (stringlist_insert_string (&files, filename, fd) < 0) {
 			close (fd);
 			for (i = 0; i < files.used; i++) {
 				close (files.strings[i].data);
@@ -379,46 +425,35 @@ int do_relay (relay_t *relay)
 
 			stringlist_free (&files);
 
-			closedir (relay_directory);
-
 			return -1;
 		}
 
 		nmessages++;
 	}
 
-	closedir (relay_directory);
-
 	if (!nmessages) {
 		return 0;
 	}
 
-	input_stream = &relay->input_stream;
-
-	mail_transaction_init (&mail_transaction);
-
 	/* Save current time. */
 	server.current_time = time (NULL);
 	gmtime_r (&server.current_time, &server.stm);
 
 	/* For each message to relay... */
 	for (i = 0; i < nmessages; i++) {
-		input_stream->fd = files.strings[i].data;
-		input_stream->read_ptr = input_stream->buf_base;
-		input_stream->read_end = input_stream->buf_base;
-
-		input_stream->end_of_file = 0;
-		input_stream->error = 0;
-
-		if (read_pre_header (&relay->input_stream, &mail_transaction, &offset) < 0) {
-			mail_transaction_free (&mail_transaction);
-			close (relay->input_stream.fd);
+		/* Read the envelope. */
+		if ((envelope_read (&envelope, files.strings[i].data) < 0) || (envelope.header->ndomains == 0)) {
+			envelope_free (&envelope);
+			close (files.strings[i].data);
 
 			/* Move mail to error directory. */
-			snprintf (oldpath, sizeof (oldpath), "%s/%.*s", server.relay_directory, files.strings[i].len, files.data + files.strings[i].string);
-			snprintf (newpath, sizeof (newpath), "%s/%.*s", server.error_directory, files.strings[i].len, files.data + files.strings[i].string);
+			snprintf (name, sizeof (name), "%.*s", (int) files.strings[i].len, files.data + files.strings[i].string);
+			spool_directory_path (oldpath, sizeof (oldpath), server.relay_directory, name);
+			spool_directory_path (newpath, sizeof (newpath), server.error_directory, name);
 			rename (oldpath, newpath);
 
+			journal_append (JOURNAL_DONE, JOURNAL_RELAY, name, 0, ENVELOPE_FAILED);
+
 			/* Mark file as closed. */
 			files.strings[i].data = -1;
 
@@ -426,19 +461,17 @@ int do_relay (relay_t *relay)
 		}
 
 		/* Get filesize. */
-		filesize = lseek (relay->input_stream.fd, 0, SEEK_END);
-
-		forward_paths = &mail_transaction.forward_paths;
-		data = forward_paths->data.data;
+		filesize = lseek (files.strings[i].data, 0, SEEK_END);
 
 		/* For each domain... */
-		for (j = 0; j < forward_paths->used; j++) {
-			domain = &(forward_paths->records[j]);
+		for (j = 0; j < envelope.header->ndomains; j++) {
+			domain = &(envelope.domains[j]);
+			domain_name = envelope_string (&envelope, domain->name);
 
 			/* Resolve DNS. */
-			status = dnscache_lookup (&dnscache, data + domain->domain_name, T_MX, MAX_HOSTS, &index, server.current_time);
+			status = dnscache_lookup (&dnscache, domain_name, T_MX, MAX_HOSTS, &index, server.current_time);
 			if ((status == DNS_HOST_NOT_FOUND) || (status == DNS_NO_DATA)) {
-				status = dnscache_lookup (&dnscache, data + domain->domain_name, T_A, MAX_HOSTS, &index, server.current_time);
+				status = dnscache_lookup (&dnscache, domain_name, T_A, MAX_HOSTS, &index, server.current_time);
 			}
 
 			if (status != DNS_SUCCESS) {
@@ -478,7 +511,7 @@ int do_relay (relay_t *relay)
 				session = &(relay->sessions[sd]);
 
 				/* Save domain. */
-				if (buffer_append_string (&session->domain, data + domain->domain_name) < 0) {
+				if (buffer_append_string (&session->domain, domain_name) < 0) {
 					buffer_free (&session->domain);
 
 					/* Remove connection from epoll descriptor. */
@@ -523,7 +556,7 @@ int do_relay (relay_t *relay)
 			transaction = &(transaction_list->transactions[transaction_list->used]);
 
 			buffer_init (&transaction->reverse_path, 32);
-			if (buffer_append_string (&transaction->reverse_path, mail_transaction.reverse_path) < 0) {
+			if (buffer_append_string (&transaction->reverse_path, envelope_string (&envelope, envelope.header->reverse_path)) < 0) {
 				buffer_free (&transaction->reverse_path);
 				session_free_transactions (session);
 				buffer_free (&session->domain);
@@ -546,8 +579,8 @@ int do_relay (relay_t *relay)
 
 			/* For each forward path... */
 			stringlist_init (&transaction->forward_paths);
-			for (k = 0; k < domain->used; k++) {
-				if (stringlist_insert_string (&transaction->forward_paths, data + domain->local_parts[k], 0) < 0) {
+			for (k = 0; k < domain->count; k++) {
+				if (stringlist_insert_string (&transaction->forward_paths, envelope_string (&envelope, envelope.recipients[domain->first + k].local_part), 0) < 0) {
 					stringlist_free (&transaction->forward_paths);
 					buffer_free (&transaction->reverse_path);
 					session_free_transactions (session);
@@ -571,13 +604,13 @@ int do_relay (relay_t *relay)
 			}
 
 			/* If we couldn't allocate memory... */
-			if (k != domain->used) {
+			if (k != domain->count) {
 				break;
 			}
 
 			transaction->fd = files.strings[i].data;
-			transaction->message_offset = offset;
-			transaction->offset = offset;
+			transaction->message_offset = envelope.header->size;
+			transaction->offset = envelope.header->size;
 			transaction->filesize = filesize;
 
 			transaction_list->used++;
@@ -589,8 +622,8 @@ int do_relay (relay_t *relay)
 			}
 		}
 
-		if (j != forward_paths->used) {
-			mail_transaction_free (&mail_transaction);
+		if (j != envelope.header->ndomains) {
+			envelope_free (&envelope);
 
 			/* Remove sessions.*/
 			for (j = 0; j < relay->nfds;) {
@@ -609,7 +642,7 @@ int do_relay (relay_t *relay)
 			return -1;
 		}
 
-		mail_transaction_free (&mail_transaction);
+		envelope_free (&envelope);
 	}
 
 	if (relay->nfds > 0) {
@@ -623,8 +656,11 @@ int do_relay (relay_t *relay)
 		if (files.strings[i].data != -1) {
 			close (files.strings[i].data);
 
-			snprintf (oldpath, sizeof (oldpath), "%s/%.*s", server.relay_directory, files.strings[i].len, files.data + files.strings[i].string);
+			snprintf (name, sizeof (name), "%.*s", (int) files.strings[i].len, files.data + files.strings[i].string);
+			spool_directory_path (oldpath, sizeof (oldpath), server.relay_directory, name);
 			unlink (oldpath);
+
+			journal_append (JOURNAL_DONE, JOURNAL_RELAY, name, 0, 0);
 		}
 	}
 
@@ -633,82 +669,40 @@ int do_relay (relay_t *relay)
 	return 0;
 }
 
-int read_pre_header (input_stream_t *input_stream, mail_transaction_t *mail_transaction, off_t *offset)
+const char *next_message (relay_t *relay)
 {
-	unsigned char *argument;
-	unsigned char *local_part;
-	size_t local_part_len;
-	unsigned char *domain;
-	size_t domainlen;
-	size_t size;
-
-	char line[TEXT_LINE_MAXLEN + 1];
-	size_t len;
-
-	int error;
-	int ret;
-
-	size = 0;
-	error = 0;
-
-	do {
-		/* Read line. */
-		if ((!input_stream_fgets (input_stream, line, sizeof (line), &len)) || (line[len - 1] != '\n')) {
-			return -1;
-		}
-
-		size += len;
-
-		/* End of pre-header? */
-		if ((len == 1) || ((len == 2) && (line[0] == '\r'))) {
-			/* If there is not reverse-path or no recipients... */
-			if ((!mail_transaction->reverse_path[0]) || (mail_transaction->forward_paths.used == 0)) {
-				return -1;
-			}
-
-			*offset = size;
-
-			return 0;
+	journal_entry_t *entry;
+	const char *filename;
+
+	if (relay->check) {
+		if ((filename = spool_scan_next (&relay->scan)) != NULL) {
+			/* Make sure the journal knows about it. */
+			journal_append (JOURNAL_ENQUEUE, JOURNAL_RELAY, filename, 0, 0);
+			return filename;
 		}
 
-		/* Parse SMTP command. */
-		if (((ret = parse_smtp_command ((unsigned char *) line, &argument, &error)) < 0) || (error != 0)) {
-			return -1;
+		/* With a journal, the relay directory is only walked once. */
+		if (server.queue_journal) {
+			relay->check = 0;
 		}
 
-		if ((eSmtpCommand) ret == MAIL) {
-			/* If there was another "MAIL FROM: <reverse_path>" line... */
-			if (mail_transaction->reverse_path[0]) {
-				return -1;
-			}
+		return NULL;
+	}
 
-			/* Valid reverse path? */
-			if (parse_reverse_path (argument, &local_part, &local_part_len, &domain, &domainlen, NULL, NULL) < 0) {
-				return -1;
-			}
+	/* Go on from where the last burst stopped. */
+	while (relay->remaining > 0) {
+		relay->remaining--;
 
-			/* Null reverse path? */
-			if (!local_part) {
-				memcpy (mail_transaction->reverse_path, "<>", 3);
-			} else {
-				mail_transaction_set_reverse_path (mail_transaction, (const char *) local_part, local_part_len, (const char *) domain, domainlen);
-			}
-		} else if ((eSmtpCommand) ret == RCPT) {
-			/* Valid forward path? */
-			if (parse_forward_path (argument, &local_part, &local_part_len, &domain, &domainlen) < 0) {
-				return -1;
-			}
-
-			local_part[local_part_len] = 0;
-			domain[domainlen] = 0;
+		entry = &(relay->queue.entries[relay->cursor]);
+		relay->cursor = (relay->cursor + 1) & (relay->queue.size - 1);
 
-			if (mail_transaction_add_forward_path (mail_transaction, (const char *) local_part, local_part_len, (const char *) domain, domainlen) < 0) {
-				return -1;
-			}
-		} else {
-			return -1;
+		if ((entry->used) && (entry->spool == JOURNAL_RELAY)) {
+			snprintf (relay->filename, sizeof (relay->filename), "%s%s", entry->queue_id, MESSAGE_EXTENSION);
+			return relay->filename;
 		}
-	} while (1);
+	}
+
+	return NULL;
 }
 
 int connect_to_smtp_server (dnscache_entry_t *dnscache_entry)
@@ -4,6 +4,8 @@
 #include "session.h"
 #include "input_stream.h"
 #include "dnscache.h"
+#include "spool_directory.h"
+#include "journal.h"
 
 typedef struct {
 	int epoll_fd; /* epoll file descriptor. */
@@ -20,6 +22,16 @@ typedef struct {
 	size_t number_interrupted_sessions;
 
 	input_stream_t input_stream;
+
+	int check; /* Walk the relay directory (instead of using the journal)? */
+	spool_scan_t scan;
+
+	/* Messages queued in the journal. */
+	journal_index_t queue;
+	size_t cursor;
+	size_t remaining;
+
+	char filename[QUEUE_ID_MAXLEN + 5]; /* "<queue ID>.eml" */
 } relay_t;
 
 void relay_loop (void);
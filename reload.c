@@ -0,0 +1,413 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include "reload.h"
+#include "server.h"
+#include "configuration.h"
+#include "replies.h"
+
+/* Status written by the child: the tables it has built. */
+#define RELOAD_DOMAINS    0x01
+#define RELOAD_IPS        0x02
+#define RELOAD_BLOCKLISTS 0x04
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+extern server_t server;
+
+static pid_t pid = -1;
+static int domains_fd = -1; /* Memory files written by the child. */
+static int ips_fd = -1;
+static int blocklists_fd = -1;
+static int status = -1; /* -1: not received yet. */
+static int pending = 0; /* Another reload is needed once this one is done. */
+
+static int root_wd = -1; /* Watch of the domains directory. */
+
+static void reload_child (int fd);
+static void apply (void);
+static void done (void);
+static int watch_domain (const char *name);
+
+int reload_init (void)
+{
+	struct epoll_event ev;
+	struct dirent *entry;
+	DIR *domains;
+
+	if (!server.watch_domains) {
+		return 0;
+	}
+
+	if ((server.watch_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	if ((root_wd = inotify_add_watch (server.watch_fd, server.domains_directory, WATCH_MASK)) < 0) {
+		reload_free ();
+		return -1;
+	}
+
+	/* And each domain (the mailboxes). */
+	if ((domains = opendir (server.domains_directory)) == NULL) {
+		reload_free ();
+		return -1;
+	}
+
+	while ((entry = readdir (domains)) != NULL) {
+		if ((entry->d_name[0] == '.') || ((entry->d_type != DT_DIR) && (entry->d_type != DT_UNKNOWN))) {
+			continue;
+		}
+
+		if (watch_domain (entry->d_name) < 0) {
+			fprintf (stderr, "Couldn't watch domain %s (reload with SIGHUP).\n", entry->d_name);
+		}
+	}
+
+	closedir (domains);
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.fd = server.watch_fd;
+	if (epoll_ctl (server.epoll_fd, EPOLL_CTL_ADD, server.watch_fd, &ev) < 0) {
+		reload_free ();
+		return -1;
+	}
+
+	return 0;
+}
+
+void reload_free (void)
+{
+	if (pid != -1) {
+		kill (pid, SIGKILL);
+		waitpid (pid, NULL, 0);
+	}
+
+	done ();
+
+	pending = 0;
+
+	if (server.watch_fd != -1) {
+		close (server.watch_fd);
+		server.watch_fd = -1;
+	}
+
+	root_wd = -1;
+}
+
+int reload_start (void)
+{
+	struct epoll_event ev;
+	int pipefd[2];
+
+	/* Already running? */
+	if (pid != -1) {
+		pending = 1;
+		return 0;
+	}
+
+	pending = 0;
+
+	if ((domains_fd = memfd_create ("domains", MFD_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	if ((ips_fd = memfd_create ("ips", MFD_CLOEXEC)) < 0) {
+		done ();
+		return -1;
+	}
+
+	if ((blocklists_fd = memfd_create ("blocklists", MFD_CLOEXEC)) < 0) {
+		done ();
+		return -1;
+	}
+
+	if (pipe2 (pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		done ();
+		return -1;
+	}
+
+	if ((pid = fork ()) < 0) {
+		pid = -1;
+
+		close (pipefd[0]);
+		close (pipefd[1]);
+
+		done ();
+		return -1;
+	}
+
+	/* If I am the child... */
+	if (pid == 0) {
+		close (pipefd[0]);
+		reload_child (pipefd[1]);
+	}
+
+	close (pipefd[1]);
+	server.reload_fd = pipefd[0];
+	status = -1;
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.fd = server.reload_fd;
+	if (epoll_ctl (server.epoll_fd, EPOLL_CTL_ADD, server.reload_fd, &ev) < 0) {
+		kill (pid, SIGKILL);
+		waitpid (pid, NULL, 0);
+
+		done ();
+		return -1;
+	}
+
+	return 0;
+}
+
+void reload_child (int fd)
+{
+	domainlist_t domainlist;
+	ip_list_t ip_list;
+	blocklist_t blocklist;
+	configuration_t configuration;
+	connection_t *connection;
+	unsigned char result;
+	unsigned i;
+
+	/* Let go of the clients and of the listener: the receiver may close them
+	 * while we are running. Only close the descriptors, the files of the
+	 * messages being received still belong to the receiver.
+	 */
+	for (i = 0; i < server.nfds; i++) {
+		connection = &(server.connections[server.index[i]]);
+
+		close (connection->sd);
+
+		if (connection->spool_file.fd != -1) {
+			close (connection->spool_file.fd);
+		}
+	}
+
+	close (server.listener);
+
+	result = 0;
+
+	domainlist_init (&domainlist);
+	if ((domainlist_load (&domainlist, server.domains_directory) == 0) && (domainlist_write (&domainlist, domains_fd) == 0)) {
+		result |= RELOAD_DOMAINS;
+
+		/* Keep the image up to date for the next start-up. */
+		if ((server.domains_image) && (domainlist_save (&domainlist, server.domains_image) < 0)) {
+			fprintf (stderr, "Couldn't write domains image %s.\n", server.domains_image);
+		}
+	}
+
+	configuration_init (&configuration, 1);
+	if (configuration_load (&configuration, CONFIG_FILE) == 0) {
+		ip_list_init (&ip_list);
+		if ((ip_list_load (&ip_list, &configuration) == 0) && (ip_list_write (&ip_list, ips_fd) == 0)) {
+			result |= RELOAD_IPS;
+		}
+
+		blocklist_init (&blocklist);
+		if ((blocklist_load (&blocklist, &configuration) == 0) && (blocklist_write (&blocklist, blocklists_fd) == 0)) {
+			result |= RELOAD_BLOCKLISTS;
+		}
+	}
+
+	write (fd, &result, 1);
+
+	/* Don't run the receiver's exit handlers nor flush its buffers. */
+	_exit (0);
+}
+
+void reload_finish (void)
+{
+	unsigned char result;
+	ssize_t bytes;
+
+	while ((bytes = read (server.reload_fd, &result, 1)) != 0) {
+		if (bytes == 1) {
+			/* Swap the tables as soon as they are ready. */
+			status = result;
+			apply ();
+		} else if (errno == EAGAIN) {
+			/* Wait for the end of file. */
+			return;
+		} else if (errno != EINTR) {
+			break;
+		}
+	}
+
+	/* End of file: the child has exited (its memory is already released). */
+	if (status < 0) {
+		fprintf (stderr, "Reload of the domains, IPs and blocklists failed.\n");
+	}
+
+	waitpid (pid, NULL, 0);
+
+	done ();
+
+	if (pending) {
+		reload_start ();
+	}
+}
+
+void apply (void)
+{
+	domainlist_t domainlist;
+	ip_list_t ip_list;
+	ip_list_t tmp;
+	blocklist_t blocklist;
+	blocklist_t tmp_blocklist;
+	off_t offset;
+
+	if (status & RELOAD_DOMAINS) {
+		domainlist_init (&domainlist);
+		if (domainlist_map_fd (&domainlist, domains_fd, NULL) == 0) {
+			domainlist_swap (&server.domainlist, &domainlist);
+
+			/* The first domain may have changed. */
+			if (replies_build () < 0) {
+				fprintf (stderr, "Couldn't format the replies.\n");
+			}
+		} else {
+			fprintf (stderr, "Couldn't map the reloaded domains.\n");
+		}
+
+		domainlist_free (&domainlist);
+	} else {
+		fprintf (stderr, "Couldn't reload domains directory %s.\n", server.domains_directory);
+	}
+
+	if (status & RELOAD_IPS) {
+		ip_list_init (&ip_list);
+		offset = 0;
+		if (ip_list_read (&ip_list, ips_fd, &offset) == 0) {
+			tmp = server.ip_list;
+			server.ip_list = ip_list;
+			ip_list = tmp;
+		}
+
+		ip_list_free (&ip_list);
+	} else {
+		fprintf (stderr, "Couldn't reload IP list from %s.\n", CONFIG_FILE);
+	}
+
+	if (status & RELOAD_BLOCKLISTS) {
+		blocklist_init (&blocklist);
+		if (blocklist_read (&blocklist, blocklists_fd) == 0) {
+			tmp_blocklist = server.blocklist;
+			server.blocklist = blocklist;
+			blocklist = tmp_blocklist;
+		}
+
+		blocklist_free (&blocklist);
+	} else {
+		fprintf (stderr, "Couldn't reload blocklists from %s.\n", CONFIG_FILE);
+	}
+}
+
+void done (void)
+{
+	if (server.reload_fd != -1) {
+		epoll_ctl (server.epoll_fd, EPOLL_CTL_DEL, server.reload_fd, NULL);
+
+		close (server.reload_fd);
+		server.reload_fd = -1;
+	}
+
+	if (domains_fd != -1) {
+		close (domains_fd);
+		domains_fd = -1;
+	}
+
+	if (ips_fd != -1) {
+		close (ips_fd);
+		ips_fd = -1;
+	}
+
+	if (blocklists_fd != -1) {
+		close (blocklists_fd);
+		blocklists_fd = -1;
+	}
+
+	pid = -1;
+	status = -1;
+}
+
+void reload_handle_watch (void)
+{
+	char events[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t bytes;
+	char *ptr;
+	int changed;
+
+	changed = 0;
+
+	while ((bytes = read (server.watch_fd, events, sizeof (events))) != 0) {
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		for (ptr = events; ptr < events + bytes; ptr += sizeof (struct inotify_event) + event->len) {
+			event = (const struct inotify_event *) ptr;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				changed = 1;
+				continue;
+			}
+
+			/* Only directories are domains and mailboxes. */
+			if (!(event->mask & (IN_ISDIR | IN_DELETE_SELF))) {
+				continue;
+			}
+
+			changed = 1;
+
+			/* New domain: watch its mailboxes. */
+			if ((event->wd == root_wd) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->len > 0) && (event->name[0] != '.')) {
+				if (watch_domain (event->name) < 0) {
+					fprintf (stderr, "Couldn't watch domain %s (reload with SIGHUP).\n", event->name);
+				}
+			}
+		}
+	}
+
+	if (changed) {
+		if (reload_start () < 0) {
+			fprintf (stderr, "Couldn't start reload of the domains, IPs and blocklists.\n");
+		}
+	}
+}
+
+int watch_domain (const char *name)
+{
+	char path[PATH_MAX + 1];
+
+	if (snprintf (path, sizeof (path), "%s/%s", server.domains_directory, name) >= sizeof (path)) {
+		return -1;
+	}
+
+	/* Not a directory: IN_ONLYDIR makes it fail. */
+	if (inotify_add_watch (server.watch_fd, path, WATCH_MASK) < 0) {
+		return (errno == ENOTDIR) ? 0 : -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+/* Live reload of the domains, of the IPs for relay and of the blocklists
+ * (receiver).
+ * The tables are rebuilt by a child process, which walks the domains directory
+ * and reads the configuration file and the blocklist zones while the receiver
+ * goes on serving the connections. The child writes them into memory files
+ * (the domains as a compiled image) and tells the receiver through a pipe; the
+ * receiver maps them and swaps them for the current ones between two events,
+ * when no lookup is in progress, and frees the old ones.
+ * A reload is started on SIGHUP (e.g. after the zones have been updated) and,
+ * with "WatchDomainsDirectory", whenever a
+ * directory is created or removed in the domains directory or in a domain
+ * (inotify). Changes made while a reload is running start another one when
+ * it is done.
+ */
+
+/* Watch the domains directory (if enabled). */
+int reload_init (void);
+void reload_free (void);
+
+int reload_start (void);
+
+/* server.watch_fd is readable: something has changed. */
+void reload_handle_watch (void);
+
+/* server.reload_fd is readable: the child has finished. */
+void reload_finish (void);
+
+#endif /* RELOAD_H */
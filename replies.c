@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "replies.h"
+#include "server.h"
+#include "reply_codes.h"
+#include "version.h"
+
+#define NUMBER_REPLIES (TOO_MANY_TRANSACTIONS_REPLY + 1)
+
+extern server_t server;
+
+static char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+static char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+
+static buffer_t replies[NUMBER_REPLIES];
+
+static buffer_t received_by;
+static time_t received_time = (time_t) -1; /* -1: to be formatted. */
+
+void replies_init (void)
+{
+	size_t i;
+
+	for (i = 0; i < NUMBER_REPLIES; i++) {
+		buffer_init (&replies[i], 128);
+	}
+
+	buffer_init (&received_by, 128);
+	received_time = (time_t) -1;
+}
+
+void replies_free (void)
+{
+	size_t i;
+
+	for (i = 0; i < NUMBER_REPLIES; i++) {
+		buffer_free (&replies[i]);
+	}
+
+	buffer_free (&received_by);
+	received_time = (time_t) -1;
+}
+
+int replies_build (void)
+{
+	const char *domain;
+	size_t i;
+
+	domain = domainlist_get_first_domain (&server.domainlist);
+
+	for (i = 0; i < NUMBER_REPLIES; i++) {
+		buffer_reset (&replies[i]);
+	}
+
+	if ((buffer_format (&replies[GREETING_REPLY], REPLY_CODE_220, domain, SMTPSERVER_NAME) < 0) || (buffer_format (&replies[EHLO_REPLY], EHLO_RESPONSE, domain, server.max_message_size) < 0) || (buffer_format (&replies[HELO_REPLY], HELO_RESPONSE, domain) < 0) || (buffer_format (&replies[CLOSING_REPLY], REPLY_CODE_221, domain) < 0) || (buffer_format (&replies[TOO_MANY_TRANSACTIONS_REPLY], TOO_MANY_TRANSACTIONS, domain, (unsigned long) server.max_transactions) < 0)) {
+		fprintf (stderr, "[replies_build] Couldn't allocate memory.\n");
+		return -1;
+	}
+
+	/* The Received field names the first domain as well. */
+	received_time = (time_t) -1;
+
+	return 0;
+}
+
+const buffer_t *replies_get (eReply reply)
+{
+	return &replies[reply];
+}
+
+const buffer_t *replies_received_by (time_t now, const struct tm *stm)
+{
+	if (now != received_time) {
+		buffer_reset (&received_by);
+		if (buffer_format (&received_by, "\tBY %s;\r\n\t%s, %d %s %d %02d:%02d:%02d GMT\r\n", domainlist_get_first_domain (&server.domainlist), days[stm->tm_wday], stm->tm_mday, months[stm->tm_mon], 1900 + stm->tm_year, stm->tm_hour, stm->tm_min, stm->tm_sec) < 0) {
+			received_time = (time_t) -1;
+			return NULL;
+		}
+
+		received_time = now;
+	}
+
+	return &received_by;
+}
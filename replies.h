@@ -0,0 +1,33 @@
+#ifndef REPLIES_H
+#define REPLIES_H
+
+#include <time.h>
+#include "buffer.h"
+
+/* Replies which only depend on the configuration and on the domains (they
+ * name the server after the first domain), formatted when these are loaded
+ * instead of for each client.
+ */
+
+typedef enum {
+	GREETING_REPLY, /* 220 */
+	EHLO_REPLY,
+	HELO_REPLY,
+	CLOSING_REPLY,  /* 221 */
+	TOO_MANY_TRANSACTIONS_REPLY /* 450 */
+} eReply;
+
+void replies_init (void);
+void replies_free (void);
+
+/* (Re)format the replies: after loading or reloading the domains. */
+int replies_build (void);
+
+const buffer_t *replies_get (eReply reply);
+
+/* End of the Received field: "\tBY <domain>;\r\n\t<date>\r\n", formatted
+ * again only when the time (seconds) has changed.
+ */
+const buffer_t *replies_received_by (time_t now, const struct tm *stm);
+
+#endif /* REPLIES_H */
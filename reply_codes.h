@@ -10,14 +10,14 @@
 #define RESET_STATE                   "250 2.0.0 Reset state\r\n"
 #define MESSAGE_ACCEPTED_FOR_DELIVERY "250 2.0.0 Message accepted for delivery\r\n"
 
-#define EHLO_RESPONSE                 "250-%s\r\n250-8BITMIME\r\n250-SIZE %lu\r\n250 CHUNKING\r\n"
+#define EHLO_RESPONSE                 "250-%s\r\n250-PIPELINING\r\n250-8BITMIME\r\n250-SIZE %lu\r\n250 CHUNKING\r\n"
 #define HELO_RESPONSE                 "250 %s\r\n"
 
 #define REPLY_CODE_354                "354 Enter mail, end with \".\" on a line by itself\r\n"
 #define REPLY_CODE_421                "421 4.7.0 %s closing connection\r\n"
 
 #define REPLY_CODE_450                "450 Requested mail action not taken: mailbox unavailable\r\n"
-#define TOO_MANY_TRANSACTIONS         "450 4.7.1 Error: too much mail from %s\r\n"
+#define TOO_MANY_TRANSACTIONS         "450 4.7.1 %s Error: too much mail, at most %lu transactions per connection\r\n"
 
 #define REPLY_CODE_451                "451 4.3.2 Please try again later\r\n"
 
@@ -53,4 +53,6 @@
 #define REPLY_CODE_551                "551 5.1.6 User not local; please try %s\r\n"
 #define REPLY_CODE_552                "552 5.2.3 Message size exceeds maximum value\r\n"
 
+#define CLIENT_BLOCKED                "554 5.7.1 Service unavailable; client host blocked\r\n"
+
 #endif /* REPLY_CODES_H */
@@ -8,11 +8,18 @@
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <sys/resource.h>
+#include <time.h>
 #include "server.h"
 #include "handle_connection.h"
 #include "delivery.h"
 #include "switch_to_user.h"
 #include "configuration.h"
+#include "queue_id.h"
+#include "handoff.h"
+#include "journal.h"
+#include "spool_directory.h"
+#include "reload.h"
+#include "replies.h"
 
 #define BACKLOG 200
 
@@ -24,13 +31,18 @@ static int setnonblocking (int fd);
 static int create_connections (server_t *server);
 static int create_connection (server_t *server, int client, struct sockaddr_in *sin);
 static void remove_connection (server_t *server, int client);
+static unsigned long long get_milliseconds (void);
 
 int create_server (server_t *server, unsigned short port)
 {
 	struct epoll_event ev;
+	int sv[2];
+	int ret;
 
 	domainlist_init (&server->domainlist);
 	ip_list_init (&server->ip_list);
+	blocklist_init (&server->blocklist);
+	replies_init ();
 	server->port = port;
 	server->listener = -1;
 	server->epoll_fd = -1;
@@ -41,16 +53,66 @@ int create_server (server_t *server, unsigned short port)
 	server->connections = NULL;
 	server->interrupted_connections = NULL;
 	server->number_interrupted_connections = 0;
+	server->committing_connections = NULL;
+	server->number_committing_connections = 0;
+	server->commit_deadline = 0;
+	server->received_directory_fd = -1;
 	server->current_time = 0;
 	server->handle_alarm = 0;
+	server->handle_reload = 0;
+	server->watch_fd = -1;
+	server->reload_fd = -1;
 	server->log_fd = -1;
+	server->delivery_socket = -1;
 	buffer_init (&server->logbuffer, 512);
 
-	/* Load domain list. */
-	if (domainlist_load (&server->domainlist, server->domains_directory) < 0) {
+	/* Load domain list (from the compiled image if it is up to date). */
+	if ((!server->domains_image) || (domainlist_map (&server->domainlist, server->domains_image, server->domains_directory) < 0)) {
+		if (domainlist_load (&server->domainlist, server->domains_directory) < 0) {
+			domainlist_free (&server->domainlist);
+
+			fprintf (stderr, "Couldn't load host list.\n");
+			return -1;
+		}
+
+		/* Compile it for the next start-up. */
+		if ((server->domains_image) && (domainlist_save (&server->domainlist, server->domains_image) < 0)) {
+			fprintf (stderr, "Couldn't write domains image %s.\n", server->domains_image);
+		}
+	}
+
+	/* Create the ring of messages for the delivery process. */
+	if (handoff_create () < 0) {
+		domainlist_free (&server->domainlist);
+
+		fprintf (stderr, "Couldn't create handoff ring.\n");
+		return -1;
+	}
+
+	/* Open the queue journal (shared by all the processes). */
+	if (server->queue_journal) {
+		if ((ret = journal_create (server->received_directory)) < 0) {
+			handoff_destroy ();
+			domainlist_free (&server->domainlist);
+
+			fprintf (stderr, "Couldn't create queue journal.\n");
+			return -1;
+		}
+
+		/* No journal yet: the queue is in the spool directories. */
+		if (ret == 1) {
+			server->queue_check = 1;
+		}
+	}
+
+	/* Create the socket for handing messages over to the delivery process. */
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		perror ("socketpair");
+
+		journal_destroy ();
+		handoff_destroy ();
 		domainlist_free (&server->domainlist);
 
-		fprintf (stderr, "Couldn't load host list.\n");
 		return -1;
 	}
 
@@ -61,6 +123,11 @@ int create_server (server_t *server, unsigned short port)
 	if ((server->delivery_pid = fork ()) < 0) {
 		perror ("fork");
 
+		close (sv[0]);
+		close (sv[1]);
+
+		journal_destroy ();
+		handoff_destroy ();
 		domainlist_free (&server->domainlist);
 
 		return -1;
@@ -68,23 +135,44 @@ int create_server (server_t *server, unsigned short port)
 
 	/* If I am the delivery process... */
 	if (server->delivery_pid == 0) {
+		close (sv[0]);
+		server->delivery_socket = sv[1];
+
 		server->delivery_pid = getpid ();
 		deliver_loop ();
 	}
 
+	close (sv[1]);
+	server->delivery_socket = sv[0];
+
+	/* Queue IDs generated by the receiver. */
+	queue_id_init (server->receiver_pid);
+
 	/* Load IP list. */
 	if (ip_list_load (&server->ip_list, &conf) < 0) {
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't load IP list.\n");
 		return -1;
 	}
 
+	/* Load the blocklists. */
+	if (blocklist_load (&server->blocklist, &conf) < 0) {
+		blocklist_free (&server->blocklist);
+		ip_list_free (&server->ip_list);
+		domainlist_free (&server->domainlist);
+
+		fprintf (stderr, "Couldn't load blocklists.\n");
+		return -1;
+	}
+
 	if (server->log_mails) {
 		server->log_fd = open (server->logfile,  O_CREAT | O_WRONLY | O_APPEND | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 		if (server->log_fd < 0) {
 			ip_list_free (&server->ip_list);
+			blocklist_free (&server->blocklist);
 			domainlist_free (&server->domainlist);
 
 			fprintf (stderr, "Couldn't open log file.\n");
@@ -100,6 +188,7 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't set the soft limit of the maximum number of file descriptors.\n");
@@ -114,6 +203,7 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't create listener socket on port: %u.\n", server->port);
@@ -132,6 +222,7 @@ int create_server (server_t *server, unsigned short port)
 			}
 
 			ip_list_free (&server->ip_list);
+			blocklist_free (&server->blocklist);
 			domainlist_free (&server->domainlist);
 
 			fprintf (stderr, "A user must be defined when running as root.\n");
@@ -148,12 +239,30 @@ int create_server (server_t *server, unsigned short port)
 			}
 
 			ip_list_free (&server->ip_list);
+			blocklist_free (&server->blocklist);
 			domainlist_free (&server->domainlist);
 
 			return -1;
 		}
 	}
 
+	/* Create the shards of the spool directories (as the mail user). */
+	if ((spool_directory_create (server->incoming_directory) < 0) || (spool_directory_create (server->received_directory) < 0) || (spool_directory_create (server->relay_directory) < 0) || (spool_directory_create (server->error_directory) < 0)) {
+		close (server->listener);
+		server->listener = -1;
+
+		if (server->log_fd != -1) {
+			close (server->log_fd);
+			server->log_fd = -1;
+		}
+
+		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
+		domainlist_free (&server->domainlist);
+
+		return -1;
+	}
+
 	/* Open epoll file descriptor. */
 	if ((server->epoll_fd = epoll_create (server->max_file_descriptors)) < 0) {
 		perror ("epoll_create");
@@ -167,6 +276,7 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		return -1;
@@ -191,6 +301,7 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		return -1;
@@ -211,6 +322,7 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't allocate memory for index.\n");
@@ -235,6 +347,7 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't allocate memory for epoll events.\n");
@@ -262,6 +375,7 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't allocate memory for connections.\n");
@@ -292,13 +406,95 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't allocate memory for interrupted connections.\n");
 		return -1;
 	}
 
+	/* Allocate memory for committing connections. */
+	server->committing_connections = (connection_t **) malloc (server->max_file_descriptors * sizeof (connection_t *));
+	if (!server->committing_connections) {
+		free (server->interrupted_connections);
+		server->interrupted_connections = NULL;
+
+		free (server->connections);
+		server->connections = NULL;
+
+		free (server->events);
+		server->events = NULL;
+
+		free (server->index);
+		server->index = NULL;
+
+		close (server->epoll_fd);
+		server->epoll_fd = -1;
+
+		close (server->listener);
+		server->listener = -1;
+
+		if (server->log_fd != -1) {
+			close (server->log_fd);
+			server->log_fd = -1;
+		}
+
+		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
+		domainlist_free (&server->domainlist);
+
+		fprintf (stderr, "Couldn't allocate memory for committing connections.\n");
+		return -1;
+	}
+
+	/* Open the received directory (for flushing it to disk). */
+	if (server->group_commit) {
+		server->received_directory_fd = open (server->received_directory, O_RDONLY | O_DIRECTORY);
+		if (server->received_directory_fd < 0) {
+			free (server->committing_connections);
+			server->committing_connections = NULL;
+
+			free (server->interrupted_connections);
+			server->interrupted_connections = NULL;
+
+			free (server->connections);
+			server->connections = NULL;
+
+			free (server->events);
+			server->events = NULL;
+
+			free (server->index);
+			server->index = NULL;
+
+			close (server->epoll_fd);
+			server->epoll_fd = -1;
+
+			close (server->listener);
+			server->listener = -1;
+
+			if (server->log_fd != -1) {
+				close (server->log_fd);
+				server->log_fd = -1;
+			}
+
+			ip_list_free (&server->ip_list);
+			blocklist_free (&server->blocklist);
+			domainlist_free (&server->domainlist);
+
+			fprintf (stderr, "Couldn't open received directory %s.\n", server->received_directory);
+			return -1;
+		}
+	}
+
 	if (create_connections (server) < 0) {
+		if (server->received_directory_fd != -1) {
+			close (server->received_directory_fd);
+			server->received_directory_fd = -1;
+		}
+
+		free (server->committing_connections);
+		server->committing_connections = NULL;
+
 		free (server->interrupted_connections);
 		server->interrupted_connections = NULL;
 
@@ -323,12 +519,18 @@ int create_server (server_t *server, unsigned short port)
 		}
 
 		ip_list_free (&server->ip_list);
+		blocklist_free (&server->blocklist);
 		domainlist_free (&server->domainlist);
 
 		fprintf (stderr, "Couldn't allocate memory for connections.\n");
 		return -1;
 	}
 
+	/* Watch the domains directory (SIGHUP works anyway). */
+	if (reload_init () < 0) {
+		fprintf (stderr, "Couldn't watch domains directory %s (reload with SIGHUP).\n", server->domains_directory);
+	}
+
 	return 0;
 }
 
@@ -343,8 +545,14 @@ int delete_server (server_t *server)
 		}
 	}
 
+	reload_free ();
+
 	domainlist_free (&server->domainlist);
 	ip_list_free (&server->ip_list);
+	blocklist_free (&server->blocklist);
+	replies_free ();
+
+	deliver_direct_free ();
 
 	if (server->log_fd != -1) {
 		close (server->log_fd);
@@ -389,6 +597,26 @@ int delete_server (server_t *server)
 
 	server->number_interrupted_connections = 0;
 
+	if (server->committing_connections) {
+		free (server->committing_connections);
+		server->committing_connections = NULL;
+	}
+
+	server->number_committing_connections = 0;
+
+	if (server->received_directory_fd != -1) {
+		close (server->received_directory_fd);
+		server->received_directory_fd = -1;
+	}
+
+	if (server->delivery_socket != -1) {
+		close (server->delivery_socket);
+		server->delivery_socket = -1;
+	}
+
+	journal_destroy ();
+	handoff_destroy ();
+
 	server->current_time = 0;
 	server->handle_alarm = 0;
 
@@ -411,6 +639,8 @@ void start_server (server_t *server)
 	time_t now;
 	connection_t **interrupted_connections;
 	connection_t *connection;
+	unsigned long long now_ms;
+	int timeout;
 	int i;
 
 #if DEBUG
@@ -464,7 +694,25 @@ void start_server (server_t *server)
 			server->handle_alarm = 0;
 		}
 
-		nfds = epoll_wait (epoll_fd, events, maxevents, -1);
+		/* Rebuild the domains, the IPs for relay and the blocklists in the background. */
+		if (server->handle_reload) {
+			server->handle_reload = 0;
+
+			if (reload_start () < 0) {
+				fprintf (stderr, "Couldn't start reload of the domains, IPs and blocklists.\n");
+			}
+		}
+
+		/* If there are messages waiting to be committed... */
+		if (server->number_committing_connections > 0) {
+			/* wait for more messages, but not longer than the commit latency. */
+			now_ms = get_milliseconds ();
+			timeout = (now_ms < server->commit_deadline) ? (int) (server->commit_deadline - now_ms) : 0;
+		} else {
+			timeout = -1;
+		}
+
+		nfds = epoll_wait (epoll_fd, events, maxevents, timeout);
 
 		/* For each event... */
 		for (i = 0; i < nfds; i++) {
@@ -487,6 +735,10 @@ void start_server (server_t *server)
 					close (client);
 					break;
 				}
+			} else if (events[i].data.fd == server->watch_fd) {
+				reload_handle_watch ();
+			} else if (events[i].data.fd == server->reload_fd) {
+				reload_finish ();
 			} else {
 				if (handle_connection (&(server->connections[events[i].data.fd]), &(events[i])) < 0) {
 					remove_connection (server, events[i].data.fd);
@@ -494,6 +746,19 @@ void start_server (server_t *server)
 			}
 		}
 
+		/* Commit messages. */
+		if (server->number_committing_connections > 0) {
+			now_ms = get_milliseconds ();
+			if (server->commit_deadline == 0) {
+				server->commit_deadline = now_ms + server->commit_latency;
+			}
+
+			if (now_ms >= server->commit_deadline) {
+				commit_messages ();
+				server->commit_deadline = 0;
+			}
+		}
+
 		/* Handle interrupted connections. */
 		i = 0;
 		while (i < server->number_interrupted_connections) {
@@ -684,6 +949,7 @@ void remove_connection (server_t *server, int client)
 	struct epoll_event ev;
 	connection_t *connection;
 	int index;
+	size_t i;
 
 	/* Remove connection from epoll descriptor. */
 	ev.events = 0;
@@ -693,6 +959,16 @@ void remove_connection (server_t *server, int client)
 
 	connection = &(server->connections[client]);
 
+	/* If the connection is waiting for its message to be committed... */
+	if (connection->state == COMMITTING_STATE) {
+		for (i = 0; i < server->number_committing_connections; i++) {
+			if (server->committing_connections[i] == connection) {
+				server->committing_connections[i] = server->committing_connections[--server->number_committing_connections];
+				break;
+			}
+		}
+	}
+
 	/* Save position of connection in index array. */
 	index = connection->index;
 
@@ -711,3 +987,12 @@ void remove_connection (server_t *server, int client)
 	fprintf (stdout, "# connections: %d.\n", server->nfds);
 #endif
 }
+
+unsigned long long get_milliseconds (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
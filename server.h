@@ -4,10 +4,12 @@
 #include "connection.h"
 #include "domainlist.h"
 #include "ip_list.h"
+#include "blocklist.h"
 
 typedef struct {
 	domainlist_t domainlist;
 	ip_list_t ip_list; /* List of IPs that can do relay. */
+	blocklist_t blocklist; /* Clients refused at connection time. */
 
 	int port; /* Port to bind to. */
 	int listener; /* Listener socket. */
@@ -26,25 +28,44 @@ typedef struct {
 	connection_t **interrupted_connections;
 	size_t number_interrupted_connections;
 
+	/* Connections waiting for their messages to be committed. */
+	connection_t **committing_connections;
+	size_t number_committing_connections;
+	unsigned long long commit_deadline; /* Milliseconds (monotonic clock). */
+
 	time_t current_time;
 	struct tm stm;
 	struct tm local_time;
 
-	size_t nfile;
-
 	int handle_alarm;
+	int handle_reload; /* SIGHUP received. */
 
 	time_t max_idle_time;
 
 	const char *domains_directory;
+	const char *domains_image; /* Compiled image of the domains directory (NULL: none). */
+	int watch_domains; /* Reload the domains when they change (inotify)? */
+	int watch_fd; /* inotify file descriptor. */
+	int reload_fd; /* Pipe from the reload process. */
 	const char *incoming_directory;
 	const char *received_directory;
 	const char *relay_directory;
 	const char *error_directory;
 
+	int received_directory_fd;
+
+	int group_commit; /* Flush messages to disk before accepting them? */
+	int commit_latency; /* Milliseconds. */
+
 	size_t max_recipients;
 	size_t max_message_size;
 	size_t max_transactions;
+	size_t min_free_disk_space;
+
+	size_t memory_spool_size; /* Memory for in-memory messages (all the connections). */
+	size_t memory_spool_message_size; /* Largest in-memory message (0: disabled). */
+
+	size_t direct_delivery_size; /* Largest message delivered by the receiver (0: disabled). */
 
 	int log_mails;
 	const char *logfile;
@@ -60,6 +81,15 @@ typedef struct {
 		size_t domainlen;
 	} postmaster;
 
+	int delivery_socket; /* Hands in-memory messages over to the delivery process. */
+	unsigned delivery_workers; /* # of delivery processes. */
+	int single_instance_store; /* Hardlink one copy of the message into the mailboxes? */
+	int mailbox_format; /* MAILBOX_FLAT or MAILBOX_MAILDIR. */
+	const char *lmtp_server; /* Deliver the local recipients through LMTP (NULL: to the mailboxes). */
+	unsigned short lmtp_port;
+	int queue_journal; /* Keep an append-only journal of the queue? */
+	int queue_check; /* Walk the spool directories at start-up? */
+
 	pid_t receiver_pid;
 	pid_t delivery_pid;
 	pid_t relay_pid;
@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "spool.h"
+#include "server.h"
+#include "handoff.h"
+#include "spool_directory.h"
+#include "journal.h"
+
+#define MESSAGE_EXTENSION ".eml"
+
+/* Room for the envelope and the Received field. */
+#define PREALLOCATION_SLACK (8 * 1024)
+
+extern server_t server;
+
+static int tmpfile_supported = 1;
+
+/* Free space budget of the filesystem of the received directory. */
+static size_t available_space = 0;
+static size_t reserved_space = 0;
+static time_t statvfs_time = 0;
+
+/* Memory used by in-memory files (being received or handed over). */
+static size_t memory_used = 0;
+
+static int open_on_disk (spool_file_t *spool_file);
+static int link_on_disk (spool_file_t *spool_file);
+static void enqueue (spool_file_t *spool_file);
+static int publish_on_disk (spool_file_t *spool_file);
+static int hand_over (spool_file_t *spool_file);
+static int spill (spool_file_t *spool_file);
+static void release_space (spool_file_t *spool_file);
+
+void spool_file_init (spool_file_t *spool_file)
+{
+	spool_file->fd = -1;
+	spool_file->anonymous = 0;
+	spool_file->in_memory = 0;
+	spool_file->preallocated = 0;
+	spool_file->reserved = 0;
+	spool_file->queue_id[0] = 0;
+}
+
+int spool_file_open (spool_file_t *spool_file, size_t size)
+{
+	queue_id_generate (spool_file->queue_id, sizeof (spool_file->queue_id));
+
+	/* Keep small messages in memory, unless they have to be flushed to disk. */
+	if ((server.memory_spool_message_size > 0) && (!server.group_commit) && (size <= server.memory_spool_message_size)) {
+		/* Out of memory? Take back the memory of the messages delivered since. */
+		if (memory_used + server.memory_spool_message_size > server.memory_spool_size) {
+			memory_used -= (size_t) handoff_released () * server.memory_spool_message_size;
+		}
+
+		if (memory_used + server.memory_spool_message_size <= server.memory_spool_size) {
+			spool_file->fd = memfd_create (spool_file->queue_id, MFD_CLOEXEC);
+			if (spool_file->fd != -1) {
+				spool_file->anonymous = 1;
+				spool_file->in_memory = 1;
+				memory_used += server.memory_spool_message_size;
+
+				return 0;
+			}
+		}
+	}
+
+	return open_on_disk (spool_file);
+}
+
+int open_on_disk (spool_file_t *spool_file)
+{
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	char path[PATH_MAX + 1];
+
+	spool_file->in_memory = 0;
+
+	/* Create an unnamed file on the filesystem of the received directory,
+	 * it will get a name only when the message has been accepted.
+	 */
+	if (tmpfile_supported) {
+		spool_file->fd = open (server.received_directory, O_TMPFILE | O_RDWR | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (spool_file->fd != -1) {
+			spool_file->anonymous = 1;
+			return 0;
+		}
+
+		/* If the kernel or the filesystem doesn't support O_TMPFILE... */
+		if ((errno != EISDIR) && (errno != EOPNOTSUPP) && (errno != EINVAL)) {
+			return -1;
+		}
+
+		tmpfile_supported = 0;
+	}
+
+	/* Fall back to a named file in the incoming directory. */
+	snprintf (filename, sizeof (filename), "%s%s", spool_file->queue_id, MESSAGE_EXTENSION);
+	spool_directory_path (path, sizeof (path), server.incoming_directory, filename);
+
+	spool_file->fd = open (path, O_CREAT | O_EXCL | O_RDWR | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (spool_file->fd < 0) {
+		return -1;
+	}
+
+	spool_file->anonymous = 0;
+
+	return 0;
+}
+
+int spool_file_publish (spool_file_t *spool_file)
+{
+	if (spool_file->in_memory) {
+		/* Hand the file over to the delivery process... */
+		if (hand_over (spool_file) == 0) {
+			close (spool_file->fd);
+			spool_file->fd = -1;
+
+			/* The delivery process holds the pages now: the memory stays
+			 * used until it reports the message delivered.
+			 */
+			spool_file->in_memory = 0;
+			release_space (spool_file);
+
+			return 0;
+		}
+
+		/* or, if it cannot take it now, store it on disk. */
+		if (spill (spool_file) < 0) {
+			return -1;
+		}
+	}
+
+	return publish_on_disk (spool_file);
+}
+
+int link_on_disk (spool_file_t *spool_file)
+{
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	char oldpath[PATH_MAX + 1];
+	char newpath[PATH_MAX + 1];
+	off_t offset;
+	int ret;
+
+	offset = lseek (spool_file->fd, 0, SEEK_CUR);
+
+	/* Give back the preallocated blocks we haven't used. */
+	if ((spool_file->preallocated) && (offset != -1)) {
+		ftruncate (spool_file->fd, offset);
+	}
+
+	snprintf (filename, sizeof (filename), "%s%s", spool_file->queue_id, MESSAGE_EXTENSION);
+	spool_directory_path (newpath, sizeof (newpath), server.received_directory, filename);
+
+	if (spool_file->anonymous) {
+		/* Give a name to the file (linkat() with AT_EMPTY_PATH requires CAP_DAC_READ_SEARCH). */
+		snprintf (oldpath, sizeof (oldpath), "/proc/self/fd/%d", spool_file->fd);
+		ret = linkat (AT_FDCWD, oldpath, AT_FDCWD, newpath, AT_SYMLINK_FOLLOW);
+	} else {
+		/* Move file from incoming to received directory. */
+		spool_directory_path (oldpath, sizeof (oldpath), server.incoming_directory, filename);
+		ret = rename (oldpath, newpath);
+	}
+
+	if (ret < 0) {
+		spool_file_abort (spool_file);
+		return -1;
+	}
+
+	return 0;
+}
+
+void enqueue (spool_file_t *spool_file)
+{
+	close (spool_file->fd);
+	spool_file->fd = -1;
+	spool_file->preallocated = 0;
+
+	release_space (spool_file);
+
+	handoff_push (spool_file->queue_id);
+}
+
+int publish_on_disk (spool_file_t *spool_file)
+{
+	if (link_on_disk (spool_file) < 0) {
+		return -1;
+	}
+
+	/* Record it in the journal and queue it for the delivery process. */
+	journal_append (JOURNAL_ENQUEUE, JOURNAL_RECEIVED, spool_file->queue_id, 0, 0);
+
+	enqueue (spool_file);
+
+	return 0;
+}
+
+int spool_file_link (spool_file_t *spool_file)
+{
+	/* The delivery process may find the file before it is committed (scanning
+	 * the received directory): a worker cannot claim it while we hold the lock.
+	 */
+	if (flock (spool_file->fd, LOCK_EX) < 0) {
+		spool_file_abort (spool_file);
+		return -1;
+	}
+
+	if (link_on_disk (spool_file) < 0) {
+		return -1;
+	}
+
+	journal_append (JOURNAL_ENQUEUE, JOURNAL_RECEIVED, spool_file->queue_id, 0, 0);
+
+	return 0;
+}
+
+void spool_file_enqueue (spool_file_t *spool_file)
+{
+	/* Closing the file releases the lock. */
+	enqueue (spool_file);
+}
+
+void spool_file_unlink (spool_file_t *spool_file)
+{
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	char path[PATH_MAX + 1];
+
+	snprintf (filename, sizeof (filename), "%s%s", spool_file->queue_id, MESSAGE_EXTENSION);
+	spool_directory_path (path, sizeof (path), server.received_directory, filename);
+
+	/* Remove it while we hold the lock: a worker waiting for it sees st_nlink == 0. */
+	unlink (path);
+
+	journal_append (JOURNAL_DONE, JOURNAL_RECEIVED, spool_file->queue_id, 0, 0);
+
+	close (spool_file->fd);
+	spool_file->fd = -1;
+	spool_file->preallocated = 0;
+
+	release_space (spool_file);
+}
+
+void spool_file_abort (spool_file_t *spool_file)
+{
+	char filename[QUEUE_ID_MAXLEN + sizeof (MESSAGE_EXTENSION)];
+	char path[PATH_MAX + 1];
+
+	release_space (spool_file);
+
+	if (spool_file->fd == -1) {
+		return;
+	}
+
+	close (spool_file->fd);
+	spool_file->fd = -1;
+	spool_file->preallocated = 0;
+
+	/* An unnamed file (or an in-memory file) just vanishes. */
+	if (!spool_file->anonymous) {
+		snprintf (filename, sizeof (filename), "%s%s", spool_file->queue_id, MESSAGE_EXTENSION);
+		spool_directory_path (path, sizeof (path), server.incoming_directory, filename);
+		unlink (path);
+	}
+}
+
+int spool_file_reserve (spool_file_t *spool_file, size_t size)
+{
+	struct statvfs buf;
+
+	/* Refresh the free space at most once per second. */
+	if (statvfs_time != server.current_time) {
+		if (statvfs (server.received_directory, &buf) < 0) {
+			return -1;
+		}
+
+		available_space = buf.f_bavail * buf.f_frsize;
+		statvfs_time = server.current_time;
+	}
+
+	/* Would the transaction exhaust the disk? */
+	if (reserved_space + size + server.min_free_disk_space > available_space) {
+		return -1;
+	}
+
+	release_space (spool_file);
+
+	spool_file->reserved = size;
+	reserved_space += size;
+
+	return 0;
+}
+
+int spool_file_preallocate (spool_file_t *spool_file, size_t size)
+{
+	if (spool_file->in_memory) {
+		return 0;
+	}
+
+	/* Allocate the extents now, so that writing the message doesn't have to.
+	 * The file size doesn't change, only the blocks are reserved.
+	 */
+	if (fallocate (spool_file->fd, FALLOC_FL_KEEP_SIZE, 0, size + PREALLOCATION_SLACK) < 0) {
+		return -1;
+	}
+
+	spool_file->preallocated = 1;
+
+	return 0;
+}
+
+int spool_file_grow (spool_file_t *spool_file, size_t size)
+{
+	if ((spool_file->in_memory) && (size > server.memory_spool_message_size)) {
+		return spill (spool_file);
+	}
+
+	return 0;
+}
+
+int hand_over (spool_file_t *spool_file)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE (sizeof (int))];
+
+	/* The queue ID goes in the payload, the file descriptor as ancillary data. */
+	iov.iov_base = spool_file->queue_id;
+	iov.iov_len = strlen (spool_file->queue_id);
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+	memcpy (CMSG_DATA (cmsg), &spool_file->fd, sizeof (int));
+
+	/* The socket is non-blocking: if the delivery process is behind, we fail. */
+	if (sendmsg (server.delivery_socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != iov.iov_len) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int spill (spool_file_t *spool_file)
+{
+	int fd;
+	off_t offset;
+	off_t size;
+
+	fd = spool_file->fd;
+	size = lseek (fd, 0, SEEK_CUR);
+
+	/* Whatever happens, the in-memory file is gone. */
+	spool_file->in_memory = 0;
+	memory_used -= server.memory_spool_message_size;
+
+	if ((size < 0) || (open_on_disk (spool_file) < 0)) {
+		close (fd);
+		spool_file->fd = -1;
+		return -1;
+	}
+
+	/* Copy what we have received so far. */
+	offset = 0;
+	while (offset < size) {
+		if (sendfile (spool_file->fd, fd, &offset, size - offset) <= 0) {
+			close (fd);
+			spool_file_abort (spool_file);
+			return -1;
+		}
+	}
+
+	close (fd);
+
+	return 0;
+}
+
+void release_space (spool_file_t *spool_file)
+{
+	reserved_space -= spool_file->reserved;
+	spool_file->reserved = 0;
+
+	if (spool_file->in_memory) {
+		memory_used -= server.memory_spool_message_size;
+		spool_file->in_memory = 0;
+	}
+}
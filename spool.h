@@ -0,0 +1,38 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "queue_id.h"
+
+typedef struct {
+	int fd;        /* File descriptor. */
+	int anonymous; /* Created with O_TMPFILE (it has no name yet)? */
+	int in_memory; /* Created with memfd_create() (handed over to the delivery process)? */
+	int preallocated;
+
+	size_t reserved; /* Disk space reserved for the message. */
+
+	char queue_id[QUEUE_ID_MAXLEN + 1];
+} spool_file_t;
+
+void spool_file_init (spool_file_t *spool_file);
+
+/* "size" is the size announced by the client (0 if unknown). */
+int spool_file_open (spool_file_t *spool_file, size_t size);
+int spool_file_publish (spool_file_t *spool_file);
+void spool_file_abort (spool_file_t *spool_file);
+
+/* Group commit: the file is named (and locked) first, then queued for the
+ * delivery process once the directory and the journal are on disk, or
+ * removed if they couldn't be flushed. Not for in-memory files.
+ */
+int spool_file_link (spool_file_t *spool_file);
+void spool_file_enqueue (spool_file_t *spool_file);
+void spool_file_unlink (spool_file_t *spool_file);
+
+/* Make sure that the file can hold "size" bytes (spill in-memory files to disk). */
+int spool_file_grow (spool_file_t *spool_file, size_t size);
+
+int spool_file_reserve (spool_file_t *spool_file, size_t size);
+int spool_file_preallocate (spool_file_t *spool_file, size_t size);
+
+#endif /* SPOOL_H */
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "spool_directory.h"
+
+#define MESSAGE_EXTENSION ".eml"
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+unsigned spool_directory_shard (const char *filename)
+{
+	uint32_t hash;
+
+	/* FNV-1a of the queue ID (the sequence is in the last characters). */
+	hash = 2166136261u;
+	while ((*filename) && (*filename != '.')) {
+		hash ^= (unsigned char) *filename++;
+		hash *= 16777619u;
+	}
+
+	return hash & (SPOOL_SHARDS - 1);
+}
+
+void spool_directory_path (char *path, size_t size, const char *directory, const char *filename)
+{
+	snprintf (path, size, "%s/%02x/%s", directory, spool_directory_shard (filename), filename);
+}
+
+int spool_directory_create (const char *directory)
+{
+	char path[PATH_MAX + 1];
+	unsigned i;
+
+	for (i = 0; i < SPOOL_SHARDS; i++) {
+		snprintf (path, sizeof (path), "%s/%02x", directory, i);
+		if ((mkdir (path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0) && (errno != EEXIST)) {
+			fprintf (stderr, "Couldn't create spool directory %s.\n", path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int spool_directory_sync (const char *directory, uint64_t shards)
+{
+	char path[PATH_MAX + 1];
+	unsigned i;
+	int ret;
+	int fd;
+
+	ret = 0;
+
+	for (i = 0; (i < SPOOL_SHARDS) && (shards); i++, shards >>= 1) {
+		if (!(shards & 1)) {
+			continue;
+		}
+
+		snprintf (path, sizeof (path), "%s/%02x", directory, i);
+		if ((fd = open (path, O_RDONLY | O_DIRECTORY)) < 0) {
+			ret = -1;
+			continue;
+		}
+
+		if (fsync (fd) < 0) {
+			ret = -1;
+		}
+
+		close (fd);
+	}
+
+	return ret;
+}
+
+int spool_directory_migrate (const char *directory)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char name[NAME_MAX + 4];
+	uint64_t shards;
+	size_t len;
+	int error;
+	int fd;
+	int n;
+
+	if ((dir = opendir (directory)) == NULL) {
+		return -1;
+	}
+
+	fd = dirfd (dir);
+
+	n = 0;
+	error = 0;
+	shards = 0;
+
+	while ((entry = readdir (dir)) != NULL) {
+		/* Skip hidden files and whatever is not a regular file (the shards). */
+		if ((entry->d_name[0] == '.') || ((entry->d_type != DT_REG) && (entry->d_type != DT_UNKNOWN))) {
+			continue;
+		}
+
+		/* If not a message... */
+		len = strlen (entry->d_name);
+		if ((len < sizeof (MESSAGE_EXTENSION)) || (memcmp (entry->d_name + len - (sizeof (MESSAGE_EXTENSION) - 1), MESSAGE_EXTENSION, sizeof (MESSAGE_EXTENSION) - 1) != 0)) {
+			continue;
+		}
+
+		snprintf (name, sizeof (name), "%02x/%s", spool_directory_shard (entry->d_name), entry->d_name);
+
+		if (renameat (fd, entry->d_name, fd, name) < 0) {
+			fprintf (stderr, "Couldn't move %s/%s to its shard.\n", directory, entry->d_name);
+			error = 1;
+			continue;
+		}
+
+		shards |= (uint64_t) 1 << spool_directory_shard (entry->d_name);
+		n++;
+	}
+
+	/* Flush both sides of the renames. */
+	if ((shards) && (fsync (fd) < 0)) {
+		error = 1;
+	}
+
+	closedir (dir);
+
+	if ((spool_directory_sync (directory, shards) < 0) || (error)) {
+		return -1;
+	}
+
+	return n;
+}
+
+int spool_scan_init (spool_scan_t *scan, const char *directory)
+{
+	scan->directory = directory;
+
+	scan->shard = 0;
+	scan->remaining = 0;
+	scan->fd = -1;
+
+	scan->offset = 0;
+	scan->used = 0;
+
+	scan->buffer = (char *) malloc (SPOOL_SCAN_BUFFER_SIZE);
+	if (!scan->buffer) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void spool_scan_free (spool_scan_t *scan)
+{
+	if (scan->fd != -1) {
+		close (scan->fd);
+		scan->fd = -1;
+	}
+
+	if (scan->buffer) {
+		free (scan->buffer);
+		scan->buffer = NULL;
+	}
+}
+
+void spool_scan_start (spool_scan_t *scan)
+{
+	/* If we are in the middle of a shard, its beginning will be
+	 * scanned when we come back to it.
+	 */
+	scan->remaining = SPOOL_SHARDS;
+}
+
+const char *spool_scan_next (spool_scan_t *scan)
+{
+	struct linux_dirent64 *entry;
+	char path[PATH_MAX + 1];
+	size_t len;
+	long n;
+
+	do {
+		/* Entries left from the last batch? */
+		while (scan->offset < scan->used) {
+			entry = (struct linux_dirent64 *) (scan->buffer + scan->offset);
+			scan->offset += entry->d_reclen;
+
+			/* Skip hidden files and whatever is not a regular file. */
+			if ((entry->d_name[0] == '.') || ((entry->d_type != DT_REG) && (entry->d_type != DT_UNKNOWN))) {
+				continue;
+			}
+
+			/* If not a message... */
+			len = strlen (entry->d_name);
+			if ((len < sizeof (MESSAGE_EXTENSION)) || (memcmp (entry->d_name + len - (sizeof (MESSAGE_EXTENSION) - 1), MESSAGE_EXTENSION, sizeof (MESSAGE_EXTENSION) - 1) != 0)) {
+				continue;
+			}
+
+			return entry->d_name;
+		}
+
+		/* Open the next shard. */
+		if (scan->fd == -1) {
+			if (scan->remaining == 0) {
+				return NULL;
+			}
+
+			scan->remaining--;
+
+			snprintf (path, sizeof (path), "%s/%02x", scan->directory, scan->shard);
+			if ((scan->fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+				scan->shard = (scan->shard + 1) & (SPOOL_SHARDS - 1);
+				continue;
+			}
+		}
+
+		/* Read a batch of entries. */
+		scan->offset = 0;
+		scan->used = 0;
+
+		if ((n = syscall (SYS_getdents64, scan->fd, scan->buffer, SPOOL_SCAN_BUFFER_SIZE)) > 0) {
+			scan->used = n;
+			continue;
+		}
+
+		/* End of the shard (or error). */
+		close (scan->fd);
+		scan->fd = -1;
+
+		scan->shard = (scan->shard + 1) & (SPOOL_SHARDS - 1);
+	} while (1);
+}
@@ -0,0 +1,51 @@
+#ifndef SPOOL_DIRECTORY_H
+#define SPOOL_DIRECTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The spool directories (incoming, received, relay and error) are split in
+ * SPOOL_SHARDS subdirectories ("00", "01", ...), the shard of a message is a
+ * hash of its queue ID. Sets of shards are kept in 64-bit masks.
+ */
+
+#define SPOOL_SHARDS           64 /* Power of 2, at most 64. */
+#define SPOOL_SCAN_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+	const char *directory;
+
+	unsigned shard; /* Shard being scanned. */
+	unsigned remaining; /* Shards to open before the end of the pass. */
+	int fd;
+
+	char *buffer; /* Directory entries returned by getdents64(). */
+	size_t offset;
+	size_t used;
+} spool_scan_t;
+
+/* "filename" is "<queue ID>[.<extension>]". */
+unsigned spool_directory_shard (const char *filename);
+void spool_directory_path (char *path, size_t size, const char *directory, const char *filename);
+
+int spool_directory_create (const char *directory);
+
+/* Move the messages left at the top of the directory by the versions without
+ * shards into their shards. Number of messages moved, -1 on error.
+ */
+int spool_directory_migrate (const char *directory);
+
+/* Flush the directory entries of the shards in the mask. */
+int spool_directory_sync (const char *directory, uint64_t shards);
+
+/* Scanning is incremental: the scan resumes where the previous one stopped. */
+int spool_scan_init (spool_scan_t *scan, const char *directory);
+void spool_scan_free (spool_scan_t *scan);
+
+/* Start a pass over all the shards (from the current position). */
+void spool_scan_start (spool_scan_t *scan);
+
+/* Next message file name (NULL at the end of the pass). */
+const char *spool_scan_next (spool_scan_t *scan);
+
+#endif /* SPOOL_DIRECTORY_H */